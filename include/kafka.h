@@ -51,11 +51,118 @@
 #define KAFKA_TOPICS_INIT_ERROR              16
 #define KAFKA_TOPICS_PARTITIONS_INIT_ERROR   17
 #define KAFKA_METADATA_ERROR                 18
+#define KAFKA_BUFFER_FULL                    19
+#define KAFKA_MESSAGE_DROPPED                20
+#define KAFKA_MESSAGE_SPOOLED                21
 
 
 #define KAFKA_REQUEST_ASYNC      0
 #define KAFKA_REQUEST_SYNC       1
 #define KAFKA_REQUEST_FULL_SYNC -1
+/* use the producer's configured acks */
+#define KAFKA_REQUEST_DEFAULT   -2
+
+/* what a send does when the producer's byte budget is used up */
+#define KAFKA_BUFFER_FULL_BLOCK        0
+#define KAFKA_BUFFER_FULL_FAIL         1
+#define KAFKA_BUFFER_FULL_DROP_OLDEST  2
+
+/* errors are counted per status code below this */
+#define KAFKA_STATS_ERRORS 32
+
+/* histograms for kafka_producer_percentile() */
+#define KAFKA_HISTOGRAM_RTT         0	/* produce request round trip, us */
+#define KAFKA_HISTOGRAM_LATENCY     1	/* send to ack, per message, us */
+#define KAFKA_HISTOGRAM_BATCH_SIZE  2	/* messages per produce request */
+#define KAFKA_HISTOGRAMS            3
+
+/* producer stages reported to trace_cb */
+#define KAFKA_TRACE_ROUTE      0	/* messages sorted by leader */
+#define KAFKA_TRACE_SERIALIZE  1	/* one produce request */
+#define KAFKA_TRACE_WRITE      2
+#define KAFKA_TRACE_READ       3	/* waiting for and reading the response */
+#define KAFKA_TRACE_PARSE      4
+
+struct kafka_trace_event {
+	int stage;			/* KAFKA_TRACE_* */
+	int done;			/* 0 as the stage starts, 1 once it ends */
+	int32_t correlation_id;		/* -1 outside of a request */
+	int32_t broker_id;		/* -1 outside of a request */
+	size_t bytes;
+	int64_t time_us;		/* CLOCK_MONOTONIC */
+};
+
+/**
+ * Producer settings. Always fill this in with kafka_producer_config_init()
+ * first and change only what is needed.
+ */
+struct kafka_producer_config {
+	const char *zookeeper;		/* NULL means localhost:2181 */
+	const char *brokers;		/* "host:port,..." to use instead */
+	size_t max_buffered_bytes;	/* 0 means unlimited */
+	int buffer_full_policy;		/* KAFKA_BUFFER_FULL_* */
+	int buffer_full_timeout_ms;	/* how long to block, -1 for ever */
+	const char *spool_path;		/* spool file, NULL for no spool */
+	size_t spool_max_bytes;		/* largest the spool file grows */
+	/**
+	 * Write-ahead log file, NULL for none. Sent messages are logged and
+	 * synced to it, and the send returns then. They are delivered from
+	 * the log with acks, even for KAFKA_REQUEST_ASYNC, and replayed from
+	 * it, here or after a restart, until acked. Sends fail with
+	 * KAFKA_BUFFER_FULL while the log is full.
+	 */
+	const char *wal_path;
+	size_t wal_max_bytes;		/* largest the log file grows */
+	int max_retries;		/* per partition, on retryable errors */
+	int retry_backoff_ms;		/* first backoff, doubled per retry */
+	int retry_backoff_max_ms;
+	int acks;			/* KAFKA_REQUEST_* for KAFKA_REQUEST_DEFAULT */
+	int request_timeout_ms;		/* how long brokers may wait for acks */
+	int socket_timeout_ms;		/* client side, per request, -1 for none */
+	int reconnect_backoff_ms;	/* after repeated connection failures */
+	int reconnect_backoff_max_ms;
+	int connect_timeout_ms;		/* -1 for none */
+	int dns_ttl_ms;			/* how long resolved addresses are reused */
+	int dns_negative_ttl_ms;	/* and failed lookups */
+	int dns_async;			/* re-resolve expired hosts in the background */
+	int tcp_nodelay;		/* disable Nagle, on by default */
+	int socket_send_buffer;		/* SO_SNDBUF bytes, 0 for the OS default */
+	int socket_receive_buffer;	/* SO_RCVBUF bytes, 0 for the OS default */
+	int socket_keepalive_ms;	/* idle time before probing, 0 for off */
+	int socket_busy_poll_us;	/* SO_BUSY_POLL, 0 for off */
+	int tcp_user_timeout_ms;	/* TCP_USER_TIMEOUT, 0 for the OS default */
+	int stats_interval_ms;		/* how often stats_cb is called */
+	/* gets kafka_producer_stats_json() output, on the sender thread */
+	void (*stats_cb)(const char *json, void *opaque);
+	void *stats_opaque;
+	/* called on the sender thread, only if built with --enable-tracing */
+	void (*trace_cb)(const struct kafka_trace_event *event, void *opaque);
+	void *trace_opaque;
+};
+
+/**
+ * Producer totals since it was created, except for queued_messages,
+ * inflight_requests and buffered_bytes which are current values.
+ */
+struct kafka_producer_stats {
+	uint64_t messages;		/* handed to the producer */
+	uint64_t bytes;
+	uint64_t messages_acked;
+	uint64_t messages_sent;		/* with KAFKA_REQUEST_ASYNC, never acked */
+	uint64_t messages_failed;
+	uint64_t messages_spooled;	/* then replayed from the spool */
+	uint64_t messages_replayed;	/* acked from the write-ahead log */
+	uint64_t queued_messages;	/* neither sent nor failed yet */
+	uint64_t requests;
+	uint64_t request_bytes;
+	uint64_t response_bytes;
+	uint64_t inflight_requests;
+	uint64_t retries;		/* messages sent again */
+	uint64_t errors[KAFKA_STATS_ERRORS];	/* by status code */
+	size_t buffered_bytes;
+	size_t spooled_bytes;
+	size_t wal_bytes;		/* not yet acked */
+};
 
 struct kafka_producer;
 struct kafka_message;
@@ -67,13 +174,27 @@ struct metadata_response;
 const char *kafka_status_string(int status);
 
 /* producer/producer.c */
+void kafka_producer_config_init(struct kafka_producer_config *config);
 struct kafka_producer *kafka_producer_new(const char *zkServer);
+struct kafka_producer *kafka_producer_new_with_config(
+			const struct kafka_producer_config *config);
 void kafka_producer_free(struct kafka_producer *p);
+/* messages are only read, and may be in several sends at once */
 int kafka_producer_send(struct kafka_producer *p, struct kafka_message *msg,
 			int16_t sync);
 int kafka_producer_send_batch(struct kafka_producer *p, struct kafka_message_set *set,
 			int16_t sync);
+int kafka_producer_send_sealed(struct kafka_producer *p, const char *topic,
+			struct kafka_message_set *set, int16_t sync);
 int kafka_producer_status(struct kafka_producer *p);
+size_t kafka_producer_buffered_bytes(struct kafka_producer *p);
+
+/* producer/stats.c */
+void kafka_producer_stats(struct kafka_producer *p,
+			struct kafka_producer_stats *stats);
+char *kafka_producer_stats_json(struct kafka_producer *p);
+uint64_t kafka_producer_percentile(struct kafka_producer *p, int histogram,
+			double percentile);
 
 /* message.c */
 struct kafka_message *kafka_message_new(const char *topic, const char *value);
@@ -86,6 +207,7 @@ struct kafka_message_set *kafka_message_set_new(void);
 void kafka_message_set_free(struct kafka_message_set *set);
 size_t kafka_message_set_append(struct kafka_message_set *set,
 				struct kafka_message *msg);
+int kafka_message_set_seal(struct kafka_message_set *set);
 
 /* metadata/metadata_request.c */
 struct metadata_request *metadata_request_new(const char **topics, const char *client);
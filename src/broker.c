@@ -25,9 +25,16 @@
  */
 
 #include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
@@ -47,48 +54,218 @@ nonblocking(int fd)
 }
 
 int
-blocking(fd)
+blocking(int fd)
 {
 	int flags;
 	flags = fcntl(fd, F_GETFL);
-	if (flags < 0 || fcntl(fd, F_SETFL, flags | ~O_NONBLOCK) < 0)
+	if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0)
 		return -1;
 	return 0;
 }
 
-static unsigned long
-gethostaddress(const struct hostent *h)
+void
+connect_attempt_init(connect_attempt_t *a, resolver_t *resolver,
+	const socket_options_t *opts, const char *hostname, int32_t port)
 {
 	/**
-	 * returns host address in network byte order
+	 * Takes the addresses from the resolver cache if there is one. An
+	 * attempt that cannot be resolved has nothing to try and fails in
+	 * connect_attempts_run().
 	 */
-	struct in_addr **list;
-	list = (struct in_addr **)h->h_addr_list;
-	return inet_addr(inet_ntoa(*list[0]));
+	unsigned u;
+	memset(a, 0, sizeof *a);
+	a->opts = opts;
+	a->fd = -1;
+	if (resolver)
+		resolver_lookup(resolver, hostname, &a->addrs);
+	else
+		resolve_host(hostname, &a->addrs);
+
+	for (u = 0; u < a->addrs.n; u++) {
+		struct sockaddr *sa = (struct sockaddr *)&a->addrs.addr[u];
+		if (sa->sa_family == AF_INET)
+			((struct sockaddr_in *)sa)->sin_port = htons(port);
+		else if (sa->sa_family == AF_INET6)
+			((struct sockaddr_in6 *)sa)->sin6_port = htons(port);
+	}
+}
+
+void
+connect_attempt_destroy(connect_attempt_t *a)
+{
+	/* closes whatever did not win; the winning fd is the caller's */
+	unsigned u;
+	for (u = 0; u < a->nfds; u++)
+		close(a->fds[u]);
+	a->nfds = 0;
+}
+
+static void
+socket_options_apply(int fd, const socket_options_t *o)
+{
+	/**
+	 * Best effort: an option the kernel refuses leaves the socket as it
+	 * was rather than failing the connection. Buffer sizes have to be
+	 * set before connecting for the window scale to account for them.
+	 */
+	int on = 1;
+	if (o->nodelay)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+	if (o->sndbuf > 0)
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &o->sndbuf, sizeof o->sndbuf);
+	if (o->rcvbuf > 0)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &o->rcvbuf, sizeof o->rcvbuf);
+	if (o->keepalive_ms > 0) {
+		setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof on);
+#ifdef TCP_KEEPIDLE
+		{
+			int secs = o->keepalive_ms < 1000 ? 1 : o->keepalive_ms / 1000;
+			setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &secs, sizeof secs);
+			setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &secs, sizeof secs);
+		}
+#endif
+	}
+#ifdef SO_BUSY_POLL
+	if (o->busy_poll_us > 0)
+		setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &o->busy_poll_us,
+			sizeof o->busy_poll_us);
+#endif
+#ifdef TCP_USER_TIMEOUT
+	if (o->user_timeout_ms > 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &o->user_timeout_ms,
+			sizeof o->user_timeout_ms);
+#endif
+}
+
+static void
+connect_attempt_start(connect_attempt_t *a, int64_t now)
+{
+	/**
+	 * Starts connecting to the next address. An address that fails
+	 * right away is skipped without waiting.
+	 */
+	while (a->next < a->addrs.n) {
+		unsigned u = a->next++;
+		struct sockaddr *sa = (struct sockaddr *)&a->addrs.addr[u];
+		int fd = socket(sa->sa_family, SOCK_STREAM, 0);
+		if (fd == -1)
+			continue;
+		if (a->opts)
+			socket_options_apply(fd, a->opts);
+		/* all I/O on broker sockets goes through io.c with deadlines */
+		if (nonblocking(fd) == -1) {
+			close(fd);
+			continue;
+		}
+		if (connect(fd, sa, a->addrs.len[u]) == 0) {
+			a->fd = fd;
+			return;
+		}
+		if (errno != EINPROGRESS) {
+			close(fd);
+			continue;
+		}
+		a->fds[a->nfds++] = fd;
+		a->next_at = now + CONNECT_ATTEMPT_DELAY_MS;
+		return;
+	}
+}
+
+static void
+connect_attempt_drop(connect_attempt_t *a, unsigned idx)
+{
+	a->fds[idx] = a->fds[--a->nfds];
+}
+
+void
+connect_attempts_run(connect_attempt_t *attempts, unsigned n, int64_t deadline)
+{
+	/**
+	 * Drives any number of connection attempts at once until each has
+	 * a connected socket or has run out of addresses, or the deadline
+	 * passes. Each attempt starts on its next address whenever the
+	 * current ones have been pending for CONNECT_ATTEMPT_DELAY_MS, and
+	 * keeps the earlier ones going; the first to connect wins.
+	 */
+	unsigned i, j, npfd;
+	struct pollfd *pfds;
+	unsigned *owner;
+
+	pfds = malloc(n * CONNECT_MAX_ADDRS * sizeof *pfds);
+	owner = malloc(n * CONNECT_MAX_ADDRS * sizeof *owner);
+	for (;;) {
+		int64_t now = monotonic_ms();
+		int64_t wake = deadline;
+		int rc, timeout;
+
+		npfd = 0;
+		for (i = 0; i < n; i++) {
+			connect_attempt_t *a = &attempts[i];
+			if (a->fd != -1)
+				continue;
+			if (a->nfds == 0 || now >= a->next_at)
+				connect_attempt_start(a, now);
+			if (a->fd != -1)
+				continue;
+			if (a->next < a->addrs.n && (wake == -1 || a->next_at < wake))
+				wake = a->next_at;
+			for (j = 0; j < a->nfds; j++) {
+				pfds[npfd].fd = a->fds[j];
+				pfds[npfd].events = POLLOUT;
+				pfds[npfd].revents = 0;
+				owner[npfd++] = i;
+			}
+		}
+		if (npfd == 0)
+			break;
+		if (deadline != -1 && now >= deadline)
+			break;
+
+		timeout = -1;
+		if (wake != -1)
+			timeout = wake > now ? (int)(wake - now) : 0;
+		rc = poll(pfds, npfd, timeout);
+		if (rc == -1 && errno != EINTR)
+			break;
+		if (rc <= 0)
+			continue;
+
+		for (j = 0; j < npfd; j++) {
+			connect_attempt_t *a = &attempts[owner[j]];
+			int err = 0;
+			socklen_t len = sizeof err;
+			unsigned k;
+			if (!pfds[j].revents || a->fd != -1)
+				continue;
+			for (k = 0; k < a->nfds && a->fds[k] != pfds[j].fd; k++)
+				;
+			if (getsockopt(pfds[j].fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+				err = errno;
+			connect_attempt_drop(a, k);
+			if (err == 0) {
+				a->fd = pfds[j].fd;
+			} else {
+				close(pfds[j].fd);
+				if (a->nfds == 0)
+					a->next_at = now;	/* next address right away */
+			}
+		}
+	}
+	free(pfds);
+	free(owner);
 }
 
 int
-broker_connect(broker_t *broker)
+broker_connect(const char *hostname, int32_t port, int timeout_ms)
 {
+	/**
+	 * Returns a connected, non-blocking socket or -1.
+	 */
 	int fd;
-	unsigned slen;
-	unsigned long hostaddr;
-	struct sockaddr_in sin;
-	struct hostent *he;
-	he = gethostbyname(broker->hostname);
-	if (!he)
-		return -1;
-	hostaddr = gethostaddress(he);
-	slen = sizeof sin;
-	memset(&sin, 0, slen);
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(broker->port);
-	sin.sin_addr.s_addr = hostaddr;
-	fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (fd == -1)
-		return -1;
-	if (connect(fd, (struct sockaddr *)&sin, slen) == -1)
-		return -1;
-	broker->fd = fd;
+	connect_attempt_t a;
+	connect_attempt_init(&a, NULL, NULL, hostname, port);
+	connect_attempts_run(&a, 1, io_deadline(timeout_ms));
+	fd = a.fd;
+	connect_attempt_destroy(&a);
 	return fd;
 }
@@ -71,6 +71,10 @@ KafkaBufferReserve(KafkaBuffer *buffer, size_t size)
 size_t
 KafkaBufferResize(KafkaBuffer *buffer)
 {
+	/**
+	 * Contents past cur are always written before they are read, so the
+	 * new tail is left uninitialized.
+	 */
 	size_t sz, curOffset;
 	uint8_t *ptr;
 	sz = buffer->alloced * 2;
@@ -79,7 +83,99 @@ KafkaBufferResize(KafkaBuffer *buffer)
 	assert(ptr);
 	buffer->data = ptr;
 	buffer->cur = &buffer->data[curOffset];
-	memset(&buffer->data[buffer->alloced], 0, buffer->alloced);
 	buffer->alloced = sz;
 	return sz;
 }
+
+static unsigned
+size_class_ceil(size_t size)
+{
+	unsigned c = 0;
+	while (c < KAFKA_BUFFER_POOL_CLASSES &&
+		((size_t)1 << (c + KAFKA_BUFFER_POOL_MIN_SHIFT)) < size)
+		c++;
+	return c;
+}
+
+static unsigned
+size_class_floor(size_t size)
+{
+	unsigned c = 0;
+	while (c + 1 < KAFKA_BUFFER_POOL_CLASSES &&
+		((size_t)1 << (c + 1 + KAFKA_BUFFER_POOL_MIN_SHIFT)) <= size)
+		c++;
+	return c;
+}
+
+KafkaBufferPool *
+KafkaBufferPoolNew(void)
+{
+	return calloc(1, sizeof(KafkaBufferPool));
+}
+
+void
+KafkaBufferPoolFree(KafkaBufferPool *pool)
+{
+	unsigned c;
+	KafkaBuffer *buffer;
+	if (!pool)
+		return;
+	for (c = 0; c < KAFKA_BUFFER_POOL_CLASSES; c++) {
+		while ((buffer = pool->free[c]) != NULL) {
+			pool->free[c] = buffer->next;
+			KafkaBufferFree(buffer);
+		}
+	}
+	free(pool);
+}
+
+KafkaBuffer *
+KafkaBufferPoolGet(KafkaBufferPool *pool, size_t size)
+{
+	/**
+	 * Hands out a buffer with at least size bytes of capacity. Recycled
+	 * buffers keep whatever capacity they grew to and are not zeroed.
+	 * Requests bigger than the largest size class bypass the pool.
+	 */
+	unsigned c, first;
+	KafkaBuffer *buffer = NULL;
+	first = size_class_ceil(size);
+	for (c = first; c < KAFKA_BUFFER_POOL_CLASSES; c++) {
+		if (pool->free[c]) {
+			buffer = pool->free[c];
+			pool->free[c] = buffer->next;
+			pool->count[c]--;
+			break;
+		}
+	}
+	if (!buffer) {
+		buffer = calloc(1, sizeof *buffer);
+		if (first < KAFKA_BUFFER_POOL_CLASSES)
+			buffer->alloced = (size_t)1 << (first + KAFKA_BUFFER_POOL_MIN_SHIFT);
+		else
+			buffer->alloced = size;
+		buffer->data = malloc(buffer->alloced);
+		assert(buffer->data);
+	}
+	buffer->next = NULL;
+	buffer->len = 0;
+	buffer->cur = buffer->data;
+	return buffer;
+}
+
+void
+KafkaBufferPoolPut(KafkaBufferPool *pool, KafkaBuffer *buffer)
+{
+	unsigned c;
+	if (!buffer)
+		return;
+	c = size_class_floor(buffer->alloced);
+	if (buffer->alloced > KAFKA_BUFFER_POOL_MAX_SIZE ||
+		pool->count[c] >= KAFKA_BUFFER_POOL_DEPTH) {
+		KafkaBufferFree(buffer);
+		return;
+	}
+	buffer->next = pool->free[c];
+	pool->free[c] = buffer;
+	pool->count[c]++;
+}
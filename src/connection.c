@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+
+#include <kafka.h>
+#include "kafka-private.h"
+
+/**
+ * Broker connections, kept apart from metadata so they survive refreshes.
+ * A connection is opened lazily the first time it is needed, and any
+ * number of them can be opened in parallel with conn_pool_connect(). The
+ * first failure of an established connection only marks it failed, and
+ * the next use reconnects straight away, since that is usually a broker
+ * closing an idle socket. Failed connects and further failures in a row
+ * put it in backoff, doubling up to the configured maximum, and it is not
+ * retried until that is over.
+ *
+ * Connections are found by broker id, and by host:port so a broker that
+ * comes back under a new id keeps its connection.
+ */
+
+static char *
+conn_addr(const char *host, int32_t port, size_t *len)
+{
+	char *addr = string_builder("%s:%d", host, port);
+	*len = strlen(addr);
+	return addr;
+}
+
+conn_pool_t *
+conn_pool_new(int backoff_ms, int backoff_max_ms, int connect_timeout_ms,
+	resolver_t *resolver, const socket_options_t *sockopts)
+{
+	conn_pool_t *pool;
+	pool = calloc(1, sizeof *pool);
+	if (!pool)
+		return NULL;
+	pool->by_id = map_new_int32(0, NULL);
+	pool->by_addr = map_new_string(0, free, NULL);
+	pool->backoff_ms = backoff_ms;
+	pool->backoff_max_ms = backoff_max_ms;
+	pool->connect_timeout_ms = connect_timeout_ms;
+	pool->resolver = resolver;
+	pool->sockopts = *sockopts;
+	pool->seed = (unsigned)time(0);
+	return pool;
+}
+
+void
+conn_pool_free(conn_pool_t *pool)
+{
+	void *i;
+	if (!pool)
+		return;
+	i = map_iter(pool->by_addr);
+	for (; i; i = map_iter_next(pool->by_addr, i)) {
+		broker_conn_t *conn = map_iter_value(i);
+		if (conn->fd != -1)
+			close(conn->fd);
+		free(conn->host);
+		free(conn);
+	}
+	map_free(pool->by_addr);
+	map_free(pool->by_id);
+	free(pool);
+}
+
+static void
+conn_close(broker_conn_t *conn)
+{
+	if (conn->fd != -1) {
+		close(conn->fd);
+		conn->fd = -1;
+	}
+}
+
+broker_conn_t *
+conn_pool_get(conn_pool_t *pool, int32_t id, const char *host, int32_t port)
+{
+	/**
+	 * Returns the connection for broker id at host:port, creating it (not
+	 * connected) if there is none. A broker that moved to a new address
+	 * is reconnected there.
+	 */
+	size_t len;
+	char *addr;
+	broker_conn_t *conn;
+
+	conn = map_get_int32(pool->by_id, id);
+	if (conn && conn->port == port && strcmp(conn->host, host) == 0)
+		return conn;
+
+	addr = conn_addr(host, port, &len);
+	if (conn) {
+		/* same id, new address */
+		broker_conn_t *other = map_get_string(pool->by_addr, addr, len);
+		char *old = conn_addr(conn->host, conn->port, &len);
+		if (other) {
+			/* whoever had the address before is gone */
+			map_del_string(pool->by_addr, addr, strlen(addr));
+			if (map_get_int32(pool->by_id, other->id) == other)
+				map_del_int32(pool->by_id, other->id);
+			conn_close(other);
+			free(other->host);
+			free(other);
+		}
+		map_del_string(pool->by_addr, old, strlen(old));
+		free(old);
+		conn_close(conn);
+		conn->state = CONN_DOWN;
+		conn->failures = 0;
+		free(conn->host);
+		conn->host = strdup(host);
+		conn->port = port;
+		map_set_string(pool->by_addr, addr, strlen(addr), conn);
+		return conn;
+	}
+
+	len = strlen(addr);
+	conn = map_get_string(pool->by_addr, addr, len);
+	if (conn) {
+		/* same address, new id */
+		free(addr);
+		if (map_get_int32(pool->by_id, conn->id) == conn)
+			map_del_int32(pool->by_id, conn->id);
+		conn->id = id;
+		map_set_int32(pool->by_id, id, conn);
+		return conn;
+	}
+
+	conn = calloc(1, sizeof *conn);
+	conn->id = id;
+	conn->host = strdup(host);
+	conn->port = port;
+	conn->fd = -1;
+	conn->state = CONN_DOWN;
+	map_set_string(pool->by_addr, addr, len, conn);
+	map_set_int32(pool->by_id, id, conn);
+	return conn;
+}
+
+static int
+conn_may_connect(broker_conn_t *conn, int64_t now)
+{
+	if (conn->state == CONN_READY || conn->state == CONN_CONNECTING)
+		return 0;
+	return conn->state != CONN_BACKOFF || now >= conn->retry_at;
+}
+
+void
+conn_pool_connect(conn_pool_t *pool, broker_conn_t **conns, unsigned n,
+		int64_t now)
+{
+	/**
+	 * Connects every connection in conns that is not ready and not
+	 * backing off, all at once, within one connect timeout.
+	 */
+	unsigned u, m = 0;
+	connect_attempt_t *attempts;
+	broker_conn_t **pending;
+
+	attempts = malloc(n * sizeof *attempts);
+	pending = malloc(n * sizeof *pending);
+	for (u = 0; u < n; u++) {
+		unsigned v;
+		if (!conn_may_connect(conns[u], now))
+			continue;
+		/* the same broker may be listed twice */
+		for (v = 0; v < m && pending[v] != conns[u]; v++)
+			;
+		if (v < m)
+			continue;
+		conns[u]->state = CONN_CONNECTING;
+		connect_attempt_init(&attempts[m], pool->resolver, &pool->sockopts,
+				conns[u]->host, conns[u]->port);
+		pending[m++] = conns[u];
+	}
+
+	if (m)
+		connect_attempts_run(attempts, m,
+				io_deadline(pool->connect_timeout_ms));
+
+	for (u = 0; u < m; u++) {
+		broker_conn_t *conn = pending[u];
+		conn->fd = attempts[u].fd;
+		connect_attempt_destroy(&attempts[u]);
+		if (conn->fd == -1)
+			conn_failed(pool, conn, monotonic_ms());
+		else
+			conn->state = CONN_READY;
+	}
+	free(attempts);
+	free(pending);
+}
+
+int
+conn_fd(conn_pool_t *pool, broker_conn_t *conn, int64_t now)
+{
+	/**
+	 * Returns a connected socket, connecting first if needed, or -1 if
+	 * that fails or the connection is still backing off.
+	 */
+	if (conn->state != CONN_READY)
+		conn_pool_connect(pool, &conn, 1, now);
+	if (conn->state != CONN_READY) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return conn->fd;
+}
+
+void
+conn_ok(broker_conn_t *conn)
+{
+	/* a full exchange went through */
+	conn->failures = 0;
+}
+
+void
+conn_failed(conn_pool_t *pool, broker_conn_t *conn, int64_t now)
+{
+	/**
+	 * Closes the socket, whose state is unknown after a failed exchange,
+	 * and works out when it may be reconnected.
+	 */
+	int64_t d;
+	unsigned u;
+	int established = conn->state == CONN_READY;
+
+	conn_close(conn);
+	conn->failures++;
+	if (established && conn->failures == 1) {
+		conn->state = CONN_FAILED;
+		return;
+	}
+
+	d = pool->backoff_ms;
+	for (u = 1; u < conn->failures && d < pool->backoff_max_ms; u++)
+		d *= 2;
+	if (d > pool->backoff_max_ms)
+		d = pool->backoff_max_ms;
+	if (d >= 2)
+		d = d / 2 + rand_r(&pool->seed) % (d / 2 + 1);
+	conn->state = CONN_BACKOFF;
+	conn->retry_at = now + d;
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "kafka-private.h"
+#include "serialize.h"
+
+/**
+ * A minimal FetchRequest v0 and the decoding of its response, enough to
+ * read message sets back from a broker. Nothing here copies message
+ * data: partitions and messages point into the response buffer.
+ */
+
+size_t
+fetch_request_packed_size(const char *client, const char *topic, unsigned n)
+{
+	size_t len = sizeof(request_header_t) + 2 + strlen(client);
+	len += 4 + 4 + 4;	/* replica id, max wait, min bytes */
+	len += 4 + 2 + strlen(topic) + 4;	/* one topic, its partitions */
+	len += n * (4 + 8 + 4);	/* partition, offset, max bytes */
+	return len;
+}
+
+size_t
+fetch_request_pack(int32_t correlation_id, const char *client,
+	const char *topic, const fetch_partition_request_t *partitions,
+	unsigned n, int32_t max_wait_ms, int32_t min_bytes, KafkaBuffer *buffer)
+{
+	/**
+	 * Writes a FetchRequest for n partitions of one topic at buffer->cur,
+	 * which must have fetch_request_packed_size() bytes left.
+	 */
+	unsigned u;
+	request_header_t header;
+	uint8_t *start = buffer->cur;
+
+	memset(&header, 0, sizeof header);
+	header.size = fetch_request_packed_size(client, topic, n) - 4;
+	header.apikey = FETCH;
+	header.correlation_id = correlation_id;
+
+	buffer->cur += request_header_pack(&header, client, buffer->cur);
+	buffer->cur += uint32_pack(-1, buffer->cur);	/* replica id */
+	buffer->cur += uint32_pack(max_wait_ms, buffer->cur);
+	buffer->cur += uint32_pack(min_bytes, buffer->cur);
+	buffer->cur += uint32_pack(1, buffer->cur);
+	buffer->cur += string_pack(topic, buffer->cur);
+	buffer->cur += uint32_pack(n, buffer->cur);
+	for (u = 0; u < n; u++) {
+		buffer->cur += uint32_pack(partitions[u].partition, buffer->cur);
+		buffer->cur += uint64_pack(partitions[u].offset, buffer->cur);
+		buffer->cur += uint32_pack(partitions[u].max_bytes, buffer->cur);
+	}
+	return buffer->cur - start;
+}
+
+void
+fetch_response_init(fetch_response_t *resp)
+{
+	memset(resp, 0, sizeof *resp);
+}
+
+void
+fetch_response_destroy(fetch_response_t *resp)
+{
+	free(resp->partitions);
+	fetch_response_init(resp);
+}
+
+static int
+fetch_take(const uint8_t *ptr, const uint8_t *end, size_t n)
+{
+	return (size_t)(end - ptr) >= n ? 0 : -1;
+}
+
+int
+fetch_response_parse(uint8_t *buf, size_t size, fetch_response_t *resp)
+{
+	/**
+	 * Parses a FetchResponse into resp, reusing its partitions array
+	 * from one response to the next. Returns -1 if the response is
+	 * truncated or malformed.
+	 */
+	uint8_t *ptr = buf, *end = buf + size;
+	uint32_t i, j, correlationId, ntopics, nparts;
+
+	resp->n = 0;
+	if (fetch_take(ptr, end, 8) == -1)
+		return -1;
+	ptr += uint32_unpack(ptr, &correlationId);
+	ptr += uint32_unpack(ptr, &ntopics);
+	resp->correlation_id = correlationId;
+	for (i = 0; i < ntopics; i++) {
+		uint8_t *topic;
+		uint16_t topicLen;
+		if (fetch_take(ptr, end, 2) == -1)
+			return -1;
+		ptr += uint16_unpack(ptr, &topicLen);
+		if (topicLen > INT16_MAX || fetch_take(ptr, end, topicLen + 4) == -1)
+			return -1;
+		topic = ptr;
+		ptr += topicLen;
+		ptr += uint32_unpack(ptr, &nparts);
+		for (j = 0; j < nparts; j++) {
+			fetch_partition_t *part;
+			uint32_t partition, messagesSize;
+			uint16_t error;
+			uint64_t highWatermark;
+			if (resp->n == resp->alloced) {
+				unsigned alloced = resp->alloced ? resp->alloced * 2 : 16;
+				fetch_partition_t *parts = realloc(resp->partitions,
+						alloced * sizeof *parts);
+				if (!parts)
+					return -1;
+				resp->partitions = parts;
+				resp->alloced = alloced;
+			}
+			if (fetch_take(ptr, end, 4 + 2 + 8 + 4) == -1)
+				return -1;
+			part = &resp->partitions[resp->n++];
+			part->topic = (const char *)topic;
+			part->topic_len = topicLen;
+			ptr += uint32_unpack(ptr, &partition);
+			ptr += uint16_unpack(ptr, &error);
+			ptr += uint64_unpack(ptr, &highWatermark);
+			ptr += uint32_unpack(ptr, &messagesSize);
+			part->partition = partition;
+			part->error = error;
+			part->high_watermark = highWatermark;
+			part->messages_size = messagesSize;
+			if (part->messages_size < 0 ||
+			    fetch_take(ptr, end, part->messages_size) == -1)
+				return -1;
+			part->messages = ptr;
+			ptr += part->messages_size;
+		}
+	}
+	return 0;
+}
+
+int
+fetch_message_next(uint8_t **ptr, uint8_t *end, fetch_message_t *msg)
+{
+	/**
+	 * Decodes the message at *ptr in a message set ending at end and
+	 * moves *ptr past it. Returns 1 for a message, 0 at the end of the
+	 * set, which includes the partial message a broker may leave at the
+	 * end of one cut at max bytes, and -1 for a corrupt message.
+	 * Compressed message sets are handed back as their wrapper message.
+	 */
+	uint8_t *p = *ptr, *mend;
+	uint64_t offset;
+	uint32_t size, crc, keyLen, valueLen;
+
+	if (end - p < 12)
+		return 0;
+	p += uint64_unpack(p, &offset);
+	p += uint32_unpack(p, &size);
+	msg->offset = offset;
+	if ((int32_t)size < 14)
+		return -1;
+	if ((size_t)(end - p) < size)
+		return 0;
+	mend = p + size;
+	uint32_unpack(p, &crc);
+	if (crc != crc32(0, p + 4, size - 4))
+		return -1;
+	msg->attrs = p[5];
+	p += 6;	/* crc, magic, attrs */
+	p += uint32_unpack(p, &keyLen);
+	msg->key_len = keyLen;
+	if (msg->key_len < -1 || msg->key_len > mend - p - 4)
+		return -1;
+	msg->key = msg->key_len > 0 ? p : NULL;
+	if (msg->key_len > 0)
+		p += msg->key_len;
+	p += uint32_unpack(p, &valueLen);
+	msg->value_len = valueLen;
+	if (msg->value_len < -1 || msg->value_len > mend - p)
+		return -1;
+	msg->value = msg->value_len > 0 ? p : NULL;
+	*ptr = mend;
+	return 1;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "kafka-private.h"
+
+/**
+ * Log-linear histograms in the style of HdrHistogram: values below
+ * 2^HISTOGRAM_SUB_BITS get a bucket each, and every power of two above
+ * that is split into 2^HISTOGRAM_SUB_BITS buckets, which keeps any
+ * recorded value within about 6% of its bucket's bounds. Only one thread
+ * records into a histogram; others may read it at any time and see
+ * counts that are at worst slightly behind.
+ */
+
+#define SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+
+static unsigned
+bucket_of(uint64_t value)
+{
+	unsigned msb, shift;
+	if (value < SUB_COUNT)
+		return value;
+	msb = 63 - __builtin_clzll(value);
+	shift = msb - HISTOGRAM_SUB_BITS;
+	return ((shift + 1) << HISTOGRAM_SUB_BITS) +
+		((value >> shift) & (SUB_COUNT - 1));
+}
+
+static uint64_t
+bucket_highest(unsigned bucket)
+{
+	/* the largest value that falls in bucket */
+	unsigned shift, sub;
+	if (bucket < SUB_COUNT)
+		return bucket;
+	shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+	sub = bucket & (SUB_COUNT - 1);
+	return (((uint64_t)SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+void
+histogram_record(histogram_t *h, uint64_t value)
+{
+	unsigned b = bucket_of(value);
+	STATS_ADD(h->counts[b], 1);
+	STATS_ADD(h->total, 1);
+	if (value > STATS_GET(h->max))
+		__atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+uint64_t
+histogram_percentile(histogram_t *h, double percentile)
+{
+	/**
+	 * Returns the highest value equivalent to the given percentile
+	 * (0 to 100) of what was recorded, or 0 if nothing was.
+	 */
+	unsigned b;
+	uint64_t total, rank, seen = 0, max;
+
+	total = STATS_GET(h->total);
+	if (total == 0)
+		return 0;
+	if (percentile < 0)
+		percentile = 0;
+	if (percentile > 100)
+		percentile = 100;
+	rank = (uint64_t)(percentile / 100 * total + 0.5);
+	if (rank == 0)
+		rank = 1;
+	max = STATS_GET(h->max);
+	for (b = 0; b < HISTOGRAM_BUCKETS; b++) {
+		seen += STATS_GET(h->counts[b]);
+		if (seen >= rank) {
+			uint64_t v = bucket_highest(b);
+			return v < max ? v : max;
+		}
+	}
+	return max;
+}
@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "kafka-private.h"
+
+/**
+ * Reads and writes with a deadline. Every wait goes through poll(), so
+ * these work on blocking and non-blocking descriptors alike, but only a
+ * non-blocking one is guaranteed never to block past the deadline.
+ * Deadlines are absolute monotonic_ms() times; -1 means none.
+ */
+
+static int
+io_wait(int fd, short events, int64_t deadline)
+{
+	int rc, timeout = -1;
+	struct pollfd pfd;
+
+	if (deadline != -1) {
+		int64_t left = deadline - monotonic_ms();
+		if (left <= 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		timeout = left > INT32_MAX ? INT32_MAX : (int)left;
+	}
+
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	do {
+		rc = poll(&pfd, 1, timeout);
+	} while (rc == -1 && errno == EINTR);
+	if (rc == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	return rc == -1 ? -1 : 0;
+}
+
+ssize_t
+io_write_full(int fd, const void *buf, size_t len, int64_t deadline)
+{
+	/**
+	 * Returns len, or -1 with errno set (ETIMEDOUT past the deadline).
+	 * Never raises SIGPIPE on a socket the peer has closed.
+	 */
+	size_t done = 0;
+	while (done < len) {
+		ssize_t rc;
+		if (io_wait(fd, POLLOUT, deadline) == -1)
+			return -1;
+		rc = send(fd, (const char *)buf + done, len - done, MSG_NOSIGNAL);
+		if (rc == -1 && errno == ENOTSOCK)
+			rc = write(fd, (const char *)buf + done, len - done);
+		if (rc == -1) {
+			if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+				continue;
+			return -1;
+		}
+		done += rc;
+	}
+	return len;
+}
+
+ssize_t
+io_read_full(int fd, void *buf, size_t len, int64_t deadline)
+{
+	/**
+	 * Returns len, or -1 with errno set (ETIMEDOUT past the deadline,
+	 * ECONNRESET if the peer closed the connection first).
+	 */
+	size_t done = 0;
+	while (done < len) {
+		ssize_t rc;
+		if (io_wait(fd, POLLIN, deadline) == -1)
+			return -1;
+		rc = read(fd, (char *)buf + done, len - done);
+		if (rc == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		if (rc == -1) {
+			if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+				continue;
+			return -1;
+		}
+		done += rc;
+	}
+	return len;
+}
+
+int64_t
+io_deadline(int timeout_ms)
+{
+	/* a negative timeout means no deadline */
+	if (timeout_ms < 0)
+		return -1;
+	return monotonic_ms() + timeout_ms;
+}
+
+void
+frame_reader_init(frame_reader_t *r)
+{
+	r->body = NULL;
+	frame_reader_reset(r);
+}
+
+void
+frame_reader_destroy(frame_reader_t *r)
+{
+	KafkaBufferFree(r->body);
+	r->body = NULL;
+}
+
+void
+frame_reader_reset(frame_reader_t *r)
+{
+	/* drops whatever part of a frame was read, e.g. after an error */
+	r->got = 0;
+	r->size = -1;
+	r->complete = 0;
+}
+
+static int
+frame_reader_reserve(frame_reader_t *r, size_t size)
+{
+	/**
+	 * Grows the body buffer to fit size, and gives back memory an
+	 * unusually large frame left behind.
+	 */
+	uint8_t *ptr;
+	size_t want = size ? size : 1;
+
+	if (!r->body) {
+		r->body = KafkaBufferNew(want);
+		return r->body->data ? 0 : -1;
+	}
+	if (r->body->alloced >= want &&
+		(r->body->alloced <= FRAME_KEEP_SIZE || want > FRAME_KEEP_SIZE))
+		return 0;
+	ptr = realloc(r->body->data, want);
+	if (!ptr)
+		return -1;
+	r->body->data = ptr;
+	r->body->alloced = want;
+	return 0;
+}
+
+int
+frame_reader_read(frame_reader_t *r, int fd)
+{
+	/**
+	 * Reads as much of the current frame as fd has. Returns 1 once the
+	 * frame is complete (its body is in r->body), 0 if fd would block
+	 * first, or -1 with errno set: ECONNRESET if the peer closed the
+	 * connection, EMSGSIZE for a nonsensical size prefix. The next call
+	 * after a complete frame starts on the following one, so this can be
+	 * driven straight from an event loop.
+	 */
+	if (r->complete)
+		frame_reader_reset(r);
+
+	for (;;) {
+		ssize_t rc;
+		if (r->got < 4) {
+			rc = read(fd, r->header + r->got, 4 - r->got);
+		} else {
+			if (r->size == -1) {
+				int32_t size;
+				memcpy(&size, r->header, 4);
+				size = ntohl(size);
+				if (size < 0 || size > FRAME_MAX_SIZE) {
+					errno = EMSGSIZE;
+					return -1;
+				}
+				if (frame_reader_reserve(r, size) == -1) {
+					errno = ENOMEM;
+					return -1;
+				}
+				r->size = size;
+			}
+			if (r->got - 4 == (size_t)r->size) {
+				r->body->len = r->size;
+				r->body->cur = r->body->data;
+				r->complete = 1;
+				return 1;
+			}
+			rc = read(fd, r->body->data + (r->got - 4),
+				r->size - (r->got - 4));
+		}
+		if (rc == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		r->got += rc;
+	}
+}
+
+int
+frame_reader_recv(frame_reader_t *r, int fd, int64_t deadline)
+{
+	/**
+	 * Reads one whole frame, waiting for it until the deadline. Returns
+	 * 0, or -1 with errno set as for frame_reader_read() or ETIMEDOUT.
+	 */
+	for (;;) {
+		int rc;
+		if (io_wait(fd, POLLIN, deadline) == -1)
+			return -1;
+		rc = frame_reader_read(r, fd);
+		if (rc != 0)
+			return rc == 1 ? 0 : -1;
+	}
+}
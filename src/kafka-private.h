@@ -28,26 +28,394 @@
 #define _LIBKAFKA_PRIVATE_H_
 
 #include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <zookeeper/zookeeper.h>
 
+#include <kafka.h>
+
 #include "vector.h"
+#include "msgvec.h"
+#include "map.h"
+#include "mpsc.h"
 #include "jansson/jansson.h"
-#include "jansson/hashtable.h"
 
 #define KAFKA_EXPORT __attribute__((visibility("default")))
 
+/* buffer.c */
+typedef struct KafkaBuffer {
+	size_t alloced;
+	size_t len;
+	uint8_t *data;
+	uint8_t *cur;
+	struct KafkaBuffer *next;
+} KafkaBuffer;
+
+/**
+ * Free lists of recycled buffers, one per power-of-two size class from
+ * 1 KB up to KAFKA_BUFFER_POOL_MAX_SIZE.
+ */
+#define KAFKA_BUFFER_POOL_MIN_SHIFT 10
+#define KAFKA_BUFFER_POOL_CLASSES   15
+#define KAFKA_BUFFER_POOL_MAX_SIZE \
+	((size_t)1 << (KAFKA_BUFFER_POOL_MIN_SHIFT + KAFKA_BUFFER_POOL_CLASSES - 1))
+#define KAFKA_BUFFER_POOL_DEPTH     8
+
+typedef struct {
+	KafkaBuffer *free[KAFKA_BUFFER_POOL_CLASSES];
+	unsigned count[KAFKA_BUFFER_POOL_CLASSES];
+} KafkaBufferPool;
+
+KafkaBuffer *KafkaBufferNew(size_t size);
+void KafkaBufferFree(KafkaBuffer *buffer);
+size_t KafkaBufferReserve(KafkaBuffer *buffer, size_t size);
+size_t KafkaBufferResize(KafkaBuffer *buffer);
+
+KafkaBufferPool *KafkaBufferPoolNew(void);
+void KafkaBufferPoolFree(KafkaBufferPool *pool);
+KafkaBuffer *KafkaBufferPoolGet(KafkaBufferPool *pool, size_t size);
+void KafkaBufferPoolPut(KafkaBufferPool *pool, KafkaBuffer *buffer);
+
+/* io.c */
+#define FRAME_MAX_SIZE   (256 * 1024 * 1024)	/* anything larger is garbage */
+#define FRAME_KEEP_SIZE  (1024 * 1024)		/* body kept between frames */
+
+/**
+ * Reads size-prefixed responses a piece at a time, as the socket has
+ * them, into a body buffer reused from one frame to the next.
+ */
+typedef struct {
+	uint8_t header[4];
+	size_t got;		/* of the current frame, header included */
+	int32_t size;		/* of the body, -1 until the header is in */
+	int complete;
+	KafkaBuffer *body;	/* len and cur are set once complete */
+} frame_reader_t;
+
+ssize_t io_write_full(int fd, const void *buf, size_t len, int64_t deadline);
+ssize_t io_read_full(int fd, void *buf, size_t len, int64_t deadline);
+int64_t io_deadline(int timeout_ms);
+void frame_reader_init(frame_reader_t *r);
+void frame_reader_destroy(frame_reader_t *r);
+void frame_reader_reset(frame_reader_t *r);
+int frame_reader_read(frame_reader_t *r, int fd);
+int frame_reader_recv(frame_reader_t *r, int fd, int64_t deadline);
+
+/* resolver.c */
+#define RESOLVER_MAX_ADDRS 8	/* per host */
+
+/**
+ * A host's addresses in the order to try them, without ports.
+ */
+typedef struct {
+	unsigned n;
+	socklen_t len[RESOLVER_MAX_ADDRS];
+	struct sockaddr_storage addr[RESOLVER_MAX_ADDRS];
+} resolved_addrs_t;
+
+typedef struct {
+	struct map *entries;	/* { hostname: resolver_entry_t } */
+	int ttl_ms;
+	int negative_ttl_ms;
+	int async;
+	int running;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+} resolver_t;
+
+int resolve_host(const char *host, resolved_addrs_t *out);
+resolver_t *resolver_new(int ttl_ms, int negative_ttl_ms, int async);
+void resolver_free(resolver_t *r);
+int resolver_lookup(resolver_t *r, const char *host, resolved_addrs_t *out);
+
+/* broker.c */
+#define CONNECT_MAX_ADDRS         RESOLVER_MAX_ADDRS
+#define CONNECT_ATTEMPT_DELAY_MS  250	/* before trying the next address */
+
+/**
+ * Options set on every broker socket before it connects.
+ */
+typedef struct {
+	int nodelay;
+	int sndbuf;		/* 0 leaves the OS default */
+	int rcvbuf;
+	int keepalive_ms;	/* 0 for off */
+	int busy_poll_us;
+	int user_timeout_ms;
+} socket_options_t;
+
+/**
+ * Non-blocking connect to one host over all of its addresses.
+ */
+typedef struct {
+	const socket_options_t *opts;	/* NULL for none */
+	resolved_addrs_t addrs;
+	unsigned next;
+	int fds[CONNECT_MAX_ADDRS];			/* in progress */
+	unsigned nfds;
+	int64_t next_at;
+	int fd;						/* connected */
+} connect_attempt_t;
+
+int nonblocking(int fd);
+int blocking(int fd);
+void connect_attempt_init(connect_attempt_t *a, resolver_t *resolver,
+			const socket_options_t *opts, const char *hostname,
+			int32_t port);
+void connect_attempts_run(connect_attempt_t *attempts, unsigned n,
+			int64_t deadline);
+void connect_attempt_destroy(connect_attempt_t *a);
+int broker_connect(const char *hostname, int32_t port, int timeout_ms);
+
+/* connection.c */
+typedef enum {
+	CONN_DOWN,		/* never connected */
+	CONN_CONNECTING,
+	CONN_READY,
+	CONN_FAILED,		/* failed once, reconnects on next use */
+	CONN_BACKOFF		/* failed repeatedly, waits for retry_at */
+} conn_state_t;
+
+typedef struct {
+	int32_t id;
+	char *host;
+	int32_t port;
+	int fd;
+	conn_state_t state;
+	unsigned failures;	/* in a row */
+	int64_t retry_at;
+} broker_conn_t;
+
+typedef struct {
+	struct map *by_id;	/* { broker id: broker_conn_t } */
+	struct map *by_addr;	/* { "host:port": broker_conn_t }, owns them */
+	int backoff_ms;
+	int backoff_max_ms;
+	int connect_timeout_ms;
+	resolver_t *resolver;	/* not owned */
+	socket_options_t sockopts;
+	unsigned seed;
+} conn_pool_t;
+
+conn_pool_t *conn_pool_new(int backoff_ms, int backoff_max_ms,
+			int connect_timeout_ms, resolver_t *resolver,
+			const socket_options_t *sockopts);
+void conn_pool_free(conn_pool_t *pool);
+broker_conn_t *conn_pool_get(conn_pool_t *pool, int32_t id, const char *host,
+			int32_t port);
+void conn_pool_connect(conn_pool_t *pool, broker_conn_t **conns, unsigned n,
+		int64_t now);
+int conn_fd(conn_pool_t *pool, broker_conn_t *conn, int64_t now);
+void conn_ok(broker_conn_t *conn);
+void conn_failed(conn_pool_t *pool, broker_conn_t *conn, int64_t now);
+
+/* segment.c */
+struct segment_header;
+
+/**
+ * A memory-mapped file of message set records, see segment.c.
+ */
+typedef struct {
+	int fd;
+	uint8_t *base;
+	size_t size;
+	struct segment_header *header;
+	pthread_mutex_t lock;
+	pthread_mutex_t sync_lock;	/* one msync at a time */
+	unsigned pending;		/* records waiting for replay */
+	uint64_t appended;		/* appends so far */
+	uint64_t synced;		/* of those, made durable */
+} segment_t;
+
+#define SEGMENT_PENDING 0	/* waiting for replay */
+#define SEGMENT_DONE    1
+#define SEGMENT_HELD    2	/* its sender has not given up on it yet */
+
+typedef struct {
+	uint64_t pos;
+	uint64_t next;		/* where to look for the next record */
+	const char *topic;	/* not NUL terminated */
+	size_t topic_len;
+	int32_t partition;	/* -1 if none was picked */
+	int32_t count;		/* of messages */
+	uint8_t *messages;	/* message set in wire format */
+	int32_t messages_size;
+} segment_record_t;
+
+int segment_open(segment_t *s, const char *path, size_t size);
+void segment_close(segment_t *s);
+unsigned segment_pending(segment_t *s);
+size_t segment_used(segment_t *s);
+int64_t segment_append(segment_t *s, struct msgvec *messages, int state,
+		unsigned *records);
+int segment_next_pending(segment_t *s, uint64_t pos, segment_record_t *rec);
+int segment_read(segment_t *s, uint64_t pos, segment_record_t *rec);
+void segment_done(segment_t *s, uint64_t pos, unsigned n);
+void segment_release(segment_t *s, uint64_t pos, unsigned n);
+int segment_sync(segment_t *s);
+
+/**
+ * Reference counted snapshot of cluster metadata. Whoever holds a
+ * reference may read it without locking; refreshing swaps in a new
+ * snapshot and the old one is freed with its last reference.
+ */
+typedef struct {
+	unsigned refs;
+	struct map *brokers;	/* { broker id: broker_t } */
+	struct map *topics;	/* { topic: topic_metadata_t } */
+} producer_metadata_t;
+
+/**
+ * A kafka_producer_send()/kafka_producer_send_batch() call waiting on the
+ * sender thread.
+ */
+struct produce_job {
+	struct msgvec *messages;
+	size_t bytes;			/* charged to the producer's budget */
+	int64_t enqueued_us;
+	int16_t sync;			/* KAFKA_REQUEST_* it was sent with */
+	unsigned pending;		/* messages the sender still holds */
+	int wal;			/* logged: the sender settles and frees it */
+	int res;
+	sem_t done;
+};
+
+/* async, sync, full sync */
+#define PRODUCER_SYNC_LEVELS 3
+
+/**
+ * Per-thread front-end of a producer. The owning thread partitions its
+ * messages and appends them to the shard's per-partition batches; the
+ * shard is queued for the sender only when it goes from empty to
+ * non-empty, and the sender merges whole partition batches from every
+ * queued shard into per-broker requests.
+ */
+struct producer_shard {
+	struct mpsc_node node;		/* on the producer queue while queued */
+	struct producer_shard *next;	/* every shard of the producer */
+	pthread_mutex_t lock;		/* owning thread vs sender */
+	int queued;
+	int orphaned;			/* owning thread has exited */
+	uint64_t messages;		/* submitted, under lock */
+	uint64_t bytes;
+	struct map *batches[PRODUCER_SYNC_LEVELS]; /* { topic: { partition: msgvec } } */
+	producer_metadata_t *md;	/* owning thread only */
+	unsigned long md_gen;
+	unsigned seed;
+};
+
+/**
+ * Counters the sender thread keeps. It is the only writer, so they are
+ * bumped with plain relaxed loads and stores; the locks guard only the
+ * creation of per-broker and per-partition entries against readers.
+ */
+#define STATS_ADD(counter, n) \
+	__atomic_store_n(&(counter), \
+		__atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), \
+		__ATOMIC_RELAXED)
+#define STATS_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+/* histogram.c */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS  ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+typedef struct {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+} histogram_t;
+
+void histogram_record(histogram_t *h, uint64_t value);
+uint64_t histogram_percentile(histogram_t *h, double percentile);
+
+typedef struct {
+	uint64_t requests;
+	uint64_t request_bytes;
+	uint64_t response_bytes;
+	uint64_t inflight;
+	uint64_t errors;		/* requests that failed on the wire */
+} broker_stats_t;
+
+typedef struct {
+	uint64_t messages;		/* acked */
+	uint64_t bytes;
+	uint64_t retries;
+	uint64_t errors;
+} partition_stats_t;
+
+typedef struct {
+	uint64_t messages_acked;
+	uint64_t messages_sent;
+	uint64_t messages_failed;
+	uint64_t messages_spooled;
+	uint64_t messages_replayed;
+	uint64_t requests;
+	uint64_t request_bytes;
+	uint64_t response_bytes;
+	uint64_t inflight;
+	uint64_t retries;
+	uint64_t errors[KAFKA_STATS_ERRORS];
+	histogram_t histograms[KAFKA_HISTOGRAMS];
+	pthread_mutex_t lock;
+	struct map *brokers;		/* { broker id: broker_stats_t } */
+	struct map *topics;		/* { topic: { partition: partition_stats_t } } */
+	int64_t emit_at;		/* next stats_cb call, sender thread only */
+} producer_stats_t;
+
 struct kafka_producer {
 	unsigned magic;
 #define KAFKA_PRODUCER_MAGIC 0xb5be14d0
+	struct kafka_producer_config config;
 	zhandle_t *zh;
+	char *bootstrap;		/* "host:port,..." in place of zh */
 	clientid_t cid;
-	hashtable_t *brokers;
-	hashtable_t *metadata;
+	pthread_mutex_t metadata_lock;	/* guards the metadata pointer only */
+	producer_metadata_t *metadata;
+	unsigned long metadata_gen;	/* bumped whenever metadata is swapped */
+	pthread_key_t shard_key;
+	int shards_ready;
+	pthread_mutex_t shards_lock;
+	struct producer_shard *shards;
+	KafkaBufferPool *buffers;	/* sender thread only */
+	conn_pool_t *conns;		/* sender thread only, once started */
+	resolver_t *resolver;
+	frame_reader_t reader;		/* sender thread only */
+	producer_stats_t stats;
+	unsigned sender_seed;		/* sender thread only */
+	int32_t correlation_id;		/* sender thread only */
+	struct map *retries[PRODUCER_SYNC_LEVELS]; /* sender thread only */
+	int64_t retry_due;		/* sender thread only */
+	unsigned long round;		/* sender thread only */
+	int metadata_stale;		/* sender thread only */
+	int64_t metadata_refreshed;	/* sender thread only */
+	segment_t *spool;		/* sender thread only */
+	int64_t spool_replay_at;	/* sender thread only */
+	segment_t *wal;
+	int64_t wal_replay_at;		/* sender thread only */
+	struct mpsc_queue queue;	/* shards with pending work */
+	unsigned long enqueued;
+	unsigned long dequeued;		/* sender thread only */
+	int sender_idle;
+	int running;
+	pthread_mutex_t sender_lock;
+	pthread_cond_t sender_wakeup;
+	pthread_t sender;
+	int sender_started;
+	size_t buffered_bytes;		/* queued or in flight */
+	unsigned budget_waiters;
+	pthread_mutex_t budget_lock;
+	pthread_cond_t budget_freed;
 	int res;
 };
 
 struct kafka_message_set {
-	struct vector *messages;
+	struct msgvec messages;
+	uint8_t *sealed;		/* the messages in wire format, once sealed */
+	size_t sealed_size;
 };
 
 typedef enum {
@@ -61,19 +429,6 @@ typedef enum {
 	OFFSET_FETCH=7
 } kafka_request_types;
 
-/* buffer.c */
-typedef struct {
-	size_t alloced;
-	size_t len;
-	uint8_t *data;
-	uint8_t *cur;
-} KafkaBuffer;
-
-KafkaBuffer *KafkaBufferNew(size_t size);
-void KafkaBufferFree(KafkaBuffer *buffer);
-size_t KafkaBufferReserve(KafkaBuffer *buffer, size_t size);
-size_t KafkaBufferResize(KafkaBuffer *buffer);
-
 typedef struct {
 	int32_t len;
 	uint8_t *data;
@@ -83,21 +438,21 @@ typedef struct {
 	int32_t id;
 	char *hostname;
 	int32_t port;
-	int fd;
 } broker_t;
 
 typedef struct {
 	int16_t error;
 	int32_t partition_id;
 	broker_t *leader;
-	hashtable_t *replicas;
-	hashtable_t *isr;
+	struct map *replicas;
+	struct map *isr;
 } partition_metadata_t;
 
 typedef struct {
 	char *topic;
+	uint16_t topic_len;
 	int32_t num_partitions;
-	hashtable_t *partitions;
+	struct map *partitions;
 	int16_t error;
 } topic_metadata_t;
 
@@ -127,49 +482,51 @@ struct metadata_response {
 	int32_t correlation_id;
 	int32_t numBrokers;
 	int32_t numTopics;
-	hashtable_t *brokers;
-	hashtable_t *metadata;
+	struct map *brokers;
+	struct map *metadata;
 };
 
 typedef struct {
 	int32_t partition;
-	struct vector *messages;
+	struct msgvec messages;
 } partition_messages_t;
 
 typedef struct {
 	char *topic;
-	hashtable_t *partitions;
+	struct map *partitions;
 } topic_partitions_t;
 
 typedef struct {
 	int16_t acks;
 	int32_t ttl;
-	hashtable_t *topics_partitions;
+	struct map *topics_partitions;
 } produce_request_t;
 
 struct kafka_message {
 	char *topic;
+	uint16_t topic_len;
 	bytestring_t *key;
 	bytestring_t *value;
+	int32_t partition;		/* -1 until a partition is picked */
+	struct produce_job *job;	/* set while in flight */
+	/* in place of key and value: a sealed set, as it goes on the wire */
+	const uint8_t *sealed;
+	size_t sealed_size;
+	unsigned sealed_count;		/* messages in it */
+	uint64_t wal_pos;		/* its record, if its job is logged */
 };
 
 /* metadata/partition_metadata.c */
 partition_metadata_t *partition_metadata_new(int32_t partition_id, broker_t *broker,
-					hashtable_t *replicas, hashtable_t *isr, int16_t error);
+					struct map *replicas, struct map *isr, int16_t error);
 size_t partition_metadata_from_buffer(uint8_t *ptr,
-				hashtable_t *brokers, partition_metadata_t **out);
-
-/* broker.c */
-int nonblocking(int fd);
-int blocking(int fd);
-int broker_connect(broker_t *broker);
+				struct map *brokers, partition_metadata_t **out);
 
 /* utils.c */
-size_t jenkins(const void *key);
-int keycmp(const void *a, const void *b);
-
-size_t int32_hash(const void *key);
-int int32_cmp(const void *a, const void *b);
+size_t hash_bytes(const void *key, size_t len);
+int64_t monotonic_ms(void);
+int64_t monotonic_us(void);
+void deadline_after_ms(struct timespec *ts, int64_t ms);
 
 void free_String_vector(struct String_vector *v);
 char *string_builder(const char *fmt, ...);
@@ -181,16 +538,170 @@ json_t *wget_json_from_znode(zhandle_t *zh, const char *znode,
 
 /* message.c */
 int32_t kafka_message_packed_size(struct kafka_message *m);
+size_t kafka_message_wire_size(struct kafka_message *m);
+unsigned messages_count(struct msgvec *vec);
 
 /* crc32.c */
 uint32_t crc32(uint32_t crc, const void *buf, size_t size);
 
+/* producer/producer.c */
+void producer_enqueue(struct kafka_producer *p, struct mpsc_node *node);
+void producer_sender_wakeup(struct kafka_producer *p);
+producer_metadata_t *producer_metadata_acquire(struct kafka_producer *p);
+void producer_metadata_release(producer_metadata_t *md);
+int producer_metadata_refresh(struct kafka_producer *p);
+
+/* producer/budget.c */
+void producer_budget_init(struct kafka_producer *p);
+void producer_budget_destroy(struct kafka_producer *p);
+int producer_budget_reserve(struct kafka_producer *p, size_t bytes);
+void producer_budget_release(struct kafka_producer *p, size_t bytes);
+int producer_budget_drop_wanted(struct kafka_producer *p);
+
+/* producer/stats.c */
+void producer_stats_init(struct kafka_producer *p);
+void producer_stats_destroy(struct kafka_producer *p);
+broker_stats_t *producer_stats_broker(struct kafka_producer *p, int32_t id);
+partition_stats_t *producer_stats_partition(struct kafka_producer *p,
+				const char *topic, size_t topicLen,
+				int32_t partition);
+void producer_stats_error(struct kafka_producer *p, int error);
+void producer_stats_tick(struct kafka_producer *p, int64_t now);
+
+/* producer/spool.c */
+int producer_spool_open(struct kafka_producer *p);
+void producer_spool_close(struct kafka_producer *p);
+int producer_spool_append(struct kafka_producer *p, struct msgvec *vec);
+int64_t producer_replay_due(segment_t *s, int64_t replay_at);
+void producer_replay(struct kafka_producer *p, producer_metadata_t *md,
+		segment_t *s, int64_t *replay_at, int64_t now);
+
+/* producer/trace.c */
+void producer_trace(struct kafka_producer *p, int stage, int done,
+		int32_t correlation_id, int32_t broker_id, size_t bytes);
+
+/* producer/wal.c */
+int producer_wal_open(struct kafka_producer *p);
+void producer_wal_close(struct kafka_producer *p);
+int producer_wal_send(struct kafka_producer *p, struct msgvec *messages,
+		int16_t sync);
+void producer_wal_settle(struct kafka_producer *p, struct msgvec *vec, int res);
+void producer_wal_finish(struct kafka_producer *p, struct produce_job *job);
+
+/**
+ * TRACE_START and TRACE_DONE mark where a KAFKA_TRACE_* stage begins and
+ * ends. In builds configured with --enable-tracing each one fires a USDT
+ * probe, libkafka:start or libkafka:done with the stage, correlation id,
+ * broker id and byte count as arguments, and calls the producer's
+ * trace_cb. Otherwise they compile to nothing.
+ */
+#ifdef ENABLE_TRACING
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, stage, corr, broker, bytes) \
+	DTRACE_PROBE4(libkafka, name, stage, corr, broker, bytes)
+#else
+#define TRACE_PROBE(name, stage, corr, broker, bytes) do { } while (0)
+#endif
+#define TRACE_EVENT(p, name, done, stage, corr, broker, bytes) do { \
+	TRACE_PROBE(name, KAFKA_TRACE_##stage, corr, broker, bytes); \
+	if ((p)->config.trace_cb) \
+		producer_trace(p, KAFKA_TRACE_##stage, done, corr, broker, \
+			bytes); \
+} while (0)
+#else
+/* the arguments are still referenced, so none of them goes unused */
+#define TRACE_EVENT(p, name, done, stage, corr, broker, bytes) do { \
+	(void)(p); (void)(corr); (void)(broker); (void)(bytes); \
+} while (0)
+#endif
+#define TRACE_START(p, stage, corr, broker, bytes) \
+	TRACE_EVENT(p, start, 0, stage, corr, broker, bytes)
+#define TRACE_DONE(p, stage, corr, broker, bytes) \
+	TRACE_EVENT(p, done, 1, stage, corr, broker, bytes)
+
+/* fetch.c */
+typedef struct {
+	int32_t partition;
+	int64_t offset;
+	int32_t max_bytes;
+} fetch_partition_request_t;
+
+typedef struct {
+	const char *topic;	/* not NUL terminated */
+	size_t topic_len;
+	int32_t partition;
+	int16_t error;
+	int64_t high_watermark;
+	uint8_t *messages;	/* message set, may end in a partial message */
+	int32_t messages_size;
+} fetch_partition_t;
+
+typedef struct {
+	int32_t correlation_id;
+	unsigned n;
+	unsigned alloced;
+	fetch_partition_t *partitions;
+} fetch_response_t;
+
+typedef struct {
+	int64_t offset;
+	int8_t attrs;
+	int32_t key_len;	/* -1 for a null key */
+	uint8_t *key;
+	int32_t value_len;
+	uint8_t *value;
+} fetch_message_t;
+
+size_t fetch_request_packed_size(const char *client, const char *topic,
+				unsigned n);
+size_t fetch_request_pack(int32_t correlation_id, const char *client,
+			const char *topic,
+			const fetch_partition_request_t *partitions, unsigned n,
+			int32_t max_wait_ms, int32_t min_bytes,
+			KafkaBuffer *buffer);
+void fetch_response_init(fetch_response_t *resp);
+void fetch_response_destroy(fetch_response_t *resp);
+int fetch_response_parse(uint8_t *buf, size_t size, fetch_response_t *resp);
+int fetch_message_next(uint8_t **ptr, uint8_t *end, fetch_message_t *msg);
+
+/* producer/shard.c */
+int producer_sync_level(int16_t sync);
+int producer_shards_init(struct kafka_producer *p);
+void producer_shards_free(struct kafka_producer *p);
+int producer_shard_route(struct kafka_producer *p, struct msgvec *messages);
+int producer_shard_submit(struct kafka_producer *p, struct produce_job *job,
+			int16_t sync);
+void producer_shard_take(struct producer_shard *shard, struct map **batches);
+void producer_batches_free(struct map *batches);
+partition_metadata_t *producer_pick_partition(producer_metadata_t *md,
+					struct kafka_message *msg,
+					unsigned *seed);
+
+/* producer/sender.c */
+void *producer_sender_main(void *arg);
+int error_retryable(int error);
+struct map *parse_produce_response(KafkaBuffer *buffer);
+int broker_fd(struct kafka_producer *p, producer_metadata_t *md,
+		int32_t brokerId, broker_conn_t **connOut);
+int broker_exchange(struct kafka_producer *p, int32_t brokerId,
+		broker_conn_t *conn, int fd, KafkaBuffer *buffer,
+		int32_t correlation_id, int16_t sync);
+struct msgvec *broker_message_slot(struct map *map, int32_t brokerId,
+				struct kafka_message *msg);
+void broker_message_map_free(struct map *map);
+
 /* producer/watchers.c */
 void producer_init_watcher(zhandle_t *zp, int type, int state,
 			const char *path, void *ctx);
 
 /* metadata/metadata_request.c */
-struct metadata_response *topic_metadata_request(broker_t *broker, const char **topics);
+int metadata_request_send(int fd, struct metadata_request *r, int64_t deadline);
+struct metadata_response *topic_metadata_request(int fd, const char **topics,
+						int timeout_ms);
+
+/* metadata/metadata_response.c */
+struct metadata_response *metadata_response_recv(int fd, int64_t deadline);
 
 /**
  * OBJ stuff taken from miniobj.h in Varnish. Written by PHK.
@@ -52,7 +52,11 @@ kafka_status_string(int status)
 		{"Zookeeper Init Error"},
 		{"Broker Init Error"},
 		{"Topics Init Error"},
-		{"Topics Partitions Init Error"}
+		{"Topics Partitions Init Error"},
+		{"Metadata Error"},
+		{"Buffer Full"},
+		{"Message Dropped"},
+		{"Message Spooled"}
 	};
 
 	if (status >= sizeof(statuses) / sizeof(kafka_status_t) ||
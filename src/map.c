@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "map.h"
+#include "kafka-private.h"
+
+enum {
+	MAP_INT32,
+	MAP_STRING
+};
+
+#define MAP_MAX_HINT (1U << 20)	/* larger size hints are ignored */
+
+struct map_slot {
+	uint32_t hash;	/* 0 marks an empty slot */
+	uint32_t len;	/* string keys only */
+	union {
+		int32_t i;
+		char *s;
+	} key;
+	void *value;
+};
+
+struct map {
+	unsigned magic;
+#define MAP_MAGIC 0x2f8d6a31U
+	int type;
+	unsigned mask;
+	unsigned size;
+	struct map_slot *slots;
+	map_free_fn free_key;
+	map_free_fn free_value;
+};
+
+static uint32_t
+int32_key_hash(int32_t key)
+{
+	/* murmur3 finalizer; broker and partition ids are small and dense */
+	uint32_t h = (uint32_t)key;
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h ? h : 1;
+}
+
+static uint32_t
+string_key_hash(const char *key, size_t len)
+{
+	uint32_t h = (uint32_t)hash_bytes(key, len);
+	return h ? h : 1;
+}
+
+static struct map *
+map_new(int type, unsigned size, map_free_fn free_key, map_free_fn free_value)
+{
+	size_t cap = 8;
+	struct map *m;
+	ALLOC_OBJ(m, MAP_MAGIC);
+	if (!m)
+		return NULL;
+	/*
+	 * size is only a hint, often a count off the wire; negative or
+	 * absurd ones get the default
+	 */
+	if (size > MAP_MAX_HINT)
+		size = 0;
+	/* keep the load factor under 3/4 for the requested size */
+	while (cap * 3 < (size_t)size * 4)
+		cap <<= 1;
+	m->type = type;
+	m->mask = cap - 1;
+	m->slots = calloc(cap, sizeof *m->slots);
+	assert(m->slots != NULL);
+	m->free_key = free_key;
+	m->free_value = free_value;
+	return m;
+}
+
+struct map *
+map_new_int32(unsigned size, map_free_fn free_value)
+{
+	return map_new(MAP_INT32, size, NULL, free_value);
+}
+
+struct map *
+map_new_string(unsigned size, map_free_fn free_key, map_free_fn free_value)
+{
+	return map_new(MAP_STRING, size, free_key, free_value);
+}
+
+static void
+slot_release(struct map *m, struct map_slot *slot)
+{
+	if (m->type == MAP_STRING && m->free_key)
+		m->free_key(slot->key.s);
+	if (m->free_value)
+		m->free_value(slot->value);
+}
+
+void
+map_free(struct map *m)
+{
+	unsigned u;
+	if (!m)
+		return;
+	CHECK_OBJ(m, MAP_MAGIC);
+	for (u = 0; u <= m->mask; u++) {
+		if (m->slots[u].hash)
+			slot_release(m, &m->slots[u]);
+	}
+	free(m->slots);
+	FREE_OBJ(m);
+}
+
+unsigned
+map_size(struct map *m)
+{
+	CHECK_OBJ_NOTNULL(m, MAP_MAGIC);
+	return m->size;
+}
+
+static int
+slot_matches(struct map *m, struct map_slot *slot, uint32_t hash,
+	int32_t ikey, const char *skey, size_t len)
+{
+	if (slot->hash != hash)
+		return 0;
+	if (m->type == MAP_INT32)
+		return slot->key.i == ikey;
+	return slot->len == len && memcmp(slot->key.s, skey, len) == 0;
+}
+
+static struct map_slot *
+map_find(struct map *m, uint32_t hash, int32_t ikey, const char *skey,
+	size_t len)
+{
+	/**
+	 * Returns the slot holding the key, or the empty slot that ends its
+	 * probe sequence.
+	 */
+	unsigned u = hash & m->mask;
+	while (m->slots[u].hash) {
+		if (slot_matches(m, &m->slots[u], hash, ikey, skey, len))
+			break;
+		u = (u + 1) & m->mask;
+	}
+	return &m->slots[u];
+}
+
+static void
+map_grow(struct map *m)
+{
+	unsigned u, cap;
+	struct map_slot *old = m->slots;
+	unsigned oldmask = m->mask;
+	cap = (m->mask + 1) * 2;
+	m->slots = calloc(cap, sizeof *m->slots);
+	assert(m->slots != NULL);
+	m->mask = cap - 1;
+	for (u = 0; u <= oldmask; u++) {
+		unsigned v;
+		if (!old[u].hash)
+			continue;
+		/* cached hashes mean no key is rehashed */
+		v = old[u].hash & m->mask;
+		while (m->slots[v].hash)
+			v = (v + 1) & m->mask;
+		m->slots[v] = old[u];
+	}
+	free(old);
+}
+
+static void
+map_set(struct map *m, uint32_t hash, int32_t ikey, char *skey, size_t len,
+	void *value)
+{
+	struct map_slot *slot;
+	CHECK_OBJ_NOTNULL(m, MAP_MAGIC);
+	if ((m->size + 1) * 4 > (m->mask + 1) * 3)
+		map_grow(m);
+	slot = map_find(m, hash, ikey, skey, len);
+	if (slot->hash) {
+		/* replacing: the new key is dropped in favour of the old one */
+		if (m->type == MAP_STRING && m->free_key && skey != slot->key.s)
+			m->free_key(skey);
+		if (m->free_value && value != slot->value)
+			m->free_value(slot->value);
+		slot->value = value;
+		return;
+	}
+	slot->hash = hash;
+	if (m->type == MAP_INT32) {
+		slot->key.i = ikey;
+	} else {
+		slot->key.s = skey;
+		slot->len = len;
+	}
+	slot->value = value;
+	m->size++;
+}
+
+static int
+map_del(struct map *m, uint32_t hash, int32_t ikey, const char *skey,
+	size_t len)
+{
+	/**
+	 * Backward-shift deletion keeps probe sequences intact without
+	 * tombstones.
+	 */
+	unsigned hole, u;
+	struct map_slot *slot;
+	CHECK_OBJ_NOTNULL(m, MAP_MAGIC);
+	slot = map_find(m, hash, ikey, skey, len);
+	if (!slot->hash)
+		return -1;
+	slot_release(m, slot);
+	hole = slot - m->slots;
+	u = hole;
+	for (;;) {
+		unsigned home;
+		u = (u + 1) & m->mask;
+		if (!m->slots[u].hash)
+			break;
+		home = m->slots[u].hash & m->mask;
+		/* move u into the hole unless its home lies in (hole, u] */
+		if (((u - home) & m->mask) >= ((u - hole) & m->mask)) {
+			m->slots[hole] = m->slots[u];
+			hole = u;
+		}
+	}
+	memset(&m->slots[hole], 0, sizeof m->slots[hole]);
+	m->size--;
+	return 0;
+}
+
+void *
+map_get_int32(struct map *m, int32_t key)
+{
+	CHECK_OBJ_NOTNULL(m, MAP_MAGIC);
+	assert(m->type == MAP_INT32);
+	return map_find(m, int32_key_hash(key), key, NULL, 0)->value;
+}
+
+void
+map_set_int32(struct map *m, int32_t key, void *value)
+{
+	assert(m->type == MAP_INT32);
+	map_set(m, int32_key_hash(key), key, NULL, 0, value);
+}
+
+int
+map_del_int32(struct map *m, int32_t key)
+{
+	assert(m->type == MAP_INT32);
+	return map_del(m, int32_key_hash(key), key, NULL, 0);
+}
+
+void *
+map_get_string(struct map *m, const char *key, size_t len)
+{
+	CHECK_OBJ_NOTNULL(m, MAP_MAGIC);
+	assert(m->type == MAP_STRING);
+	return map_find(m, string_key_hash(key, len), 0, key, len)->value;
+}
+
+void
+map_set_string(struct map *m, char *key, size_t len, void *value)
+{
+	assert(m->type == MAP_STRING);
+	map_set(m, string_key_hash(key, len), 0, key, len, value);
+}
+
+int
+map_del_string(struct map *m, const char *key, size_t len)
+{
+	assert(m->type == MAP_STRING);
+	return map_del(m, string_key_hash(key, len), 0, key, len);
+}
+
+static void *
+map_scan(struct map *m, unsigned u)
+{
+	for (; u <= m->mask; u++) {
+		if (m->slots[u].hash)
+			return &m->slots[u];
+	}
+	return NULL;
+}
+
+void *
+map_iter(struct map *m)
+{
+	CHECK_OBJ_NOTNULL(m, MAP_MAGIC);
+	return map_scan(m, 0);
+}
+
+void *
+map_iter_next(struct map *m, void *iter)
+{
+	struct map_slot *slot = iter;
+	return map_scan(m, (slot - m->slots) + 1);
+}
+
+int32_t
+map_iter_int32_key(void *iter)
+{
+	return ((struct map_slot *)iter)->key.i;
+}
+
+const char *
+map_iter_string_key(void *iter)
+{
+	return ((struct map_slot *)iter)->key.s;
+}
+
+size_t
+map_iter_string_key_len(void *iter)
+{
+	return ((struct map_slot *)iter)->len;
+}
+
+void *
+map_iter_value(void *iter)
+{
+	return ((struct map_slot *)iter)->value;
+}
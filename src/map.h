@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MAP_H
+#define MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Open-addressing hash map with either int32 or string keys stored inline
+ * in the slot array. String keys are passed with their length, which is
+ * kept next to the cached hash so lookups never rescan the key. They are
+ * not copied; the map only takes ownership of them if a free_key function
+ * is given.
+ */
+struct map;
+
+typedef void (*map_free_fn)(void *ptr);
+
+struct map *map_new_int32(unsigned size, map_free_fn free_value);
+struct map *map_new_string(unsigned size, map_free_fn free_key,
+			map_free_fn free_value);
+void map_free(struct map *m);
+unsigned map_size(struct map *m);
+
+void *map_get_int32(struct map *m, int32_t key);
+void map_set_int32(struct map *m, int32_t key, void *value);
+int map_del_int32(struct map *m, int32_t key);
+
+void *map_get_string(struct map *m, const char *key, size_t len);
+void map_set_string(struct map *m, char *key, size_t len, void *value);
+int map_del_string(struct map *m, const char *key, size_t len);
+
+void *map_iter(struct map *m);
+void *map_iter_next(struct map *m, void *iter);
+int32_t map_iter_int32_key(void *iter);
+const char *map_iter_string_key(void *iter);
+size_t map_iter_string_key_len(void *iter);
+void *map_iter_value(void *iter);
+
+#endif
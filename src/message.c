@@ -41,11 +41,16 @@ static void bytestring_free(bytestring_t *s)
 static struct kafka_message *
 create_message(const char *topic, const char *key, const char *value)
 {
+	size_t topic_len;
 	struct kafka_message *msg;
 	if (!topic)
 		return NULL;
 	if (!value)
 		return NULL;
+	/* topics go on the wire with an int16 length */
+	topic_len = strlen(topic);
+	if (topic_len > INT16_MAX)
+		return NULL;
 	msg = calloc(1, sizeof *msg);
 	msg->key = calloc(1, sizeof *msg->key);
 	msg->key->len = -1;
@@ -59,6 +64,8 @@ create_message(const char *topic, const char *key, const char *value)
 	msg->value->data = calloc(msg->value->len+1, 1);
 	memcpy(msg->value->data, value, msg->value->len);
 	msg->topic = strdup(topic);
+	msg->topic_len = topic_len;
+	msg->partition = -1;
 	return msg;
 }
 
@@ -100,3 +107,26 @@ kafka_message_packed_size(struct kafka_message *m)
 	size += m->value->len;
 	return size;
 }
+
+size_t
+kafka_message_wire_size(struct kafka_message *m)
+{
+	/**
+	 * Returns size of the message in a message set, offset+size header
+	 * included. For a sealed set, that of the whole set.
+	 */
+	if (m->sealed)
+		return m->sealed_size;
+	return 12 + kafka_message_packed_size(m);
+}
+
+unsigned
+messages_count(struct msgvec *vec)
+{
+	/* messages in vec, counting those in sealed sets */
+	unsigned u, n = 0;
+	struct kafka_message **msgs = msgvec_data(vec);
+	for (u = 0; u < msgvec_size(vec); u++)
+		n += msgs[u]->sealed ? msgs[u]->sealed_count : 1;
+	return n;
+}
@@ -28,23 +28,27 @@
 
 #include <kafka.h>
 #include "kafka-private.h"
-
-static void msg_free(void *ptr);
+#include "serialize.h"
 
 KAFKA_EXPORT struct kafka_message_set *
 kafka_message_set_new(void)
 {
 	struct kafka_message_set *set;
 	set = calloc(1, sizeof *set);
-	set->messages = vector_new(0, msg_free);
+	msgvec_init(&set->messages);
 	return set;
 }
 
 KAFKA_EXPORT void
 kafka_message_set_free(struct kafka_message_set *set)
 {
+	unsigned u;
 	if (set) {
-		vector_free(set->messages);
+		struct kafka_message **msgs = msgvec_data(&set->messages);
+		for (u = 0; u < msgvec_size(&set->messages); u++)
+			kafka_message_free(msgs[u]);
+		msgvec_destroy(&set->messages);
+		free(set->sealed);
 		free(set);
 	}
 }
@@ -53,13 +57,35 @@ KAFKA_EXPORT size_t
 kafka_message_set_append(struct kafka_message_set *set, struct kafka_message *msg)
 {
 	assert(set);
-	vector_push_back(set->messages, msg);
-	return vector_size(set->messages);
+	if (set->sealed)
+		return 0;
+	msgvec_push_back(&set->messages, msg);
+	return msgvec_size(&set->messages);
 }
 
-static void
-msg_free(void *ptr)
+KAFKA_EXPORT int
+kafka_message_set_seal(struct kafka_message_set *set)
 {
-	struct kafka_message *msg = (struct kafka_message *)ptr;
-	kafka_message_free(msg);
+	/**
+	 * Serializes the set's messages once, offsets, sizes and CRCs
+	 * included, so that kafka_producer_send_sealed() can send them to
+	 * any number of topics and producers with a plain copy. Their own
+	 * topics play no part. Returns -1 for an empty set, or if memory
+	 * runs out, in which case the set stays unsealed.
+	 */
+	uint8_t *sealed;
+	size_t size;
+	assert(set);
+	if (set->sealed)
+		return 0;
+	if (msgvec_size(&set->messages) == 0)
+		return -1;
+	size = message_set_packed_size(&set->messages);
+	sealed = malloc(size);
+	if (!sealed)
+		return -1;
+	serialize_message_set(&set->messages, sealed);
+	set->sealed = sealed;
+	set->sealed_size = size;
+	return 0;
 }
@@ -56,7 +56,6 @@ metadata_request_new(const char **topics, const char *client)
 	if (topics) {
 		while (topics[r->numTopics]) {
 			r->header.size += 2 + strlen(topics[r->numTopics++]);
-			r->numTopics++;
 		}
 	}
 	return r;
@@ -81,38 +80,39 @@ metadata_request_to_buffer(struct metadata_request *r, uint8_t **out)
 
 KAFKA_EXPORT int
 metadata_request_write(int fd, struct metadata_request *r)
+{
+	return metadata_request_send(fd, r, -1);
+}
+
+int
+metadata_request_send(int fd, struct metadata_request *r, int64_t deadline)
 {
 	int rc;
 	size_t len;
 	uint8_t *buffer;
 
 	len = metadata_request_to_buffer(r, &buffer);
-
-	do {
-		rc = write(fd, buffer, len);
-	} while (rc == -1 && errno == EINTR);
-
-	if (rc == -1)
-		return rc;
-
-	assert(rc == len);
+	rc = io_write_full(fd, buffer, len, deadline);
 	free(buffer);
 	return rc;
 }
 
 struct metadata_response *
-topic_metadata_request(broker_t *broker, const char **topics)
+topic_metadata_request(int fd, const char **topics, int timeout_ms)
 {
 	/**
 	 * @param topics NULL-terminated list of strings
+	 * @param timeout_ms for the whole exchange, -1 for none
 	 */
 	int rc;
+	int64_t deadline = io_deadline(timeout_ms);
 	struct metadata_request *req;
 	req = metadata_request_new(topics, "libkafka");
-	rc = metadata_request_write(broker->fd, req);
+	rc = metadata_request_send(fd, req, deadline);
+	free(req);
 	if (rc == -1)
 		return NULL;
-	return metadata_response_read(broker->fd);
+	return metadata_response_recv(fd, deadline);
 }
 
 static void
@@ -33,41 +33,29 @@
 #include "../serialize.h"
 
 static topic_metadata_t *topic_metadata_new(char *topic, int32_t num_partitions,
-					hashtable_t *partitions, int16_t error);
+					struct map *partitions, int16_t error);
 
 static size_t topic_metadata_from_buffer(uint8_t *ptr,
-					hashtable_t *brokers,
+					struct map *brokers,
 					topic_metadata_t **out);
 
 KAFKA_EXPORT struct metadata_response *
 metadata_response_read(int fd)
 {
-	int rc;
-	uint8_t *buffer;
-	int32_t size = 0;
-	struct metadata_response *resp;
-
-	do {
-		rc = read(fd, &size, sizeof(int32_t));
-	} while (rc == -1 && errno == EINTR);
-
-	if (rc == -1)
-		return NULL;
-
-	size = ntohl(size);
-	buffer = calloc(size, 1);
-	do {
-		rc = read(fd, buffer, size);
-	} while (rc == -1 && errno == EINTR);
+	return metadata_response_recv(fd, -1);
+}
 
-	if (rc == -1) {
-		free(buffer);
-		return NULL;
-	}
+struct metadata_response *
+metadata_response_recv(int fd, int64_t deadline)
+{
+	frame_reader_t reader;
+	struct metadata_response *resp = NULL;
 
-	assert(rc == size);
-	resp = metadata_response_from_buffer(buffer, size);
-	free(buffer);
+	frame_reader_init(&reader);
+	if (frame_reader_recv(&reader, fd, deadline) == 0 && reader.body->len > 0)
+		resp = metadata_response_from_buffer(reader.body->data,
+				reader.body->len);
+	frame_reader_destroy(&reader);
 	return resp;
 }
 
@@ -79,10 +67,9 @@ metadata_response_from_buffer(uint8_t *buffer, size_t size)
 	struct metadata_response *resp;
 	ptr = buffer;
 	resp = calloc(1, sizeof *resp);
-	resp->brokers = hashtable_create(int32_hash, int32_cmp, NULL, NULL);
-	resp->metadata = hashtable_create(jenkins, keycmp, NULL, NULL);
 	ptr += uint32_unpack(ptr, &resp->correlation_id);
 	ptr += uint32_unpack(ptr, &resp->numBrokers);
+	resp->brokers = map_new_int32(resp->numBrokers, NULL);
 
 	for (i = 0; i < resp->numBrokers; i++) {
 		/* TODO: refactor this */
@@ -91,15 +78,16 @@ metadata_response_from_buffer(uint8_t *buffer, size_t size)
 		ptr += uint32_unpack(ptr, &b->id);
 		ptr += string_unpack(ptr, &b->hostname);
 		ptr += uint32_unpack(ptr, &b->port);
-		broker_connect(b);
-		hashtable_set(resp->brokers, &b->id, b);
+		map_set_int32(resp->brokers, b->id, b);
 	}
 
 	ptr += uint32_unpack(ptr, &resp->numTopics);
+	resp->metadata = map_new_string(resp->numTopics, NULL, NULL);
 	for (i = 0; i < resp->numTopics; i++) {
 		topic_metadata_t *topic;
 		ptr += topic_metadata_from_buffer(ptr, resp->brokers, &topic);
-		hashtable_set(resp->metadata, topic->topic, topic);
+		map_set_string(resp->metadata, topic->topic, topic->topic_len,
+			topic);
 	}
 
 	assert(ptr - buffer == size);
@@ -107,7 +95,7 @@ metadata_response_from_buffer(uint8_t *buffer, size_t size)
 }
 
 static topic_metadata_t *
-topic_metadata_new(char *topic, int32_t num_partitions, hashtable_t *partitions,
+topic_metadata_new(char *topic, int32_t num_partitions, struct map *partitions,
 		int16_t error)
 {
 	topic_metadata_t *t;
@@ -120,22 +108,26 @@ topic_metadata_new(char *topic, int32_t num_partitions, hashtable_t *partitions,
 }
 
 static size_t
-topic_metadata_from_buffer(uint8_t *ptr, hashtable_t *brokers, topic_metadata_t **out)
+topic_metadata_from_buffer(uint8_t *ptr, struct map *brokers, topic_metadata_t **out)
 {
 	int32_t i, numPartitions;
 	int16_t errCode;
 	char *topic;
-	hashtable_t *partitions;
+	size_t topicLen;
+	struct map *partitions;
 	size_t u = 0;
 	u += uint16_unpack(ptr, &errCode);
-        u += string_unpack(ptr+u, &topic);
+	topicLen = string_unpack(ptr+u, &topic);
+	u += topicLen;
+	topicLen -= 2;
 	u += uint32_unpack(ptr+u, &numPartitions);
-	partitions = hashtable_create(int32_hash, int32_cmp, NULL, NULL);
+	partitions = map_new_int32(numPartitions, NULL);
 	for (i = 0; i < numPartitions; i++) {
 		partition_metadata_t *part;
 		u += partition_metadata_from_buffer(ptr+u, brokers, &part);
-		hashtable_set(partitions, &part->partition_id, part);
+		map_set_int32(partitions, part->partition_id, part);
 	}
 	*out = topic_metadata_new(topic, numPartitions, partitions, errCode);
+	(*out)->topic_len = topicLen;
 	return u;
 }
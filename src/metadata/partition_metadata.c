@@ -31,32 +31,34 @@
 #include "../serialize.h"
 
 static size_t
-map_partition_replicas(uint8_t *ptr, hashtable_t *brokers, hashtable_t **out)
+map_partition_replicas(uint8_t *ptr, struct map *brokers, struct map **out)
 {
 	size_t u = 0;
 	int32_t i, num_replicas;
-	hashtable_t *r = hashtable_create(int32_hash, int32_cmp, free, NULL);
+	struct map *r;
 	u += uint32_unpack(ptr, &num_replicas);
+	r = map_new_int32(num_replicas, NULL);
 	for (i = 0; i < num_replicas; i++) {
-		int32_t *replica_id = calloc(1, sizeof(int32_t));
-		u += uint32_unpack(ptr, replica_id);
-		hashtable_set(r, replica_id, hashtable_get(brokers, replica_id));
+		int32_t replica_id;
+		u += uint32_unpack(ptr+u, &replica_id);
+		map_set_int32(r, replica_id, map_get_int32(brokers, replica_id));
 	}
 	*out = r;
 	return u;
 }
 
 static size_t
-map_partition_isr(uint8_t *ptr, hashtable_t *brokers, hashtable_t **out)
+map_partition_isr(uint8_t *ptr, struct map *brokers, struct map **out)
 {
 	size_t u = 0;
 	int32_t i, num_isr;
-	hashtable_t *isr = hashtable_create(int32_hash, int32_cmp, free, NULL);
+	struct map *isr;
 	u += uint32_unpack(ptr+u, &num_isr);
+	isr = map_new_int32(num_isr, NULL);
 	for (i = 0; i < num_isr; i++) {
-		int32_t *isr_id = calloc(1, sizeof(int32_t));
-		u += uint32_unpack(ptr+u, isr_id);
-		hashtable_set(isr, isr_id, hashtable_get(brokers, isr_id));
+		int32_t isr_id;
+		u += uint32_unpack(ptr+u, &isr_id);
+		map_set_int32(isr, isr_id, map_get_int32(brokers, isr_id));
 	}
 	*out = isr;
 	return u;
@@ -64,7 +66,7 @@ map_partition_isr(uint8_t *ptr, hashtable_t *brokers, hashtable_t **out)
 
 partition_metadata_t *
 partition_metadata_new(int32_t partition_id, broker_t *leader,
-		hashtable_t *replicas, hashtable_t *isr, int16_t error)
+		struct map *replicas, struct map *isr, int16_t error)
 {
 	partition_metadata_t *p;
 	p = calloc(1, sizeof *p);
@@ -77,7 +79,7 @@ partition_metadata_new(int32_t partition_id, broker_t *leader,
 }
 
 size_t
-partition_metadata_from_buffer(uint8_t *ptr, hashtable_t *brokers,
+partition_metadata_from_buffer(uint8_t *ptr, struct map *brokers,
 			partition_metadata_t **out)
 {
 	int32_t i;
@@ -85,13 +87,13 @@ partition_metadata_from_buffer(uint8_t *ptr, hashtable_t *brokers,
 	int32_t partition_id;
 	int32_t leader_id;
 	broker_t *leader;
-	hashtable_t *replicas, *isr;
+	struct map *replicas, *isr;
 	size_t u = 0;
 	u += uint16_unpack(ptr, &err_code);
 	u += uint32_unpack(ptr+u, &partition_id);
 	u += uint32_unpack(ptr+u, &leader_id);
 
-	leader = hashtable_get(brokers, &leader_id);
+	leader = map_get_int32(brokers, leader_id);
 	u += map_partition_replicas(ptr+u, brokers, &replicas);
 	u += map_partition_isr(ptr+u, brokers, &isr);
 
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+
+#include "mpsc.h"
+
+void
+mpsc_init(struct mpsc_queue *q)
+{
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+void
+mpsc_push(struct mpsc_queue *q, struct mpsc_node *n)
+{
+	struct mpsc_node *prev;
+	__atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+	/* the queue is briefly unlinked here; mpsc_pop() treats it as empty */
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+struct mpsc_node *
+mpsc_pop(struct mpsc_queue *q)
+{
+	/**
+	 * Returns NULL when the queue is empty, and also when a producer is
+	 * between the exchange and the link in mpsc_push(). Callers that
+	 * count pushes can tell the two apart and simply try again.
+	 */
+	struct mpsc_node *tail = q->tail;
+	struct mpsc_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	struct mpsc_node *head;
+
+	if (tail == &q->stub) {
+		if (!next)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	if (tail != head)
+		return NULL;
+	mpsc_push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "msgvec.h"
+
+void
+msgvec_init(struct msgvec *v)
+{
+	v->size = 0;
+	v->alloced = MSGVEC_INLINE;
+	v->heap = NULL;
+}
+
+void
+msgvec_destroy(struct msgvec *v)
+{
+	free(v->heap);
+	msgvec_init(v);
+}
+
+static int
+msgvec_reserve(struct msgvec *v, unsigned size)
+{
+	unsigned u = v->alloced;
+	struct kafka_message **ptr;
+	if (size <= v->alloced)
+		return 0;
+	while (u < size)
+		u *= 2;
+	if (v->heap) {
+		ptr = realloc(v->heap, u * sizeof *ptr);
+	} else {
+		ptr = malloc(u * sizeof *ptr);
+		if (ptr)
+			memcpy(ptr, v->inline_msgs, v->size * sizeof *ptr);
+	}
+	if (!ptr)
+		return -1;
+	v->heap = ptr;
+	v->alloced = u;
+	return 0;
+}
+
+int
+msgvec_push_back(struct msgvec *v, struct kafka_message *msg)
+{
+	/* on failure v is left as it was */
+	if (v->size == v->alloced && msgvec_reserve(v, v->size + 1) != 0)
+		return -1;
+	msgvec_data(v)[v->size++] = msg;
+	return 0;
+}
+
+void
+msgvec_append(struct msgvec *v, struct msgvec *from)
+{
+	int res = msgvec_reserve(v, v->size + from->size);
+	assert(res == 0);
+	(void)res;
+	memcpy(msgvec_data(v) + v->size, msgvec_data(from),
+		from->size * sizeof(struct kafka_message *));
+	v->size += from->size;
+}
+
+void
+msgvec_swap(struct msgvec *a, struct msgvec *b)
+{
+	/* inline storage is located through msgvec_data(), so this is safe */
+	struct msgvec tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MSGVEC_H
+#define MSGVEC_H
+
+struct kafka_message;
+
+/**
+ * Growable array of message pointers. The first MSGVEC_INLINE entries live
+ * inside the struct, so small batches (and single-message sends) need no
+ * allocation for the container. Elements are accessed without bounds or
+ * magic checks; use msgvec_data() and msgvec_size() to iterate.
+ *
+ * A msgvec never owns the messages it points to.
+ */
+#define MSGVEC_INLINE 8
+
+struct msgvec {
+	unsigned size;
+	unsigned alloced;
+	struct kafka_message **heap;
+	struct kafka_message *inline_msgs[MSGVEC_INLINE];
+};
+
+void msgvec_init(struct msgvec *v);
+void msgvec_destroy(struct msgvec *v);
+int msgvec_push_back(struct msgvec *v, struct kafka_message *msg);
+void msgvec_append(struct msgvec *v, struct msgvec *from);
+void msgvec_swap(struct msgvec *a, struct msgvec *b);
+
+static inline struct kafka_message **
+msgvec_data(struct msgvec *v)
+{
+	return v->heap ? v->heap : v->inline_msgs;
+}
+
+static inline unsigned
+msgvec_size(const struct msgvec *v)
+{
+	return v->size;
+}
+
+static inline struct kafka_message *
+msgvec_pop_back(struct msgvec *v)
+{
+	return msgvec_data(v)[--v->size];
+}
+
+static inline void
+msgvec_clear(struct msgvec *v)
+{
+	v->size = 0;
+}
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <kafka.h>
+#include "../kafka-private.h"
+
+/**
+ * Producer-wide byte budget. Every send charges the packed size of its
+ * messages before they are queued and gives it back once the sender is
+ * done with them, delivered or not. With no budget left a send fails,
+ * blocks until enough is given back, or, with
+ * KAFKA_BUFFER_FULL_DROP_OLDEST, blocks while the sender drops the
+ * messages waiting on a retry, which are the oldest it holds.
+ */
+
+void
+producer_budget_init(struct kafka_producer *p)
+{
+	pthread_condattr_t attr;
+	pthread_mutex_init(&p->budget_lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&p->budget_freed, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+void
+producer_budget_destroy(struct kafka_producer *p)
+{
+	pthread_cond_destroy(&p->budget_freed);
+	pthread_mutex_destroy(&p->budget_lock);
+}
+
+static int
+budget_try(struct kafka_producer *p, size_t bytes)
+{
+	size_t used = __atomic_load_n(&p->buffered_bytes, __ATOMIC_SEQ_CST);
+	do {
+		if (used + bytes > p->config.max_buffered_bytes)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&p->buffered_bytes, &used,
+			used + bytes, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	return 1;
+}
+
+int
+producer_budget_reserve(struct kafka_producer *p, size_t bytes)
+{
+	int res = KAFKA_OK;
+	struct timespec deadline;
+	int timeout = p->config.buffer_full_timeout_ms;
+
+	if (!p->config.max_buffered_bytes) {
+		__atomic_add_fetch(&p->buffered_bytes, bytes, __ATOMIC_SEQ_CST);
+		return KAFKA_OK;
+	}
+	if (bytes > p->config.max_buffered_bytes)
+		return KAFKA_BUFFER_FULL;
+	if (budget_try(p, bytes))
+		return KAFKA_OK;
+	if (p->config.buffer_full_policy == KAFKA_BUFFER_FULL_FAIL)
+		return KAFKA_BUFFER_FULL;
+
+	if (timeout >= 0)
+		deadline_after_ms(&deadline, timeout);
+	pthread_mutex_lock(&p->budget_lock);
+	__atomic_add_fetch(&p->budget_waiters, 1, __ATOMIC_SEQ_CST);
+	if (p->config.buffer_full_policy == KAFKA_BUFFER_FULL_DROP_OLDEST)
+		producer_sender_wakeup(p);
+	while (!budget_try(p, bytes)) {
+		if (timeout < 0) {
+			pthread_cond_wait(&p->budget_freed, &p->budget_lock);
+		} else if (pthread_cond_timedwait(&p->budget_freed,
+				&p->budget_lock, &deadline) == ETIMEDOUT) {
+			res = KAFKA_BUFFER_FULL;
+			break;
+		}
+	}
+	__atomic_sub_fetch(&p->budget_waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&p->budget_lock);
+	return res;
+}
+
+void
+producer_budget_release(struct kafka_producer *p, size_t bytes)
+{
+	__atomic_sub_fetch(&p->buffered_bytes, bytes, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&p->budget_waiters, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&p->budget_lock);
+		pthread_cond_broadcast(&p->budget_freed);
+		pthread_mutex_unlock(&p->budget_lock);
+	}
+}
+
+int
+producer_budget_drop_wanted(struct kafka_producer *p)
+{
+	/**
+	 * True when the sender should stop retrying what it holds because
+	 * newer sends are waiting for room.
+	 */
+	return p->config.buffer_full_policy == KAFKA_BUFFER_FULL_DROP_OLDEST &&
+		__atomic_load_n(&p->budget_waiters, __ATOMIC_SEQ_CST) != 0;
+}
+
+KAFKA_EXPORT size_t
+kafka_producer_buffered_bytes(struct kafka_producer *p)
+{
+	CHECK_OBJ_NOTNULL(p, KAFKA_PRODUCER_MAGIC);
+	return __atomic_load_n(&p->buffered_bytes, __ATOMIC_RELAXED);
+}
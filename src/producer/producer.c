@@ -29,61 +29,126 @@
 #include <time.h>
 #include <assert.h>
 #include <string.h>
-#include <arpa/inet.h>
-#include <poll.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include <zookeeper/zookeeper.h>
 
 #include <kafka.h>
 #include "../kafka-private.h"
 #include "../jansson/jansson.h"
-#include "serialize.h"
 
-static void producer_metadata_free(struct kafka_producer *p);
-static struct metadata_response *bootstrap_metadata(zhandle_t *zh);
+static struct metadata_response *bootstrap_metadata(struct kafka_producer *p);
+static broker_conn_t **bootstrap_zookeeper(struct kafka_producer *p,
+					unsigned *n);
+static broker_conn_t **bootstrap_list(struct kafka_producer *p, unsigned *n);
 static json_t *bootstrap_brokers(zhandle_t *zh);
+static void connect_brokers(struct kafka_producer *p);
+static int submit_and_wait(struct kafka_producer *p, struct msgvec *messages,
+			int16_t sync);
+static int enqueue_and_wait(struct kafka_producer *p, struct msgvec *messages,
+			int16_t sync);
 
-static partition_metadata_t *pick_random_topic_partition(struct kafka_producer *p,
-							struct kafka_message *msg);
-
-static hashtable_t *parse_produce_response(KafkaBuffer *buffer);
-static int send_produce_request(struct kafka_producer *p, int32_t brokerId,
-				hashtable_t *topics_partitions, int16_t sync,
-				hashtable_t **failuresOut);
-
-static hashtable_t *broker_message_map(struct kafka_producer *p,
-				struct vector *messages);
-static void broker_message_map_free(hashtable_t *map);
-
-static int handle_topics_partitions_failures(hashtable_t *topicsPartitions,
-					hashtable_t *failedRequest,
-					struct vector *failedMessages);
-
-static int try_send(struct kafka_producer *p, struct vector *messages,
-		int16_t sync);
-static int dispatch(struct kafka_producer *p, struct vector *messages,
-		int16_t sync, struct vector **out);
+KAFKA_EXPORT void
+kafka_producer_config_init(struct kafka_producer_config *config)
+{
+	memset(config, 0, sizeof *config);
+	config->zookeeper = NULL;
+	config->brokers = NULL;
+	config->max_buffered_bytes = 64 * 1024 * 1024;
+	config->buffer_full_policy = KAFKA_BUFFER_FULL_BLOCK;
+	config->buffer_full_timeout_ms = 30000;
+	config->spool_path = NULL;
+	config->spool_max_bytes = 1024 * 1024 * 1024;
+	config->wal_path = NULL;
+	config->wal_max_bytes = 1024 * 1024 * 1024;
+	config->max_retries = 5;
+	config->retry_backoff_ms = 100;
+	config->retry_backoff_max_ms = 2000;
+	config->acks = KAFKA_REQUEST_SYNC;
+	config->request_timeout_ms = 1500;
+	config->socket_timeout_ms = 5000;
+	config->reconnect_backoff_ms = 100;
+	config->reconnect_backoff_max_ms = 10000;
+	config->connect_timeout_ms = 3000;
+	config->dns_ttl_ms = 60000;
+	config->dns_negative_ttl_ms = 5000;
+	config->dns_async = 0;
+	config->tcp_nodelay = 1;
+	config->socket_send_buffer = 0;
+	config->socket_receive_buffer = 0;
+	config->socket_keepalive_ms = 0;
+	config->socket_busy_poll_us = 0;
+	config->tcp_user_timeout_ms = 0;
+}
 
 KAFKA_EXPORT struct kafka_producer *
 kafka_producer_new(const char *zkServer)
 {
-	int rc;
+	struct kafka_producer_config config;
+	kafka_producer_config_init(&config);
+	config.zookeeper = zkServer;
+	return kafka_producer_new_with_config(&config);
+}
+
+KAFKA_EXPORT struct kafka_producer *
+kafka_producer_new_with_config(const struct kafka_producer_config *config)
+{
 	struct kafka_producer *p;
-	struct metadata_response *metadata_resp;
+	const char *zkServer;
+	pthread_condattr_t attr;
+	socket_options_t sockopts;
 
 	srand(time(0));
 
-	p = calloc(1, sizeof *p);
+	ALLOC_OBJ(p, KAFKA_PRODUCER_MAGIC);
 	if (!p)
 		return NULL;
 
+	p->config = *config;
+	zkServer = p->config.zookeeper;
+	p->config.zookeeper = NULL;	/* not ours to keep */
+	if (p->config.brokers)
+		p->bootstrap = strdup(p->config.brokers);
+	p->config.brokers = NULL;
+
 	p->res = KAFKA_OK;
+	p->buffers = KafkaBufferPoolNew();
+	frame_reader_init(&p->reader);
+	producer_stats_init(p);
+	p->resolver = resolver_new(p->config.dns_ttl_ms,
+			p->config.dns_negative_ttl_ms, p->config.dns_async);
+	sockopts.nodelay = p->config.tcp_nodelay;
+	sockopts.sndbuf = p->config.socket_send_buffer;
+	sockopts.rcvbuf = p->config.socket_receive_buffer;
+	sockopts.keepalive_ms = p->config.socket_keepalive_ms;
+	sockopts.busy_poll_us = p->config.socket_busy_poll_us;
+	sockopts.user_timeout_ms = p->config.tcp_user_timeout_ms;
+	p->conns = conn_pool_new(p->config.reconnect_backoff_ms,
+			p->config.reconnect_backoff_max_ms,
+			p->config.connect_timeout_ms, p->resolver, &sockopts);
+	producer_budget_init(p);
+	pthread_mutex_init(&p->metadata_lock, NULL);
+	pthread_mutex_init(&p->sender_lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&p->sender_wakeup, &attr);
+	pthread_condattr_destroy(&attr);
+	mpsc_init(&p->queue);
+	p->sender_seed = time(0);
+	if (producer_shards_init(p) != 0) {
+		p->res = KAFKA_PRODUCER_ERROR;
+		goto finish;
+	}
+	p->shards_ready = 1;
 
 	/* TODO: make this configurable */
 	zoo_set_debug_level(ZOO_LOG_LEVEL_WARN);
 
-	if (zkServer) {
+	if (p->bootstrap) {
+		/* brokers are listed; ZooKeeper is not needed */
+	} else if (zkServer) {
 		p->zh = zookeeper_init(zkServer, producer_init_watcher, 10000,
 				&p->cid, p, 0);
 	} else {
@@ -92,21 +157,29 @@ kafka_producer_new(const char *zkServer)
 				10000, &p->cid, p, 0);
 	}
 
-	if (!p->zh) {
+	if (!p->zh && !p->bootstrap) {
 		p->res = KAFKA_ZOOKEEPER_INIT_ERROR;
 		goto finish;
 	}
 
-	p->magic = KAFKA_PRODUCER_MAGIC;
+	if (producer_spool_open(p) != 0 || producer_wal_open(p) != 0) {
+		p->res = KAFKA_PRODUCER_ERROR;
+		goto finish;
+	}
 
-	metadata_resp = bootstrap_metadata(p->zh);
-	if (!metadata_resp) {
+	if (producer_metadata_refresh(p) != KAFKA_OK) {
 		p->res = KAFKA_METADATA_ERROR;
 		goto finish;
 	}
-	p->brokers = metadata_resp->brokers;
-	p->metadata = metadata_resp->metadata;
-	free(metadata_resp);
+	connect_brokers(p);
+
+	p->running = 1;
+	if (pthread_create(&p->sender, NULL, producer_sender_main, p) != 0) {
+		p->running = 0;
+		p->res = KAFKA_PRODUCER_ERROR;
+		goto finish;
+	}
+	p->sender_started = 1;
 finish:
 	return p;
 }
@@ -129,459 +202,447 @@ kafka_producer_send(struct kafka_producer *p, struct kafka_message *msg,
 	 * - KAFKA_REQUEST_ASYNC: no ack response
 	 * - KAFKA_REQUEST_SYNC: ack response after message is written to log
 	 * - KAFKA_REQUEST_FULL_SYNC: ack response after full replication
+	 * - KAFKA_REQUEST_DEFAULT: whichever of these the config asks for
 	 *
-	 * Async should be handled a bit differently. You need to build up a
-	 * data structure of N messages and batch them all at once at a later
-	 * time. Probably using a separate thread.
+	 * Any number of threads may call this on the same producer. The
+	 * message is batched in the calling thread's shard, the sender thread
+	 * merges it with whatever the other shards hold, and the call returns
+	 * once it has been delivered (or given up on) at the requested level.
+	 * With a write-ahead log it returns once the message is logged, and
+	 * the sender sees it acked from there.
 	 */
 	int res;
+	struct msgvec vec;
 	CHECK_OBJ_NOTNULL(p, KAFKA_PRODUCER_MAGIC);
 
-	struct vector *vec = vector_new(1, NULL);
-	vector_push_back(vec, msg);
-	return try_send(p, vec, sync);
+	/* a single message fits in the inline storage; nothing is allocated */
+	msgvec_init(&vec);
+	msgvec_push_back(&vec, msg);
+	res = enqueue_and_wait(p, &vec, sync);
+	msgvec_destroy(&vec);
+	return res;
 }
 
 KAFKA_EXPORT int
 kafka_producer_send_batch(struct kafka_producer *p,
 			struct kafka_message_set *set, int16_t sync)
 {
-	int res, retries = 4;
 	CHECK_OBJ_NOTNULL(p, KAFKA_PRODUCER_MAGIC);
 
 	if (!set)
 		return -1;
-	struct vector *vec = set->messages;
-	return try_send(p, set->messages, sync);
+	return enqueue_and_wait(p, &set->messages, sync);
+}
+
+KAFKA_EXPORT int
+kafka_producer_send_sealed(struct kafka_producer *p, const char *topic,
+			struct kafka_message_set *set, int16_t sync)
+{
+	/**
+	 * Sends a set sealed with kafka_message_set_seal() to a partition of
+	 * topic, all of it in one piece. The set is only read, so the same
+	 * one may be sent by several threads and producers at once.
+	 */
+	int res;
+	struct msgvec vec;
+	struct kafka_message carrier;
+	CHECK_OBJ_NOTNULL(p, KAFKA_PRODUCER_MAGIC);
+
+	if (!set || !set->sealed || !topic || strlen(topic) > INT16_MAX)
+		return -1;
+	/* stands in for the set's messages, on our stack like the job */
+	memset(&carrier, 0, sizeof carrier);
+	carrier.topic = (char *)topic;
+	carrier.topic_len = strlen(topic);
+	carrier.partition = -1;
+	carrier.sealed = set->sealed;
+	carrier.sealed_size = set->sealed_size;
+	carrier.sealed_count = msgvec_size(&set->messages);
+	msgvec_init(&vec);
+	msgvec_push_back(&vec, &carrier);
+	res = enqueue_and_wait(p, &vec, sync);
+	msgvec_destroy(&vec);
+	return res;
 }
 
 KAFKA_EXPORT void
 kafka_producer_free(struct kafka_producer *p)
 {
 	CHECK_OBJ_NOTNULL(p, KAFKA_PRODUCER_MAGIC);
+	if (p->sender_started) {
+		__atomic_store_n(&p->running, 0, __ATOMIC_SEQ_CST);
+		producer_sender_wakeup(p);
+		pthread_join(p->sender, NULL);
+	}
+	if (p->shards_ready)
+		producer_shards_free(p);
 	if (p->zh)
 		zookeeper_close(p->zh);
-	producer_metadata_free(p);
-	free(p);
+	free(p->bootstrap);
+	producer_metadata_release(p->metadata);
+	KafkaBufferPoolFree(p->buffers);
+	frame_reader_destroy(&p->reader);
+	producer_stats_destroy(p);
+	producer_spool_close(p);
+	producer_wal_close(p);
+	conn_pool_free(p->conns);
+	resolver_free(p->resolver);
+	producer_budget_destroy(p);
+	pthread_cond_destroy(&p->sender_wakeup);
+	pthread_mutex_destroy(&p->sender_lock);
+	pthread_mutex_destroy(&p->metadata_lock);
+	FREE_OBJ(p);
 }
 
-static void
-producer_metadata_free(struct kafka_producer *p)
+static int
+enqueue_and_wait(struct kafka_producer *p, struct msgvec *messages, int16_t sync)
 {
-	void *i, *j;
-
-	if (p->brokers) {
-		i = hashtable_iter(p->brokers);
-		for (; i; i = hashtable_iter_next(p->brokers, i)) {
-			int fd;
-			broker_t *broker = hashtable_iter_value(i);
-			if (broker) {
-				close(broker->fd);
-				free(broker->hostname);
-				free(broker);
-			}
-		}
-		hashtable_destroy(p->brokers);
-	}
-
-	/* TODO: setup value free in hashtable_create so this can go away */
-	if (p->metadata) {
-		i = hashtable_iter(p->metadata);
-		for (; i; i = hashtable_iter_next(p->metadata, i)) {
-			topic_metadata_t *topic = hashtable_iter_value(i);
-			j = hashtable_iter(topic->partitions);
-			for (; j; j = hashtable_iter_next(topic->partitions, j)) {
-				partition_metadata_t *part = hashtable_iter_value(j);
-				hashtable_destroy(part->replicas);
-				hashtable_destroy(part->isr);
-				free(part);
-			}
-			hashtable_destroy(topic->partitions);
-			free(topic->topic);
-			free(topic);
+	/**
+	 * The sender works on copies of the messages, which carry the
+	 * partition and job of this one send. The caller's messages are only
+	 * read, so the same ones may be in several sends at once. With a
+	 * write-ahead log the copies only last until they are logged.
+	 */
+	unsigned u, n = msgvec_size(messages);
+	int res;
+	struct kafka_message one, *copies;
+	struct msgvec vec;
+
+	if (!p->sender_started)
+		return p->res != KAFKA_OK ? p->res : KAFKA_PRODUCER_ERROR;
+	if (sync == KAFKA_REQUEST_DEFAULT)
+		sync = p->config.acks;
+	if (n == 0)
+		return KAFKA_OK;
+
+	copies = n == 1 ? &one : malloc(n * sizeof *copies);
+	if (!copies)
+		return KAFKA_PRODUCER_ERROR;
+	msgvec_init(&vec);
+	for (u = 0; u < n; u++) {
+		copies[u] = *msgvec_data(messages)[u];
+		copies[u].job = NULL;
+		/* a partition only sticks for the retries of this send */
+		copies[u].partition = -1;
+		if (msgvec_push_back(&vec, &copies[u]) != 0) {
+			res = KAFKA_PRODUCER_ERROR;
+			goto out;
 		}
-		hashtable_destroy(p->metadata);
 	}
+	if (p->wal)
+		res = producer_wal_send(p, &vec, sync);
+	else
+		res = submit_and_wait(p, &vec, sync);
+out:
+	msgvec_destroy(&vec);
+	if (copies != &one)
+		free(copies);
+	return res;
 }
 
-static struct metadata_response *
-bootstrap_metadata(zhandle_t *zh)
+static int
+submit_and_wait(struct kafka_producer *p, struct msgvec *messages, int16_t sync)
 {
 	/**
-	 * @todo: bootstrap for subset of topics and only set those topics
-	 * rather than overwriting all metadata.
+	 * The job lives on the caller's stack; the sender posts job.done as
+	 * the very last thing it does with it.
 	 */
-	void *iter;
-	json_t *brokers;
-	struct metadata_response *resp;
-	brokers = bootstrap_brokers(zh);
-	if (!brokers) {
-		return NULL;
-	}
-
-	/* query for metadata */
-	iter = json_object_iter(brokers);
-	for (; iter; iter = json_object_iter_next(brokers, iter)) {
-		json_t *obj = json_object_iter_value(iter);
-		broker_t broker;
-		memset(&broker, 0, sizeof broker);
-		broker.hostname = (char *)json_string_value(json_object_get(obj, "host"));
-		broker.port = json_integer_value(json_object_get(obj, "port"));
-		broker.id = json_integer_value(json_object_get(obj, "id"));
-		broker_connect(&broker);
-		/* TODO: check for "Leader Not Available" responses and wait/retry */
-		resp = topic_metadata_request(&broker, NULL);
-		close(broker.fd);
-		if (resp)
-			break;
+	unsigned u;
+	int res;
+	struct produce_job job;
+
+	memset(&job, 0, sizeof job);
+	job.messages = messages;
+	job.pending = msgvec_size(messages);
+	job.res = KAFKA_OK;
+	for (u = 0; u < msgvec_size(messages); u++)
+		job.bytes += kafka_message_wire_size(msgvec_data(messages)[u]);
+
+	res = producer_budget_reserve(p, job.bytes);
+	if (res != KAFKA_OK)
+		return res;
+
+	sem_init(&job.done, 0, 0);
+	job.enqueued_us = monotonic_us();
+	if (producer_shard_submit(p, &job, sync) != KAFKA_OK) {
+		sem_destroy(&job.done);
+		producer_budget_release(p, job.bytes);
+		return KAFKA_PRODUCER_ERROR;
 	}
-	json_decref(brokers);
-	return resp;
-}
 
-static json_t *
-bootstrap_brokers(zhandle_t *zh)
-{
-	int rc, i;
-	struct String_vector ids;
-	json_t *js;
-	rc = zoo_get_children(zh, "/brokers/ids", 0, &ids);
-	if (rc != ZOK || ids.count == 0)
-		return NULL;
-	js = json_object();
-	for (i = 0; i < ids.count; i++) {
-		char *znode;
-		json_t *broker;
-		znode = string_builder("/brokers/ids/%s", ids.data[i]);
-		assert(znode);
-		broker = get_json_from_znode(zh, znode);
-		free(znode);
-		if (broker) {
-			/* steal reference to broker */
-			json_object_set_new(js, ids.data[i], broker);
-		}
-	}
-	return js;
+	while (sem_wait(&job.done) == -1 && errno == EINTR)
+		;
+	sem_destroy(&job.done);
+	producer_budget_release(p, job.bytes);
+	return job.res;
 }
 
-static partition_metadata_t *
-pick_random_topic_partition(struct kafka_producer *p, struct kafka_message *msg)
+void
+producer_enqueue(struct kafka_producer *p, struct mpsc_node *node)
 {
-	int32_t part;
-	topic_metadata_t *topic;
-	topic = hashtable_get(p->metadata, msg->topic);
-	if (!topic)
-		return NULL;
-	part = rand() % topic->num_partitions;
-	return hashtable_get(topic->partitions, &part);
-}
-
-static void
-mark_failure(hashtable_t *failures, const char *topic, int32_t partition)
-{
-	int32_t *pid;
-	struct vector *partitionFailures;
-	assert(failures);
-	partitionFailures = hashtable_get(failures, topic);
-	if (!partitionFailures) {
-		partitionFailures = vector_new(0, free);
-		hashtable_set(failures, strdup(topic), partitionFailures);
-	}
-	pid = malloc(sizeof(int32_t));
-	*pid = partition;
-	vector_push_back(partitionFailures, pid);
+	/**
+	 * Lock-free unless the sender is asleep, in which case it has to be
+	 * woken up through its condition variable.
+	 */
+	mpsc_push(&p->queue, node);
+	__atomic_add_fetch(&p->enqueued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&p->sender_idle, __ATOMIC_SEQ_CST))
+		producer_sender_wakeup(p);
 }
 
-static hashtable_t *
-parse_produce_response(KafkaBuffer *buffer)
+void
+producer_sender_wakeup(struct kafka_producer *p)
 {
-	hashtable_t *failures = NULL;
-	int32_t correlation_id, num_topics, i, j;
-	buffer->cur += uint32_unpack(buffer->cur, &correlation_id);
-	buffer->cur += uint32_unpack(buffer->cur, &num_topics);
-	for (i = 0; i < num_topics; i++) {
-		int32_t num_partitions;
-		char *topic;
-		buffer->cur += string_unpack(buffer->cur, &topic);
-		buffer->cur += uint32_unpack(buffer->cur, &num_partitions);
-		for (j = 0; j < num_partitions; j++) {
-			int32_t partition;
-			int16_t error;
-			int64_t offset;
-			buffer->cur += uint32_unpack(buffer->cur, &partition);
-			buffer->cur += uint16_unpack(buffer->cur, &error);
-			buffer->cur += uint64_unpack(buffer->cur, &offset);
-
-			if (error != KAFKA_OK) {
-				fprintf(stderr, "%s\n", kafka_status_string(error));
-				if (!failures) {
-					failures = hashtable_create(jenkins, keycmp, free, NULL);
-				}
-				mark_failure(failures, topic, partition);
-			}
-		}
-	}
-	return failures;
+	pthread_mutex_lock(&p->sender_lock);
+	pthread_cond_signal(&p->sender_wakeup);
+	pthread_mutex_unlock(&p->sender_lock);
 }
 
-static hashtable_t *
-mark_every_failure(hashtable_t *topicsAndPartitions)
+producer_metadata_t *
+producer_metadata_acquire(struct kafka_producer *p)
 {
 	/**
-	 * Marks every topic partition as a failure.
+	 * Returns a reference to the current metadata snapshot, which stays
+	 * valid until it is released even if the producer swaps in a newer
+	 * one in the meantime.
 	 */
-	void *i, *j;
-	hashtable_t *failures = hashtable_create(jenkins, keycmp, free, NULL);
-	i = hashtable_iter(topicsAndPartitions);
-	for (; i; i = hashtable_iter_next(topicsAndPartitions, i)) {
-		const char *topic = hashtable_iter_key(i);
-		hashtable_t *partitions = hashtable_iter_value(i);
-		j = hashtable_iter(partitions);
-		for (; j; j = hashtable_iter_next(partitions, j)) {
-			int32_t pid = *(int32_t *)hashtable_iter_key(j);
-			mark_failure(failures, topic, pid);
-		}
-	}
-	return failures;
+	producer_metadata_t *md;
+	pthread_mutex_lock(&p->metadata_lock);
+	md = p->metadata;
+	if (md)
+		__atomic_add_fetch(&md->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&p->metadata_lock);
+	return md;
 }
 
-static int
-send_produce_request(struct kafka_producer *p, int32_t brokerId,
-		hashtable_t *topics_partitions, int16_t sync, hashtable_t **failuresOut)
+void
+producer_metadata_release(producer_metadata_t *md)
 {
-	int rc;
-	int res = 0;
-	hashtable_t *failures = NULL;
-	int32_t correlation_id = 0;
-	size_t len;
-	request_header_t header;
-	const char *client = "libkafka";
-	KafkaBuffer *buffer = KafkaBufferNew(0);
-
-	memset(&header, 0, sizeof header);
-	header.apikey = PRODUCE;
-	header.correlation_id = correlation_id++;
-	len = sizeof header;
-	len += 2 + strlen(client);
-	len += 2 + 4 + 4; /* acks, ttl, topics */
-
-	KafkaBufferReserve(buffer, len);
-	buffer->cur = buffer->data;
-	buffer->cur += request_header_pack(&header, client, buffer->cur);
-	buffer->cur += uint16_pack(sync, buffer->cur);
-	buffer->cur += uint32_pack(1500, buffer->cur); /*ttl*/
-
-	header.size = serialize_topics_and_partitions(topics_partitions, buffer);
-	uint32_pack(header.size-4, &buffer->data[0]);
-
-	broker_t *broker = hashtable_get(p->brokers, &brokerId);
-	if (!broker) {
-		failures = mark_every_failure(topics_partitions);
-		res = -1;
-		goto finish;
-	}
-
-	do {
-		rc = write(broker->fd, buffer->data, buffer->cur - buffer->data);
-	} while (rc == -1 && errno == EINTR);
+	void *i, *j;
 
-	if (rc == -1) {
-		failures = mark_every_failure(topics_partitions);
-		res = -1;
-		goto finish;
-	}
+	if (!md || __atomic_sub_fetch(&md->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
 
-	if (sync != KAFKA_REQUEST_ASYNC) {
-		int32_t rlen = 0;
-		rc = read(broker->fd, &rlen, 4);
-		if (rc <= 0) {
-			failures = mark_every_failure(topics_partitions);
-			res = -1;
-			goto finish;
+	if (md->brokers) {
+		i = map_iter(md->brokers);
+		for (; i; i = map_iter_next(md->brokers, i)) {
+			broker_t *broker = map_iter_value(i);
+			if (broker) {
+				free(broker->hostname);
+				free(broker);
+			}
 		}
+		map_free(md->brokers);
+	}
 
-		rlen = ntohl(rlen);
-
-		if (rlen > 0) {
-			KafkaBuffer *rbuf = KafkaBufferNew(rlen);
-			rc = read(broker->fd, rbuf->data, rbuf->alloced);
-			if (rc != rlen) {
-				failures = mark_every_failure(topics_partitions);
-				res = -1;
-				KafkaBufferFree(rbuf);
-				goto finish;
+	/* TODO: setup value free in map_new_* so this can go away */
+	if (md->topics) {
+		i = map_iter(md->topics);
+		for (; i; i = map_iter_next(md->topics, i)) {
+			topic_metadata_t *topic = map_iter_value(i);
+			j = map_iter(topic->partitions);
+			for (; j; j = map_iter_next(topic->partitions, j)) {
+				partition_metadata_t *part = map_iter_value(j);
+				map_free(part->replicas);
+				map_free(part->isr);
+				free(part);
 			}
-			rbuf->len = rbuf->alloced;
-			rbuf->cur = rbuf->data;
-
-			failures = parse_produce_response(rbuf);
-			KafkaBufferFree(rbuf);
+			map_free(topic->partitions);
+			free(topic->topic);
+			free(topic);
 		}
+		map_free(md->topics);
 	}
-finish:
-	KafkaBufferFree(buffer);
-	*failuresOut = failures;
-	return res;
+	free(md);
 }
 
-static hashtable_t *
-broker_message_map(struct kafka_producer *p, struct vector *messages)
+int
+producer_metadata_refresh(struct kafka_producer *p)
 {
 	/**
-	 * broker_message_map = { broker: { topic: { partition: [msg set] } } }
+	 * Bootstraps fresh metadata and publishes it. Readers holding the old
+	 * snapshot keep using it until they release it.
 	 */
-	int i;
-	hashtable_t *map;
-
-	map = hashtable_create(int32_hash, int32_cmp, free, NULL);
-	for (i = 0; i < vector_size(messages); i++) {
-		partition_metadata_t *pm;
-		hashtable_t *topics;
-		hashtable_t *topic_partitions;
-		struct vector *msgSet;
-
-		struct kafka_message *msg = vector_at(messages, i);
-
-		/* TODO: make use of different partitioners */
-		pm = pick_random_topic_partition(p, msg);
-
-		int32_t *leaderId = malloc(sizeof(int32_t));
-		int32_t *partId = malloc(sizeof(int32_t));
-		*leaderId = pm->leader->id;
-		*partId = pm->partition_id;
-
-		topics = hashtable_get(map, leaderId);
-		if (!topics) {
-			topics = hashtable_create(jenkins, keycmp, free, NULL);
-			hashtable_set(map, leaderId, topics);
-		}
-
-		topic_partitions = hashtable_get(topics, msg->topic);
-		if (!topic_partitions) {
-			topic_partitions = hashtable_create(int32_hash, int32_cmp, free, NULL);
-			hashtable_set(topics, strdup(msg->topic), topic_partitions);
-		}
+	producer_metadata_t *md, *old;
+	struct metadata_response *resp;
 
-		msgSet = hashtable_get(topic_partitions, partId);
-		if (!msgSet) {
-			msgSet = vector_new(0, NULL);
-			hashtable_set(topic_partitions, partId, msgSet);
-		}
-		vector_push_back(msgSet, msg);
+	md = calloc(1, sizeof *md);
+	if (!md)
+		return KAFKA_PRODUCER_ERROR;
+	resp = bootstrap_metadata(p);
+	if (!resp) {
+		free(md);
+		return KAFKA_METADATA_ERROR;
 	}
-	return map;
+	md->refs = 1;
+	md->brokers = resp->brokers;
+	md->topics = resp->metadata;
+	free(resp);
+
+	pthread_mutex_lock(&p->metadata_lock);
+	old = p->metadata;
+	p->metadata = md;
+	__atomic_add_fetch(&p->metadata_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&p->metadata_lock);
+	producer_metadata_release(old);
+	return KAFKA_OK;
 }
 
 static void
-broker_message_map_free(hashtable_t *map)
+connect_brokers(struct kafka_producer *p)
 {
-	void *i, *j, *k;
-	if (map) {
-		i = hashtable_iter(map);
-		for (; i; i = hashtable_iter_next(map, i)) {
-			hashtable_t *topics = hashtable_iter_value(i);
-			j = hashtable_iter(topics);
-			for (; j; j = hashtable_iter_next(topics, j)) {
-				hashtable_t *partitions = hashtable_iter_value(j);
-				k = hashtable_iter(partitions);
-				for (; k; k = hashtable_iter_next(partitions, k)) {
-					struct vector *vec = hashtable_iter_value(k);
-					vector_free(vec);
-				}
-				hashtable_destroy(partitions);
-			}
-			hashtable_destroy(topics);
-		}
-		hashtable_destroy(map);
+	/**
+	 * Warms up connections to every broker in the metadata in parallel,
+	 * so a cold start costs one connect timeout at most.
+	 */
+	void *iter;
+	unsigned n = 0;
+	broker_conn_t **conns;
+	producer_metadata_t *md = p->metadata;
+
+	conns = malloc(map_size(md->brokers) * sizeof *conns);
+	iter = map_iter(md->brokers);
+	for (; iter; iter = map_iter_next(md->brokers, iter)) {
+		broker_t *broker = map_iter_value(iter);
+		conns[n++] = conn_pool_get(p->conns, broker->id,
+				broker->hostname, broker->port);
 	}
+	conn_pool_connect(p->conns, conns, n, monotonic_ms());
+	free(conns);
 }
 
-static int
-handle_topics_partitions_failures(hashtable_t *topicsPartitions,
-				hashtable_t *failedRequest, struct vector *failedMessages)
+static struct metadata_response *
+bootstrap_metadata(struct kafka_producer *p)
 {
-	int i, j;
-	void *topic_iter = hashtable_iter(failedRequest);
-	for (; topic_iter; topic_iter = hashtable_iter_next(failedRequest, topic_iter)) {
-		char *topic = hashtable_iter_key(topic_iter);
-		struct vector *pids = hashtable_iter_value(topic_iter);
-		hashtable_t *partitionsForTopic = hashtable_get(topicsPartitions, topic);
-
-		for (i = 0; i < vector_size(pids); i++) {
-			struct vector *msgSet;
-			int32_t pid = *(int32_t *)vector_at(pids, i);
-			msgSet = hashtable_get(partitionsForTopic, &pid);
-			if (msgSet) {
-				for (j = 0; j < vector_size(msgSet); j++) {
-					vector_push_back(failedMessages, vector_at(msgSet, j));
-				}
-			}
+	/**
+	 * Connects to every broker at once over the pooled connections and
+	 * asks the first one that answers.
+	 *
+	 * @todo: bootstrap for subset of topics and only set those topics
+	 * rather than overwriting all metadata.
+	 */
+	struct metadata_response *resp = NULL;
+	broker_conn_t **conns;
+	unsigned u, n = 0;
+
+	if (p->bootstrap)
+		conns = bootstrap_list(p, &n);
+	else
+		conns = bootstrap_zookeeper(p, &n);
+	if (!conns)
+		return NULL;
+	conn_pool_connect(p->conns, conns, n, monotonic_ms());
+
+	/* query for metadata */
+	for (u = 0; u < n; u++) {
+		if (conns[u]->state != CONN_READY)
+			continue;
+		/* TODO: check for "Leader Not Available" responses and wait/retry */
+		resp = topic_metadata_request(conns[u]->fd, NULL,
+				p->config.socket_timeout_ms);
+		if (resp) {
+			conn_ok(conns[u]);
+			break;
 		}
+		conn_failed(p->conns, conns[u], monotonic_ms());
 	}
-	return 0;
+	free(conns);
+	return resp;
 }
 
-static int
-try_send(struct kafka_producer *p, struct vector *messages, int16_t sync)
+static broker_conn_t **
+bootstrap_zookeeper(struct kafka_producer *p, unsigned *n)
 {
-	int res, retries = 4;
-	while (retries > 0) {
-		struct vector *failures;
-		res = dispatch(p, messages, sync, &failures);
-		if (res == KAFKA_OK)
-			break;
+	/* the brokers registered in ZooKeeper */
+	void *iter;
+	json_t *brokers;
+	broker_conn_t **conns;
 
-		/**
-		 * Sometimes a failure happens because a broker just dies.
-		 * In this case there will be no response, but res != KAFKA_OK.
-		 * Just update metadata and retry the request.
-		 */
+	if (!p->zh)
+		return NULL;
+	brokers = bootstrap_brokers(p->zh);
+	if (!brokers)
+		return NULL;
 
-		if (failures) {
-			/* vector of messages that failed. simple enough to retry */
-			messages = failures;
-		}
+	*n = 0;
+	conns = malloc(json_object_size(brokers) * sizeof *conns);
+	iter = json_object_iter(brokers);
+	for (; iter; iter = json_object_iter_next(brokers, iter)) {
+		json_t *obj = json_object_iter_value(iter);
+		const char *host;
+		host = json_string_value(json_object_get(obj, "host"));
+		if (!host)
+			continue;
+		conns[(*n)++] = conn_pool_get(p->conns,
+				json_integer_value(json_object_get(obj, "id")), host,
+				json_integer_value(json_object_get(obj, "port")));
+	}
+	json_decref(brokers);
+	return conns;
+}
 
-		producer_metadata_free(p);
-		struct metadata_response *resp;
-		resp = bootstrap_metadata(p->zh);
-		if (!resp) {
-			res = KAFKA_METADATA_ERROR;
-			break;
+static broker_conn_t **
+bootstrap_list(struct kafka_producer *p, unsigned *n)
+{
+	/**
+	 * The brokers in the configured "host:port,..." list. Their ids are
+	 * not known until they answer, so they get negative placeholders;
+	 * the pool re-keys a connection once metadata names its broker. An
+	 * IPv6 address goes in brackets, as in "[::1]:9092".
+	 */
+	char *list, *entry, *save = NULL;
+	broker_conn_t **conns;
+	unsigned max = 1;
+
+	for (entry = p->bootstrap; *entry; entry++)
+		max += *entry == ',';
+	conns = malloc(max * sizeof *conns);
+	list = strdup(p->bootstrap);
+	*n = 0;
+	for (entry = strtok_r(list, ", ", &save); entry;
+	     entry = strtok_r(NULL, ", ", &save)) {
+		char *host = entry, *colon = strrchr(entry, ':');
+		if (!colon || colon == entry)
+			continue;
+		*colon = 0;
+		if (*host == '[' && colon[-1] == ']') {
+			host++;
+			colon[-1] = 0;
 		}
-		p->brokers = resp->brokers;
-		p->metadata = resp->metadata;
-		free(resp);
-		retries--;
+		conns[*n] = conn_pool_get(p->conns, -1 - (int32_t)*n, host,
+				atoi(colon + 1));
+		(*n)++;
 	}
-	if (retries == 0)
-		res = -1;
-	return res;
+	free(list);
+	if (*n == 0) {
+		free(conns);
+		return NULL;
+	}
+	return conns;
 }
 
-static int
-dispatch(struct kafka_producer *p, struct vector *messages, int16_t sync, struct vector **out)
+static json_t *
+bootstrap_brokers(zhandle_t *zh)
 {
-	void *iter;
-	int i;
-	struct vector *failedMessages = NULL;
-	hashtable_t *map = broker_message_map(p, messages);
-	int res = 0;
-
-	for (iter = hashtable_iter(map); iter; iter = hashtable_iter_next(map, iter)) {
-		int32_t brokerId = *(int32_t *)hashtable_iter_key(iter);
-		hashtable_t *topicsPartitions = hashtable_iter_value(iter);
-		hashtable_t *failures;
-		res = send_produce_request(p, brokerId, topicsPartitions, sync, &failures);
-		if (failures) {
-			res = -1;
-			if (!failedMessages)
-				failedMessages = vector_new(0, NULL);
-			handle_topics_partitions_failures(topicsPartitions, failures, failedMessages);
+	int rc, i;
+	struct String_vector ids;
+	json_t *js;
+	rc = zoo_get_children(zh, "/brokers/ids", 0, &ids);
+	if (rc != ZOK || ids.count == 0)
+		return NULL;
+	js = json_object();
+	for (i = 0; i < ids.count; i++) {
+		char *znode;
+		json_t *broker;
+		znode = string_builder("/brokers/ids/%s", ids.data[i]);
+		assert(znode);
+		broker = get_json_from_znode(zh, znode);
+		free(znode);
+		if (broker) {
+			/* steal reference to broker */
+			json_object_set_new(js, ids.data[i], broker);
 		}
 	}
-
-	broker_message_map_free(map);
-	*out = failedMessages;
-	return res;
+	free_String_vector(&ids);
+	return js;
 }
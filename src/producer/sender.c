@@ -0,0 +1,1017 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+
+#include <kafka.h>
+#include "../kafka-private.h"
+#include "serialize.h"
+
+/**
+ * The sender thread is the only code that touches broker sockets. It
+ * drains the shards queued by kafka_producer_send()/kafka_producer_send_batch(),
+ * merges their per-partition batches with the same sync level into one
+ * set of per-broker ProduceRequests, and completes each job once all of
+ * its messages are delivered or have failed.
+ *
+ * A partition that fails with a retryable error gets a retry entry and
+ * waits out an exponential backoff with jitter before its messages are
+ * sent again. New messages for it queue up behind the entry so order is
+ * kept, while every other partition keeps flowing.
+ */
+
+struct partition_retry {
+	int32_t partition;
+	int attempts;		/* failed attempts in a row */
+	int inflight;		/* messages were sent this round */
+	unsigned long round;	/* round of the last failure */
+	int64_t due;		/* monotonic ms */
+	struct msgvec messages;	/* waiting to be sent again */
+};
+
+#define RETRY_NONE INT64_MAX
+
+static int send_produce_request(struct kafka_producer *p, producer_metadata_t *md,
+				int32_t brokerId, struct map *topics_partitions,
+				int16_t sync, struct map **failuresOut);
+
+static void resolve(struct kafka_producer *p, struct msgvec *resolved,
+			struct msgvec *vec, int res);
+static void complete(struct kafka_producer *p, struct msgvec *resolved);
+
+static struct partition_retry *retry_get(struct kafka_producer *p, int level,
+					const char *topic, size_t topicLen,
+					int32_t partition, int create);
+static void retry_schedule(struct kafka_producer *p, int level,
+			struct msgvec *vec, int error, int64_t now,
+			struct msgvec *resolved);
+
+static void route(struct kafka_producer *p, producer_metadata_t *md, int level,
+		struct map **map, struct msgvec *vec, int64_t now,
+		struct msgvec *resolved);
+static void dispatch(struct kafka_producer *p, producer_metadata_t *md,
+		int level, struct map *map, int64_t now,
+		struct msgvec *resolved);
+
+static const int16_t levels[PRODUCER_SYNC_LEVELS] = {
+	KAFKA_REQUEST_ASYNC, KAFKA_REQUEST_SYNC, KAFKA_REQUEST_FULL_SYNC
+};
+
+int
+error_retryable(int error)
+{
+	/**
+	 * Errors that go away once leadership settles or the broker comes
+	 * back. Unknown topic or partition is usually stale metadata.
+	 */
+	switch (error) {
+	case KAFKA_UNKNOWN_TOPIC_OR_PARTITION:
+	case KAFKA_LEADER_NOT_AVAILABLE:
+	case KAFKA_NOT_LEADER_FOR_PARTITION:
+	case KAFKA_REQUEST_TIMED_OUT:
+	case KAFKA_BROKER_NOT_AVAILABLE:
+		return 1;
+	}
+	return 0;
+}
+
+static void
+map_free_value(void *ptr)
+{
+	map_free(ptr);
+}
+
+static struct map *
+failures_new(void)
+{
+	/* { topic: { partition: error } } */
+	return map_new_string(0, free, map_free_value);
+}
+
+static void
+mark_failure(struct map *failures, const char *topic, size_t topicLen,
+	int32_t partition, int16_t error)
+{
+	struct map *partitionFailures;
+	assert(failures);
+	assert(error != KAFKA_OK);
+	partitionFailures = map_get_string(failures, topic, topicLen);
+	if (!partitionFailures) {
+		partitionFailures = map_new_int32(0, NULL);
+		map_set_string(failures, strndup(topic, topicLen), topicLen,
+			partitionFailures);
+	}
+	map_set_int32(partitionFailures, partition, (void *)(intptr_t)error);
+}
+
+struct map *
+parse_produce_response(KafkaBuffer *buffer)
+{
+	struct map *failures = NULL;
+	int32_t correlation_id, num_topics, i, j;
+	buffer->cur += uint32_unpack(buffer->cur, &correlation_id);
+	buffer->cur += uint32_unpack(buffer->cur, &num_topics);
+	for (i = 0; i < num_topics; i++) {
+		int32_t num_partitions;
+		char *topic;
+		size_t topicLen;
+		topicLen = string_unpack(buffer->cur, &topic);
+		buffer->cur += topicLen;
+		topicLen -= 2;
+		buffer->cur += uint32_unpack(buffer->cur, &num_partitions);
+		for (j = 0; j < num_partitions; j++) {
+			int32_t partition;
+			int16_t error;
+			int64_t offset;
+			buffer->cur += uint32_unpack(buffer->cur, &partition);
+			buffer->cur += uint16_unpack(buffer->cur, &error);
+			buffer->cur += uint64_unpack(buffer->cur, &offset);
+
+			if (error != KAFKA_OK) {
+				if (!failures) {
+					failures = failures_new();
+				}
+				mark_failure(failures, topic, topicLen, partition, error);
+			}
+		}
+		free(topic);
+	}
+	return failures;
+}
+
+static struct map *
+mark_every_failure(struct map *topicsAndPartitions, int16_t error)
+{
+	/**
+	 * Marks every topic partition as a failure.
+	 */
+	void *i, *j;
+	struct map *failures = failures_new();
+	i = map_iter(topicsAndPartitions);
+	for (; i; i = map_iter_next(topicsAndPartitions, i)) {
+		const char *topic = map_iter_string_key(i);
+		size_t topicLen = map_iter_string_key_len(i);
+		struct map *partitions = map_iter_value(i);
+		j = map_iter(partitions);
+		for (; j; j = map_iter_next(partitions, j)) {
+			int32_t pid = map_iter_int32_key(j);
+			mark_failure(failures, topic, topicLen, pid, error);
+		}
+	}
+	return failures;
+}
+
+static int
+broker_io_error(struct kafka_producer *p, broker_conn_t *conn)
+{
+	/**
+	 * After a failed or timed out exchange the connection is in an
+	 * unknown state, so the pool closes it and reconnects on next use.
+	 * Returns the error for the partitions that were in the request.
+	 */
+	int error = errno == ETIMEDOUT ? KAFKA_REQUEST_TIMED_OUT :
+		KAFKA_BROKER_NOT_AVAILABLE;
+	conn_failed(p->conns, conn, monotonic_ms());
+	p->metadata_stale = 1;
+	return error;
+}
+
+int
+broker_fd(struct kafka_producer *p, producer_metadata_t *md, int32_t brokerId,
+	broker_conn_t **connOut)
+{
+	/**
+	 * Returns a connected socket for the broker, or -1 with the metadata
+	 * marked stale if there is none.
+	 */
+	int fd = -1;
+	broker_t *broker = map_get_int32(md->brokers, brokerId);
+
+	*connOut = NULL;
+	if (broker) {
+		*connOut = conn_pool_get(p->conns, broker->id, broker->hostname,
+				broker->port);
+		fd = conn_fd(p->conns, *connOut, monotonic_ms());
+	}
+	if (fd == -1) {
+		STATS_ADD(producer_stats_broker(p, brokerId)->errors, 1);
+		p->metadata_stale = 1;
+	}
+	return fd;
+}
+
+int
+broker_exchange(struct kafka_producer *p, int32_t brokerId,
+	broker_conn_t *conn, int fd, KafkaBuffer *buffer,
+	int32_t correlation_id, int16_t sync)
+{
+	/**
+	 * Writes the request in buffer, up to buffer->cur, and unless sync is
+	 * KAFKA_REQUEST_ASYNC reads the response into p->reader. Returns
+	 * KAFKA_OK, or the error every partition in the request failed with.
+	 */
+	int res = KAFKA_OK;
+	int64_t deadline, sent;
+	size_t len = buffer->cur - buffer->data;
+	broker_stats_t *stats = producer_stats_broker(p, brokerId);
+
+	/* one deadline for the whole exchange */
+	deadline = io_deadline(p->config.socket_timeout_ms);
+
+	STATS_ADD(p->stats.requests, 1);
+	STATS_ADD(p->stats.request_bytes, len);
+	STATS_ADD(p->stats.inflight, 1);
+	STATS_ADD(stats->requests, 1);
+	STATS_ADD(stats->request_bytes, len);
+	STATS_ADD(stats->inflight, 1);
+
+	sent = monotonic_us();
+	TRACE_START(p, WRITE, correlation_id, brokerId, len);
+	if (io_write_full(fd, buffer->data, len, deadline) == -1)
+		goto io_error;
+	TRACE_DONE(p, WRITE, correlation_id, brokerId, len);
+
+	if (sync != KAFKA_REQUEST_ASYNC) {
+		TRACE_START(p, READ, correlation_id, brokerId, 0);
+		if (frame_reader_recv(&p->reader, fd, deadline) == -1)
+			goto io_error;
+		TRACE_DONE(p, READ, correlation_id, brokerId,
+			4 + p->reader.body->len);
+		histogram_record(&p->stats.histograms[KAFKA_HISTOGRAM_RTT],
+			monotonic_us() - sent);
+		STATS_ADD(p->stats.response_bytes, 4 + p->reader.body->len);
+		STATS_ADD(stats->response_bytes, 4 + p->reader.body->len);
+	}
+	conn_ok(conn);
+	goto finish;
+io_error:
+	frame_reader_reset(&p->reader);
+	STATS_ADD(stats->errors, 1);
+	res = broker_io_error(p, conn);
+finish:
+	STATS_ADD(p->stats.inflight, -1);
+	STATS_ADD(stats->inflight, -1);
+	return res;
+}
+
+static int
+send_produce_request(struct kafka_producer *p, producer_metadata_t *md,
+		int32_t brokerId, struct map *topics_partitions, int16_t sync,
+		struct map **failuresOut)
+{
+	int res;
+	struct map *failures = NULL;
+	int32_t correlation_id;
+	size_t len;
+	request_header_t header;
+	const char *client = "libkafka";
+	KafkaBuffer *buffer;
+	broker_conn_t *conn;
+	int fd;
+
+	fd = broker_fd(p, md, brokerId, &conn);
+	if (fd == -1) {
+		*failuresOut = mark_every_failure(topics_partitions,
+				KAFKA_BROKER_NOT_AVAILABLE);
+		return -1;
+	}
+
+	correlation_id = p->correlation_id++;
+	TRACE_START(p, SERIALIZE, correlation_id, brokerId, 0);
+
+	/* size the whole request up front so it is serialized in one buffer */
+	len = sizeof header;
+	len += 2 + strlen(client);
+	len += 2 + 4; /* acks, ttl */
+	len += topics_and_partitions_packed_size(topics_partitions);
+	buffer = KafkaBufferPoolGet(p->buffers, len);
+
+	memset(&header, 0, sizeof header);
+	header.size = len - 4;
+	header.apikey = PRODUCE;
+	header.correlation_id = correlation_id;
+
+	buffer->cur += request_header_pack(&header, client, buffer->cur);
+	buffer->cur += uint16_pack(sync, buffer->cur);
+	buffer->cur += uint32_pack(p->config.request_timeout_ms, buffer->cur); /*ttl*/
+	serialize_topics_and_partitions(topics_partitions, buffer);
+	assert((size_t)(buffer->cur - buffer->data) == len);
+	TRACE_DONE(p, SERIALIZE, correlation_id, brokerId, len);
+
+	res = broker_exchange(p, brokerId, conn, fd, buffer, correlation_id,
+			sync);
+	if (res != KAFKA_OK) {
+		failures = mark_every_failure(topics_partitions, res);
+	} else if (sync != KAFKA_REQUEST_ASYNC) {
+		TRACE_START(p, PARSE, correlation_id, brokerId,
+			p->reader.body->len);
+		if (p->reader.body->len > 0)
+			failures = parse_produce_response(p->reader.body);
+		TRACE_DONE(p, PARSE, correlation_id, brokerId,
+			p->reader.body->len);
+	}
+	KafkaBufferPoolPut(p->buffers, buffer);
+	*failuresOut = failures;
+	return res == KAFKA_OK ? 0 : -1;
+}
+
+struct msgvec *
+broker_message_slot(struct map *map, int32_t brokerId, struct kafka_message *msg)
+{
+	/**
+	 * Returns the message set for msg's topic and partition in the
+	 * broker's part of map, creating it if needed.
+	 */
+	struct map *topics;
+	struct map *topic_partitions;
+	struct msgvec *msgSet;
+
+	topics = map_get_int32(map, brokerId);
+	if (!topics) {
+		topics = map_new_string(0, NULL, NULL);
+		map_set_int32(map, brokerId, topics);
+	}
+
+	topic_partitions = map_get_string(topics, msg->topic, msg->topic_len);
+	if (!topic_partitions) {
+		topic_partitions = map_new_int32(0, NULL);
+		map_set_string(topics, msg->topic, msg->topic_len,
+			topic_partitions);
+	}
+
+	msgSet = map_get_int32(topic_partitions, msg->partition);
+	if (!msgSet) {
+		msgSet = malloc(sizeof *msgSet);
+		msgvec_init(msgSet);
+		map_set_int32(topic_partitions, msg->partition, msgSet);
+	}
+	return msgSet;
+}
+
+void
+broker_message_map_free(struct map *map)
+{
+	void *i, *j, *k;
+	if (map) {
+		i = map_iter(map);
+		for (; i; i = map_iter_next(map, i)) {
+			struct map *topics = map_iter_value(i);
+			j = map_iter(topics);
+			for (; j; j = map_iter_next(topics, j)) {
+				struct map *partitions = map_iter_value(j);
+				k = map_iter(partitions);
+				for (; k; k = map_iter_next(partitions, k)) {
+					struct msgvec *vec = map_iter_value(k);
+					msgvec_destroy(vec);
+					free(vec);
+				}
+				map_free(partitions);
+			}
+			map_free(topics);
+		}
+		map_free(map);
+	}
+}
+
+static void
+resolve(struct kafka_producer *p, struct msgvec *resolved, struct msgvec *vec,
+	int res)
+{
+	/**
+	 * Records the outcome of vec's messages. Their jobs are completed by
+	 * complete() at the end of the round, since a completed job's
+	 * messages, topic names included, may be freed right away. Messages
+	 * sent without acks count as sent rather than acked.
+	 */
+	unsigned u;
+	struct kafka_message **msgs = msgvec_data(vec);
+	if (msgvec_size(vec) == 0)
+		return;
+	for (u = 0; u < msgvec_size(vec); u++) {
+		struct produce_job *job = msgs[u]->job;
+		if (res != KAFKA_OK && job->res == KAFKA_OK)
+			job->res = res;
+	}
+	/* vec holds messages of a single sync level */
+	if (res == KAFKA_OK && msgs[0]->job->sync == KAFKA_REQUEST_ASYNC)
+		STATS_ADD(p->stats.messages_sent, messages_count(vec));
+	else if (res == KAFKA_OK)
+		STATS_ADD(p->stats.messages_acked, messages_count(vec));
+	else if (res != KAFKA_MESSAGE_SPOOLED)
+		STATS_ADD(p->stats.messages_failed, messages_count(vec));
+	if (p->wal)
+		producer_wal_settle(p, vec, res);
+	msgvec_append(resolved, vec);
+}
+
+static void
+give_up(struct kafka_producer *p, struct msgvec *resolved, struct msgvec *vec,
+	int error)
+{
+	/**
+	 * Spools vec, messages of one partition, or failing that fails it.
+	 * Logged messages are replayed from the log instead.
+	 */
+	if (!p->wal && producer_spool_append(p, vec) == 0)
+		error = KAFKA_MESSAGE_SPOOLED;
+	resolve(p, resolved, vec, error);
+}
+
+static void
+complete(struct kafka_producer *p, struct msgvec *resolved)
+{
+	unsigned u;
+	int64_t now = monotonic_us();
+	histogram_t *latency = &p->stats.histograms[KAFKA_HISTOGRAM_LATENCY];
+	struct kafka_message **msgs = msgvec_data(resolved);
+	for (u = 0; u < msgvec_size(resolved); u++) {
+		/* the job may vanish as soon as it is posted or finished */
+		struct produce_job *job = msgs[u]->job;
+		/* enqueue to ack, which ASYNC sends never get */
+		if (job->sync != KAFKA_REQUEST_ASYNC)
+			histogram_record(latency, now - job->enqueued_us);
+		if (--job->pending != 0)
+			continue;
+		if (job->wal)
+			producer_wal_finish(p, job);
+		else
+			sem_post(&job->done);
+	}
+	msgvec_clear(resolved);
+}
+
+static void
+retry_free(void *ptr)
+{
+	struct partition_retry *r = ptr;
+	msgvec_destroy(&r->messages);
+	free(r);
+}
+
+static struct partition_retry *
+retry_get(struct kafka_producer *p, int level, const char *topic,
+	size_t topicLen, int32_t partition, int create)
+{
+	/**
+	 * There is at most one retry entry per partition and sync level,
+	 * kept until retry_sweep() finds it with nothing left to do.
+	 */
+	struct map *partitions;
+	struct partition_retry *r;
+
+	if (!p->retries[level]) {
+		if (!create)
+			return NULL;
+		p->retries[level] = map_new_string(0, free, map_free_value);
+	}
+	partitions = map_get_string(p->retries[level], topic, topicLen);
+	if (!partitions) {
+		if (!create)
+			return NULL;
+		partitions = map_new_int32(0, retry_free);
+		map_set_string(p->retries[level], strndup(topic, topicLen),
+			topicLen, partitions);
+	}
+	r = map_get_int32(partitions, partition);
+	if (!r && create) {
+		r = calloc(1, sizeof *r);
+		r->partition = partition;
+		msgvec_init(&r->messages);
+		map_set_int32(partitions, partition, r);
+	}
+	return r;
+}
+
+static int64_t
+retry_backoff(struct kafka_producer *p, int attempts)
+{
+	/**
+	 * Doubles with every attempt up to the configured maximum. The
+	 * upper half is jittered so partitions that failed together do not
+	 * all come back at once.
+	 */
+	int64_t d = p->config.retry_backoff_ms;
+	while (--attempts > 0 && d < p->config.retry_backoff_max_ms)
+		d *= 2;
+	if (d > p->config.retry_backoff_max_ms)
+		d = p->config.retry_backoff_max_ms;
+	if (d < 2)
+		return d;
+	return d / 2 + rand_r(&p->sender_seed) % (d / 2 + 1);
+}
+
+static void
+retry_schedule(struct kafka_producer *p, int level, struct msgvec *vec,
+	int error, int64_t now, struct msgvec *resolved)
+{
+	/**
+	 * vec holds messages of one topic partition that failed with error.
+	 * They go back in front of whatever is waiting for the partition, or
+	 * fail for good if the error is fatal or the partition is out of
+	 * retries.
+	 */
+	struct partition_retry *r;
+	struct kafka_message *first = msgvec_data(vec)[0];
+	struct msgvec waiting;
+	partition_stats_t *ps;
+
+	ps = producer_stats_partition(p, first->topic, first->topic_len,
+			first->partition);
+	STATS_ADD(ps->errors, 1);
+	producer_stats_error(p, error);
+	if (!error_retryable(error)) {
+		resolve(p, resolved, vec, error);
+		return;
+	}
+	if (error != KAFKA_REQUEST_TIMED_OUT)
+		p->metadata_stale = 1;
+
+	r = retry_get(p, level, first->topic, first->topic_len, first->partition, 1);
+	if (r->round != p->round) {
+		r->attempts++;
+		r->round = p->round;
+	}
+	r->inflight = 0;
+	if (r->attempts > p->config.max_retries) {
+		/* anything queued behind it gets a fresh set of retries */
+		give_up(p, resolved, vec, error);
+		r->attempts = 0;
+		r->due = now;
+		return;
+	}
+	r->due = now + retry_backoff(p, r->attempts);
+	STATS_ADD(p->stats.retries, messages_count(vec));
+	STATS_ADD(ps->retries, messages_count(vec));
+
+	msgvec_init(&waiting);
+	msgvec_swap(&waiting, &r->messages);
+	msgvec_append(&r->messages, vec);
+	msgvec_append(&r->messages, &waiting);
+	msgvec_destroy(&waiting);
+}
+
+static void
+retry_take_due(struct kafka_producer *p, producer_metadata_t *md,
+	struct map **maps, int64_t now, struct msgvec *resolved)
+{
+	/**
+	 * Routes the messages of every partition whose backoff is over. With
+	 * the producer out of budget and set to drop the oldest messages,
+	 * everything waiting is dropped instead.
+	 */
+	unsigned l, u;
+	void *i, *j;
+	int drop = producer_budget_drop_wanted(p);
+	struct msgvec due;
+
+	msgvec_init(&due);
+	for (l = 0; l < PRODUCER_SYNC_LEVELS; l++) {
+		if (!p->retries[l])
+			continue;
+		msgvec_clear(&due);
+		i = map_iter(p->retries[l]);
+		for (; i; i = map_iter_next(p->retries[l], i)) {
+			struct map *partitions = map_iter_value(i);
+			j = map_iter(partitions);
+			for (; j; j = map_iter_next(partitions, j)) {
+				struct partition_retry *r = map_iter_value(j);
+				if (!msgvec_size(&r->messages))
+					continue;
+				if (drop) {
+					producer_stats_error(p, KAFKA_MESSAGE_DROPPED);
+					give_up(p, resolved, &r->messages,
+						KAFKA_MESSAGE_DROPPED);
+					r->attempts = 0;
+				} else if (r->due <= now) {
+					msgvec_append(&due, &r->messages);
+					r->inflight = 1;
+				} else {
+					continue;
+				}
+				msgvec_clear(&r->messages);
+			}
+		}
+
+		/* one at a time: they may be spread over many partitions */
+		for (u = 0; u < msgvec_size(&due); u++) {
+			struct msgvec one;
+			msgvec_init(&one);
+			msgvec_push_back(&one, msgvec_data(&due)[u]);
+			route(p, md, l, &maps[l], &one, now, resolved);
+			msgvec_destroy(&one);
+		}
+	}
+	msgvec_destroy(&due);
+}
+
+static void
+retry_sweep(struct kafka_producer *p)
+{
+	/**
+	 * Entries still in flight at the end of a round went through. Those
+	 * with nothing left to send are dropped, and so are topics left
+	 * without entries. Also works out when the next retry is due.
+	 */
+	unsigned l;
+	void *i, *j;
+	struct vector *idle = NULL, *empty = NULL;
+
+	p->retry_due = RETRY_NONE;
+	for (l = 0; l < PRODUCER_SYNC_LEVELS; l++) {
+		if (!p->retries[l])
+			continue;
+		i = map_iter(p->retries[l]);
+		for (; i; i = map_iter_next(p->retries[l], i)) {
+			struct map *partitions = map_iter_value(i);
+			j = map_iter(partitions);
+			for (; j; j = map_iter_next(partitions, j)) {
+				struct partition_retry *r = map_iter_value(j);
+				if (r->inflight) {
+					r->inflight = 0;
+					r->attempts = 0;
+				}
+				if (!msgvec_size(&r->messages)) {
+					if (!idle)
+						idle = vector_new(0, NULL);
+					vector_push_back(idle, r);
+				} else if (r->due < p->retry_due)
+					p->retry_due = r->due;
+			}
+			/* deleting moves slots around, so not while iterating */
+			while (idle && !vector_empty(idle)) {
+				struct partition_retry *r = vector_pop_back(idle);
+				map_del_int32(partitions, r->partition);
+			}
+			if (map_size(partitions) == 0) {
+				if (!empty)
+					empty = vector_new(0, NULL);
+				vector_push_back(empty, (void *)map_iter_string_key(i));
+			}
+		}
+		while (empty && !vector_empty(empty)) {
+			const char *topic = vector_pop_back(empty);
+			map_del_string(p->retries[l], topic, strlen(topic));
+		}
+	}
+	vector_free(idle);
+	vector_free(empty);
+}
+
+static void
+route(struct kafka_producer *p, producer_metadata_t *md, int level,
+	struct map **map, struct msgvec *vec, int64_t now,
+	struct msgvec *resolved)
+{
+	/**
+	 * Adds vec, messages of a single topic partition, to the broker
+	 * message map for its leader. Messages without a partition yet are
+	 * placed one by one. Whatever has no leader is scheduled for a retry.
+	 */
+	unsigned u;
+	topic_metadata_t *topic = NULL;
+	partition_metadata_t *pm = NULL;
+	struct kafka_message **msgs = msgvec_data(vec);
+
+	if (!*map)
+		*map = map_new_int32(md ? map_size(md->brokers) : 0, NULL);
+	if (md)
+		topic = map_get_string(md->topics, msgs[0]->topic, msgs[0]->topic_len);
+	if (!topic) {
+		retry_schedule(p, level, vec, KAFKA_UNKNOWN_TOPIC_OR_PARTITION,
+			now, resolved);
+		return;
+	}
+
+	if (msgs[0]->partition >= 0)
+		pm = map_get_int32(topic->partitions, msgs[0]->partition);
+	if (pm) {
+		if (pm->leader)
+			msgvec_append(broker_message_slot(*map, pm->leader->id,
+					msgs[0]), vec);
+		else
+			retry_schedule(p, level, vec, KAFKA_LEADER_NOT_AVAILABLE,
+				now, resolved);
+		return;
+	}
+
+	for (u = 0; u < msgvec_size(vec); u++) {
+		struct msgvec one;
+		pm = producer_pick_partition(md, msgs[u], &p->sender_seed);
+		if (pm && pm->leader) {
+			msgvec_push_back(broker_message_slot(*map, pm->leader->id,
+					msgs[u]), msgs[u]);
+			continue;
+		}
+		msgvec_init(&one);
+		msgvec_push_back(&one, msgs[u]);
+		retry_schedule(p, level, &one, pm ? KAFKA_LEADER_NOT_AVAILABLE :
+			KAFKA_UNKNOWN_TOPIC_OR_PARTITION, now, resolved);
+		msgvec_destroy(&one);
+	}
+}
+
+static void
+stats_acked(struct kafka_producer *p, const char *topic, size_t topicLen,
+	int32_t partition, struct msgvec *vec)
+{
+	unsigned u;
+	uint64_t bytes = 0;
+	partition_stats_t *ps;
+	struct kafka_message **msgs = msgvec_data(vec);
+
+	for (u = 0; u < msgvec_size(vec); u++)
+		bytes += kafka_message_wire_size(msgs[u]);
+	ps = producer_stats_partition(p, topic, topicLen, partition);
+	STATS_ADD(ps->messages, messages_count(vec));
+	STATS_ADD(ps->bytes, bytes);
+}
+
+static void
+dispatch(struct kafka_producer *p, producer_metadata_t *md, int level,
+	struct map *map, int64_t now, struct msgvec *resolved)
+{
+	/**
+	 * Sends one ProduceRequest per broker in map and sorts the outcome
+	 * out partition by partition.
+	 */
+	void *i, *j, *k;
+
+	for (i = map_iter(map); i; i = map_iter_next(map, i)) {
+		int32_t brokerId = map_iter_int32_key(i);
+		struct map *topicsPartitions = map_iter_value(i);
+		struct map *failures;
+		uint64_t messages = 0;
+
+		send_produce_request(p, md, brokerId, topicsPartitions,
+			levels[level], &failures);
+
+		j = map_iter(topicsPartitions);
+		for (; j; j = map_iter_next(topicsPartitions, j)) {
+			struct map *partitions = map_iter_value(j);
+			struct map *partitionFailures = NULL;
+			if (failures)
+				partitionFailures = map_get_string(failures,
+						map_iter_string_key(j),
+						map_iter_string_key_len(j));
+			k = map_iter(partitions);
+			for (; k; k = map_iter_next(partitions, k)) {
+				struct msgvec *vec = map_iter_value(k);
+				int error = KAFKA_OK;
+				messages += messages_count(vec);
+				if (partitionFailures)
+					error = (intptr_t)map_get_int32(partitionFailures,
+								map_iter_int32_key(k));
+				if (error == KAFKA_OK) {
+					if (levels[level] != KAFKA_REQUEST_ASYNC)
+						stats_acked(p, map_iter_string_key(j),
+							map_iter_string_key_len(j),
+							map_iter_int32_key(k), vec);
+					resolve(p, resolved, vec, KAFKA_OK);
+				} else
+					retry_schedule(p, level, vec, error, now, resolved);
+			}
+		}
+		map_free(failures);
+		histogram_record(&p->stats.histograms[KAFKA_HISTOGRAM_BATCH_SIZE],
+			messages);
+	}
+}
+
+static void
+sender_collect(struct kafka_producer *p, producer_metadata_t *md,
+	struct map **maps, int64_t now, struct msgvec *resolved)
+{
+	/**
+	 * Pops every shard queued so far and routes its batches, one broker
+	 * message map per sync level. Batches for a partition that is
+	 * waiting on a retry queue up behind it instead.
+	 */
+	unsigned long enqueued;
+	unsigned l;
+	void *i, *j;
+
+	enqueued = __atomic_load_n(&p->enqueued, __ATOMIC_ACQUIRE);
+	while (p->dequeued != enqueued) {
+		struct mpsc_node *n = mpsc_pop(&p->queue);
+		struct producer_shard *shard;
+		struct map *batches[PRODUCER_SYNC_LEVELS];
+		if (!n) {
+			/* a producer is half way through mpsc_push() */
+			sched_yield();
+			continue;
+		}
+		p->dequeued++;
+		shard = (struct producer_shard *)((char *)n -
+			offsetof(struct producer_shard, node));
+		producer_shard_take(shard, batches);
+		for (l = 0; l < PRODUCER_SYNC_LEVELS; l++) {
+			if (!batches[l])
+				continue;
+			i = map_iter(batches[l]);
+			for (; i; i = map_iter_next(batches[l], i)) {
+				struct map *partitions = map_iter_value(i);
+				j = map_iter(partitions);
+				for (; j; j = map_iter_next(partitions, j)) {
+					struct msgvec *vec = map_iter_value(j);
+					struct partition_retry *r;
+					r = retry_get(p, l, map_iter_string_key(i),
+						map_iter_string_key_len(i),
+						map_iter_int32_key(j), 0);
+					if (r && !r->inflight && msgvec_size(&r->messages))
+						msgvec_append(&r->messages, vec);
+					else
+						route(p, md, l, &maps[l], vec, now, resolved);
+				}
+			}
+			producer_batches_free(batches[l]);
+		}
+	}
+}
+
+static void
+sender_refresh_metadata(struct kafka_producer *p, int64_t now)
+{
+	/**
+	 * Refreshes metadata after leadership errors, at most once per
+	 * retry backoff.
+	 */
+	if (!p->metadata_stale)
+		return;
+	if (p->metadata_refreshed &&
+	    now - p->metadata_refreshed < p->config.retry_backoff_ms)
+		return;
+	p->metadata_refreshed = now;
+	if (producer_metadata_refresh(p) == KAFKA_OK)
+		p->metadata_stale = 0;
+}
+
+static void
+sender_connect(struct kafka_producer *p, producer_metadata_t *md,
+	struct map **maps)
+{
+	/**
+	 * Connects to every broker this round sends to that needs it, in
+	 * parallel, rather than one by one as each request goes out.
+	 */
+	unsigned l, n = 0;
+	void *i;
+	broker_conn_t **conns;
+
+	if (!md)
+		return;
+	conns = malloc(PRODUCER_SYNC_LEVELS * map_size(md->brokers) * sizeof *conns);
+	for (l = 0; l < PRODUCER_SYNC_LEVELS; l++) {
+		if (!maps[l])
+			continue;
+		for (i = map_iter(maps[l]); i; i = map_iter_next(maps[l], i)) {
+			broker_t *broker = map_get_int32(md->brokers,
+					map_iter_int32_key(i));
+			broker_conn_t *conn;
+			if (!broker)
+				continue;
+			conn = conn_pool_get(p->conns, broker->id,
+					broker->hostname, broker->port);
+			if (conn->state != CONN_READY)
+				conns[n++] = conn;
+		}
+	}
+	if (n)
+		conn_pool_connect(p->conns, conns, n, monotonic_ms());
+	free(conns);
+}
+
+static void
+sender_run(struct kafka_producer *p)
+{
+	/**
+	 * One round: sends whatever is due for a retry and everything queued,
+	 * one merged batch per sync level, then completes the jobs that have
+	 * nothing left in flight.
+	 */
+	unsigned l;
+	int64_t now;
+	producer_metadata_t *md;
+	struct map *maps[PRODUCER_SYNC_LEVELS];
+	struct msgvec resolved;
+
+	p->round++;
+	now = monotonic_ms();
+	sender_refresh_metadata(p, now);
+
+	for (l = 0; l < PRODUCER_SYNC_LEVELS; l++)
+		maps[l] = NULL;
+	msgvec_init(&resolved);
+	md = producer_metadata_acquire(p);
+	TRACE_START(p, ROUTE, -1, -1, 0);
+	retry_take_due(p, md, maps, now, &resolved);
+	sender_collect(p, md, maps, now, &resolved);
+	TRACE_DONE(p, ROUTE, -1, -1, 0);
+	sender_connect(p, md, maps);
+	for (l = 0; l < PRODUCER_SYNC_LEVELS; l++) {
+		if (!maps[l])
+			continue;
+		dispatch(p, md, l, maps[l], now, &resolved);
+		broker_message_map_free(maps[l]);
+	}
+	producer_replay(p, md, p->spool, &p->spool_replay_at, now);
+	producer_replay(p, md, p->wal, &p->wal_replay_at, now);
+	producer_metadata_release(md);
+	retry_sweep(p);
+
+	complete(p, &resolved);
+	msgvec_destroy(&resolved);
+}
+
+static int
+sender_wait(struct kafka_producer *p)
+{
+	/**
+	 * Sleeps until there is work or a retry is due. Returns 0 once the
+	 * producer is shutting down, the queue is drained and no retries are
+	 * left.
+	 */
+	int running, work;
+	struct timespec deadline;
+	pthread_mutex_lock(&p->sender_lock);
+	__atomic_store_n(&p->sender_idle, 1, __ATOMIC_SEQ_CST);
+	for (;;) {
+		int64_t now, wake;
+		running = __atomic_load_n(&p->running, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&p->enqueued, __ATOMIC_SEQ_CST) != p->dequeued)
+			break;
+		if (p->retry_due != RETRY_NONE && producer_budget_drop_wanted(p))
+			break;
+		if (!running && p->retry_due == RETRY_NONE)
+			break;
+		wake = p->retry_due;
+		if (running && p->stats.emit_at < wake)
+			wake = p->stats.emit_at;	/* stats go out on time */
+		if (running && producer_replay_due(p->spool,
+				p->spool_replay_at) < wake)
+			wake = producer_replay_due(p->spool, p->spool_replay_at);
+		if (running && producer_replay_due(p->wal,
+				p->wal_replay_at) < wake)
+			wake = producer_replay_due(p->wal, p->wal_replay_at);
+		if (wake == RETRY_NONE) {
+			pthread_cond_wait(&p->sender_wakeup, &p->sender_lock);
+			continue;
+		}
+		now = monotonic_ms();
+		if (now >= wake)
+			break;
+		deadline_after_ms(&deadline, wake - now);
+		pthread_cond_timedwait(&p->sender_wakeup, &p->sender_lock,
+				&deadline);
+	}
+	__atomic_store_n(&p->sender_idle, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&p->sender_lock);
+	work = __atomic_load_n(&p->enqueued, __ATOMIC_SEQ_CST) != p->dequeued;
+	return running || work || p->retry_due != RETRY_NONE;
+}
+
+void *
+producer_sender_main(void *arg)
+{
+	unsigned l;
+	struct kafka_producer *p = arg;
+	p->retry_due = RETRY_NONE;
+	while (sender_wait(p)) {
+		sender_run(p);
+		producer_stats_tick(p, monotonic_ms());
+	}
+	for (l = 0; l < PRODUCER_SYNC_LEVELS; l++)
+		map_free(p->retries[l]);
+	return NULL;
+}
@@ -0,0 +1,362 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <kafka.h>
+#include "../kafka-private.h"
+
+/**
+ * Each thread calling into a producer gets its own shard, found through a
+ * pthread key owned by the producer. Picking partitions and batching by
+ * partition happens here, on the calling thread, so the only state
+ * threads share is the producer queue, which a shard joins at most once
+ * per round of the sender.
+ */
+
+static void shard_orphan(void *ptr);
+
+int
+producer_sync_level(int16_t sync)
+{
+	switch (sync) {
+	case KAFKA_REQUEST_ASYNC:
+		return 0;
+	case KAFKA_REQUEST_SYNC:
+		return 1;
+	case KAFKA_REQUEST_FULL_SYNC:
+		return 2;
+	}
+	return -1;
+}
+
+int
+producer_shards_init(struct kafka_producer *p)
+{
+	pthread_mutex_init(&p->shards_lock, NULL);
+	return pthread_key_create(&p->shard_key, shard_orphan);
+}
+
+void
+producer_shards_free(struct kafka_producer *p)
+{
+	/**
+	 * Only called once the sender has exited, so no shard is queued.
+	 */
+	unsigned l;
+	struct producer_shard *shard, *next;
+	pthread_key_delete(p->shard_key);
+	for (shard = p->shards; shard; shard = next) {
+		next = shard->next;
+		for (l = 0; l < PRODUCER_SYNC_LEVELS; l++)
+			producer_batches_free(shard->batches[l]);
+		producer_metadata_release(shard->md);
+		pthread_mutex_destroy(&shard->lock);
+		free(shard);
+	}
+	pthread_mutex_destroy(&p->shards_lock);
+}
+
+static void
+shard_orphan(void *ptr)
+{
+	/**
+	 * pthread key destructor. The shard stays on the producer's list and
+	 * is handed to the next thread that needs one.
+	 */
+	struct producer_shard *shard = ptr;
+	producer_metadata_release(shard->md);
+	shard->md = NULL;
+	__atomic_store_n(&shard->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static struct producer_shard *
+shard_get(struct kafka_producer *p)
+{
+	struct producer_shard *shard;
+
+	shard = pthread_getspecific(p->shard_key);
+	if (shard)
+		return shard;
+
+	pthread_mutex_lock(&p->shards_lock);
+	for (shard = p->shards; shard; shard = shard->next) {
+		int orphaned = 1;
+		if (__atomic_compare_exchange_n(&shard->orphaned, &orphaned, 0, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	if (!shard) {
+		shard = calloc(1, sizeof *shard);
+		if (shard) {
+			pthread_mutex_init(&shard->lock, NULL);
+			shard->seed = (unsigned)time(0) ^ (unsigned)(uintptr_t)shard;
+			shard->next = p->shards;
+			p->shards = shard;
+		}
+	}
+	pthread_mutex_unlock(&p->shards_lock);
+
+	if (shard && pthread_setspecific(p->shard_key, shard) != 0) {
+		__atomic_store_n(&shard->orphaned, 1, __ATOMIC_RELEASE);
+		return NULL;
+	}
+	return shard;
+}
+
+static producer_metadata_t *
+shard_metadata(struct kafka_producer *p, struct producer_shard *shard)
+{
+	/**
+	 * Keeps a reference to the latest snapshot so the metadata lock is
+	 * only taken after a refresh.
+	 */
+	unsigned long gen = __atomic_load_n(&p->metadata_gen, __ATOMIC_ACQUIRE);
+	if (!shard->md || shard->md_gen != gen) {
+		producer_metadata_release(shard->md);
+		shard->md = producer_metadata_acquire(p);
+		shard->md_gen = gen;
+	}
+	return shard->md;
+}
+
+partition_metadata_t *
+producer_pick_partition(producer_metadata_t *md, struct kafka_message *msg,
+			unsigned *seed)
+{
+	/**
+	 * Keeps the partition the message already has if it still exists,
+	 * otherwise picks a random one.
+	 */
+	int32_t part;
+	topic_metadata_t *topic;
+	partition_metadata_t *pm;
+	if (!md)
+		return NULL;
+	topic = map_get_string(md->topics, msg->topic, msg->topic_len);
+	if (!topic || topic->num_partitions <= 0)
+		return NULL;
+	if (msg->partition >= 0) {
+		pm = map_get_int32(topic->partitions, msg->partition);
+		if (pm)
+			return pm;
+	}
+	/* TODO: make use of different partitioners */
+	part = rand_r(seed) % topic->num_partitions;
+	pm = map_get_int32(topic->partitions, part);
+	if (pm)
+		msg->partition = pm->partition_id;
+	return pm;
+}
+
+static void
+msgvec_free_ptr(void *ptr)
+{
+	msgvec_destroy(ptr);
+	free(ptr);
+}
+
+static void
+partitions_free(void *ptr)
+{
+	map_free(ptr);
+}
+
+void
+producer_batches_free(struct map *batches)
+{
+	/* the maps own their values: { topic: { partition: msgvec } } */
+	if (batches)
+		map_free(batches);
+}
+
+static int
+shard_batch(struct map *batches, struct kafka_message *msg)
+{
+	struct map *partitions;
+	struct msgvec *vec;
+
+	partitions = map_get_string(batches, msg->topic, msg->topic_len);
+	if (!partitions) {
+		partitions = map_new_int32(0, msgvec_free_ptr);
+		if (!partitions)
+			return -1;
+		map_set_string(batches, msg->topic, msg->topic_len, partitions);
+	}
+	vec = map_get_int32(partitions, msg->partition);
+	if (!vec) {
+		vec = malloc(sizeof *vec);
+		if (!vec)
+			goto unused;
+		msgvec_init(vec);
+		map_set_int32(partitions, msg->partition, vec);
+	}
+	if (msgvec_push_back(vec, msg) == 0)
+		return 0;
+	if (msgvec_size(vec) == 0)
+		map_del_int32(partitions, msg->partition);
+unused:
+	if (map_size(partitions) == 0)
+		map_del_string(batches, msg->topic, msg->topic_len);
+	return -1;
+}
+
+static void
+shard_unbatch(struct map *batches, struct kafka_message **msgs, unsigned n)
+{
+	/**
+	 * Takes back the first n messages of a job that could not be batched
+	 * whole. They went in last, with the shard locked, so each is at the
+	 * back of its vector.
+	 */
+	while (n-- > 0) {
+		struct kafka_message *msg = msgs[n], *popped;
+		struct map *partitions;
+		struct msgvec *vec;
+
+		partitions = map_get_string(batches, msg->topic, msg->topic_len);
+		vec = map_get_int32(partitions, msg->partition);
+		popped = msgvec_pop_back(vec);
+		assert(popped == msg);
+		(void)popped;
+		if (msgvec_size(vec) == 0)
+			map_del_int32(partitions, msg->partition);
+		if (map_size(partitions) == 0)
+			map_del_string(batches, msg->topic, msg->topic_len);
+	}
+}
+
+int
+producer_shard_route(struct kafka_producer *p, struct msgvec *messages)
+{
+	/**
+	 * Picks a partition for each message that has none, as
+	 * producer_shard_submit() would, for callers that need to know it
+	 * beforehand. Messages of a topic the metadata does not know keep -1.
+	 */
+	unsigned u;
+	producer_metadata_t *md;
+	struct producer_shard *shard;
+	struct kafka_message **msgs = msgvec_data(messages);
+
+	shard = shard_get(p);
+	if (!shard)
+		return KAFKA_PRODUCER_ERROR;
+	md = shard_metadata(p, shard);
+	for (u = 0; u < msgvec_size(messages); u++) {
+		if (!producer_pick_partition(md, msgs[u], &shard->seed))
+			msgs[u]->partition = -1;
+	}
+	return KAFKA_OK;
+}
+
+int
+producer_shard_submit(struct kafka_producer *p, struct produce_job *job,
+		int16_t sync)
+{
+	/**
+	 * Batches the job's messages by partition in the calling thread's
+	 * shard and queues the shard for the sender if it is not already.
+	 * Messages of a topic the metadata does not know go in partition -1,
+	 * which the sender retries after refreshing metadata. Nothing is
+	 * queued if memory runs out on the way.
+	 */
+	unsigned u;
+	int level, queued;
+	producer_metadata_t *md;
+	struct map *batches;
+	struct producer_shard *shard;
+	struct kafka_message **msgs = msgvec_data(job->messages);
+	unsigned n = msgvec_size(job->messages);
+
+	level = producer_sync_level(sync);
+	if (level < 0)
+		return KAFKA_PRODUCER_ERROR;
+	shard = shard_get(p);
+	if (!shard)
+		return KAFKA_PRODUCER_ERROR;
+
+	md = shard_metadata(p, shard);
+	job->sync = sync;
+	for (u = 0; u < n; u++) {
+		msgs[u]->job = job;
+		if (!producer_pick_partition(md, msgs[u], &shard->seed))
+			msgs[u]->partition = -1;
+	}
+
+	pthread_mutex_lock(&shard->lock);
+	batches = shard->batches[level];
+	if (!batches) {
+		batches = map_new_string(0, NULL, partitions_free);
+		if (!batches) {
+			pthread_mutex_unlock(&shard->lock);
+			return KAFKA_PRODUCER_ERROR;
+		}
+		shard->batches[level] = batches;
+	}
+	for (u = 0; u < n; u++) {
+		if (shard_batch(batches, msgs[u]) != 0) {
+			shard_unbatch(batches, msgs, u);
+			if (map_size(batches) == 0) {
+				map_free(batches);
+				shard->batches[level] = NULL;
+			}
+			pthread_mutex_unlock(&shard->lock);
+			return KAFKA_PRODUCER_ERROR;
+		}
+	}
+	shard->messages += messages_count(job->messages);
+	shard->bytes += job->bytes;
+	queued = shard->queued;
+	shard->queued = 1;
+	pthread_mutex_unlock(&shard->lock);
+
+	if (!queued)
+		producer_enqueue(p, &shard->node);
+	return KAFKA_OK;
+}
+
+void
+producer_shard_take(struct producer_shard *shard, struct map **batches)
+{
+	/**
+	 * Called by the sender for a shard it popped off the queue. Moves the
+	 * shard's batches (one per sync level) into batches; the shard may be
+	 * queued again from here on.
+	 */
+	unsigned l;
+	pthread_mutex_lock(&shard->lock);
+	for (l = 0; l < PRODUCER_SYNC_LEVELS; l++) {
+		batches[l] = shard->batches[l];
+		shard->batches[l] = NULL;
+	}
+	shard->queued = 0;
+	pthread_mutex_unlock(&shard->lock);
+}
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <kafka.h>
+#include "../kafka-private.h"
+#include "../serialize.h"
+
+/**
+ * Optional local spool for messages the producer would otherwise give
+ * up on: those out of retries and those dropped to make room in the
+ * budget. They are written to a segment file in wire format and their
+ * jobs complete with KAFKA_MESSAGE_SPOOLED, which frees their budget.
+ * The sender replays the spool oldest first, straight from the segment,
+ * whenever brokers answer again, and whatever is still spooled when the
+ * producer goes away is replayed by the next one to open the file.
+ *
+ * Replay works on any segment, and also serves the write-ahead log.
+ */
+
+#define REPLAY_BYTES (1024 * 1024)	/* per round */
+
+int
+producer_spool_open(struct kafka_producer *p)
+{
+	if (!p->config.spool_path)
+		return 0;
+	p->spool = calloc(1, sizeof *p->spool);
+	if (segment_open(p->spool, p->config.spool_path,
+			p->config.spool_max_bytes) == -1) {
+		free(p->spool);
+		p->spool = NULL;
+		return -1;
+	}
+	p->config.spool_path = NULL;	/* not ours to keep */
+	return 0;
+}
+
+void
+producer_spool_close(struct kafka_producer *p)
+{
+	if (!p->spool)
+		return;
+	segment_close(p->spool);
+	free(p->spool);
+	p->spool = NULL;
+}
+
+int
+producer_spool_append(struct kafka_producer *p, struct msgvec *vec)
+{
+	/**
+	 * Spools vec, messages of one topic partition. Returns -1 if there
+	 * is no spool or it is full.
+	 */
+	unsigned records;
+	if (!p->spool ||
+	    segment_append(p->spool, vec, SEGMENT_PENDING, &records) == -1)
+		return -1;
+	STATS_ADD(p->stats.messages_spooled, messages_count(vec));
+	return 0;
+}
+
+int64_t
+producer_replay_due(segment_t *s, int64_t replay_at)
+{
+	/* when the sender should next replay s, INT64_MAX if never */
+	if (!s || segment_pending(s) == 0)
+		return INT64_MAX;
+	return replay_at;
+}
+
+static int
+record_send(struct kafka_producer *p, producer_metadata_t *md,
+	segment_record_t *rec)
+{
+	/**
+	 * Sends one record as a ProduceRequest of its own and returns the
+	 * partition's error. Records whose partition is gone, or that never
+	 * had one, go to a random partition of the topic.
+	 */
+	topic_metadata_t *topic;
+	partition_metadata_t *pm = NULL;
+	request_header_t header;
+	const char *client = "libkafka";
+	KafkaBuffer *buffer;
+	broker_conn_t *conn;
+	struct map *failures = NULL;
+	int16_t sync = p->config.acks;
+	int32_t correlation_id;
+	size_t len;
+	int fd, res;
+
+	topic = map_get_string(md->topics, rec->topic, rec->topic_len);
+	if (!topic || topic->num_partitions <= 0)
+		return KAFKA_UNKNOWN_TOPIC_OR_PARTITION;
+	if (rec->partition >= 0)
+		pm = map_get_int32(topic->partitions, rec->partition);
+	if (!pm)
+		pm = map_get_int32(topic->partitions,
+			rand_r(&p->sender_seed) % topic->num_partitions);
+	if (!pm || !pm->leader)
+		return KAFKA_LEADER_NOT_AVAILABLE;
+	fd = broker_fd(p, md, pm->leader->id, &conn);
+	if (fd == -1)
+		return KAFKA_BROKER_NOT_AVAILABLE;
+
+	/* only an ack lets the record go */
+	if (sync == KAFKA_REQUEST_ASYNC)
+		sync = KAFKA_REQUEST_SYNC;
+	len = sizeof header + 2 + strlen(client);
+	len += 2 + 4 + 4;	/* acks, ttl, number of topics */
+	len += 2 + rec->topic_len + 4 + 4 + 4 + rec->messages_size;
+	buffer = KafkaBufferPoolGet(p->buffers, len);
+
+	correlation_id = p->correlation_id++;
+	memset(&header, 0, sizeof header);
+	header.size = len - 4;
+	header.apikey = PRODUCE;
+	header.correlation_id = correlation_id;
+	buffer->cur += request_header_pack(&header, client, buffer->cur);
+	buffer->cur += uint16_pack(sync, buffer->cur);
+	buffer->cur += uint32_pack(p->config.request_timeout_ms, buffer->cur);
+	buffer->cur += uint32_pack(1, buffer->cur);
+	buffer->cur += string_pack_len(rec->topic, rec->topic_len, buffer->cur);
+	buffer->cur += uint32_pack(1, buffer->cur);
+	buffer->cur += uint32_pack(pm->partition_id, buffer->cur);
+	buffer->cur += uint32_pack(rec->messages_size, buffer->cur);
+	memcpy(buffer->cur, rec->messages, rec->messages_size);
+	buffer->cur += rec->messages_size;
+
+	res = broker_exchange(p, pm->leader->id, conn, fd, buffer,
+			correlation_id, sync);
+	KafkaBufferPoolPut(p->buffers, buffer);
+	if (res != KAFKA_OK)
+		return res;
+	if (p->reader.body->len > 0)
+		failures = parse_produce_response(p->reader.body);
+	if (failures) {
+		struct map *partitions = map_get_string(failures, rec->topic,
+				rec->topic_len);
+		if (partitions)
+			res = (intptr_t)map_get_int32(partitions, pm->partition_id);
+		map_free(failures);
+	}
+	return res;
+}
+
+void
+producer_replay(struct kafka_producer *p, producer_metadata_t *md,
+	segment_t *s, int64_t *replay_at, int64_t now)
+{
+	/**
+	 * Sends the pending records of s, oldest first, up to
+	 * REPLAY_BYTES a round. The first retryable failure puts replay off
+	 * for the longest retry backoff, since the brokers are likely still
+	 * away. Records that fail for good are dropped. Sender thread only.
+	 * Replays from the write-ahead log are not new outcomes: their
+	 * messages were counted as failed when first sent, if by this
+	 * producer at all, and only count as replayed once acked.
+	 */
+	segment_record_t rec;
+	uint64_t pos = 0;
+	size_t sent = 0;
+	int rc;
+
+	if (producer_replay_due(s, *replay_at) > now)
+		return;
+	*replay_at = now + p->config.retry_backoff_max_ms;
+	if (!md)
+		return;
+	while (sent < REPLAY_BYTES &&
+	       (rc = segment_next_pending(s, pos, &rec)) != 0) {
+		int error;
+		pos = rec.next;
+		if (rc == -1) {
+			producer_stats_error(p, KAFKA_INVALID_MESSAGE);
+			segment_done(s, rec.pos, 1);
+			continue;
+		}
+		error = record_send(p, md, &rec);
+		if (error != KAFKA_OK) {
+			producer_stats_error(p, error);
+			if (error_retryable(error))
+				return;
+			/* logged ones failed when first sent, or in another process */
+			if (s != p->wal)
+				STATS_ADD(p->stats.messages_failed, rec.count);
+		} else if (s == p->wal) {
+			STATS_ADD(p->stats.messages_replayed, rec.count);
+		} else {
+			STATS_ADD(p->stats.messages_acked, rec.count);
+		}
+		segment_done(s, rec.pos, 1);
+		sent += rec.messages_size;
+	}
+	/* more to go, or all done: either way, on with the next round */
+	*replay_at = now;
+}
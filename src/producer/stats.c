@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <kafka.h>
+#include "../kafka-private.h"
+#include "../jansson/jansson.h"
+
+/**
+ * Producer statistics. Threads that send count what they hand over in
+ * their own shard; everything past that is counted by the sender
+ * thread. Nothing is aggregated until somebody asks.
+ */
+
+static void
+map_free_value(void *ptr)
+{
+	map_free(ptr);
+}
+
+void
+producer_stats_init(struct kafka_producer *p)
+{
+	producer_stats_t *s = &p->stats;
+	memset(s, 0, sizeof *s);
+	pthread_mutex_init(&s->lock, NULL);
+	s->brokers = map_new_int32(0, free);
+	s->topics = map_new_string(0, free, map_free_value);
+	s->emit_at = INT64_MAX;
+	if (p->config.stats_cb && p->config.stats_interval_ms > 0)
+		s->emit_at = monotonic_ms() + p->config.stats_interval_ms;
+}
+
+void
+producer_stats_destroy(struct kafka_producer *p)
+{
+	map_free(p->stats.brokers);
+	map_free(p->stats.topics);
+	pthread_mutex_destroy(&p->stats.lock);
+}
+
+broker_stats_t *
+producer_stats_broker(struct kafka_producer *p, int32_t id)
+{
+	/* sender thread only */
+	broker_stats_t *b;
+	b = map_get_int32(p->stats.brokers, id);
+	if (!b) {
+		b = calloc(1, sizeof *b);
+		pthread_mutex_lock(&p->stats.lock);
+		map_set_int32(p->stats.brokers, id, b);
+		pthread_mutex_unlock(&p->stats.lock);
+	}
+	return b;
+}
+
+partition_stats_t *
+producer_stats_partition(struct kafka_producer *p, const char *topic,
+	size_t topicLen, int32_t partition)
+{
+	/* sender thread only */
+	struct map *partitions;
+	partition_stats_t *ps = NULL;
+
+	partitions = map_get_string(p->stats.topics, topic, topicLen);
+	if (partitions)
+		ps = map_get_int32(partitions, partition);
+	if (ps)
+		return ps;
+
+	ps = calloc(1, sizeof *ps);
+	pthread_mutex_lock(&p->stats.lock);
+	if (!partitions) {
+		partitions = map_new_int32(0, free);
+		map_set_string(p->stats.topics, strndup(topic, topicLen),
+			topicLen, partitions);
+	}
+	map_set_int32(partitions, partition, ps);
+	pthread_mutex_unlock(&p->stats.lock);
+	return ps;
+}
+
+void
+producer_stats_error(struct kafka_producer *p, int error)
+{
+	if (error > 0 && error < KAFKA_STATS_ERRORS)
+		STATS_ADD(p->stats.errors[error], 1);
+}
+
+KAFKA_EXPORT void
+kafka_producer_stats(struct kafka_producer *p, struct kafka_producer_stats *stats)
+{
+	unsigned u;
+	struct producer_shard *shard;
+	producer_stats_t *s;
+
+	CHECK_OBJ_NOTNULL(p, KAFKA_PRODUCER_MAGIC);
+	s = &p->stats;
+	memset(stats, 0, sizeof *stats);
+
+	pthread_mutex_lock(&p->shards_lock);
+	for (shard = p->shards; shard; shard = shard->next) {
+		pthread_mutex_lock(&shard->lock);
+		stats->messages += shard->messages;
+		stats->bytes += shard->bytes;
+		pthread_mutex_unlock(&shard->lock);
+	}
+	pthread_mutex_unlock(&p->shards_lock);
+
+	stats->messages_acked = STATS_GET(s->messages_acked);
+	stats->messages_sent = STATS_GET(s->messages_sent);
+	stats->messages_failed = STATS_GET(s->messages_failed);
+	stats->messages_spooled = STATS_GET(s->messages_spooled);
+	stats->messages_replayed = STATS_GET(s->messages_replayed);
+	stats->requests = STATS_GET(s->requests);
+	stats->request_bytes = STATS_GET(s->request_bytes);
+	stats->response_bytes = STATS_GET(s->response_bytes);
+	stats->inflight_requests = STATS_GET(s->inflight);
+	stats->retries = STATS_GET(s->retries);
+	for (u = 0; u < KAFKA_STATS_ERRORS; u++)
+		stats->errors[u] = STATS_GET(s->errors[u]);
+	stats->buffered_bytes = kafka_producer_buffered_bytes(p);
+	if (p->spool)
+		stats->spooled_bytes = segment_used(p->spool);
+	if (p->wal)
+		stats->wal_bytes = segment_used(p->wal);
+
+	/* the shards were read first, so this cannot go negative */
+	if (stats->messages > stats->messages_acked + stats->messages_sent +
+			stats->messages_failed)
+		stats->queued_messages = stats->messages - stats->messages_acked -
+			stats->messages_sent - stats->messages_failed;
+}
+
+static void
+json_set_uint(json_t *obj, const char *key, uint64_t value)
+{
+	json_object_set_new(obj, key, json_integer((json_int_t)value));
+}
+
+KAFKA_EXPORT uint64_t
+kafka_producer_percentile(struct kafka_producer *p, int histogram,
+	double percentile)
+{
+	/**
+	 * Returns the value at percentile (0 to 100) of one of the
+	 * KAFKA_HISTOGRAM_* histograms, or 0 if it is empty.
+	 */
+	CHECK_OBJ_NOTNULL(p, KAFKA_PRODUCER_MAGIC);
+	if (histogram < 0 || histogram >= KAFKA_HISTOGRAMS)
+		return 0;
+	return histogram_percentile(&p->stats.histograms[histogram], percentile);
+}
+
+static json_t *
+json_histogram(histogram_t *h)
+{
+	json_t *obj = json_object();
+	json_set_uint(obj, "count", STATS_GET(h->total));
+	json_set_uint(obj, "p50", histogram_percentile(h, 50));
+	json_set_uint(obj, "p99", histogram_percentile(h, 99));
+	json_set_uint(obj, "p999", histogram_percentile(h, 99.9));
+	json_set_uint(obj, "max", STATS_GET(h->max));
+	return obj;
+}
+
+KAFKA_EXPORT char *
+kafka_producer_stats_json(struct kafka_producer *p)
+{
+	/**
+	 * The totals of kafka_producer_stats(), errors keyed by status
+	 * code, plus "brokers" keyed by broker id and "topics" keyed by
+	 * topic then partition, and percentiles of each histogram. The
+	 * caller frees the string.
+	 */
+	unsigned u;
+	void *i, *j;
+	char key[16];
+	char *out;
+	struct kafka_producer_stats st;
+	json_t *root, *errors, *brokers, *topics;
+
+	kafka_producer_stats(p, &st);
+	root = json_object();
+	json_set_uint(root, "messages", st.messages);
+	json_set_uint(root, "bytes", st.bytes);
+	json_set_uint(root, "messages_acked", st.messages_acked);
+	json_set_uint(root, "messages_sent", st.messages_sent);
+	json_set_uint(root, "messages_failed", st.messages_failed);
+	json_set_uint(root, "messages_spooled", st.messages_spooled);
+	json_set_uint(root, "messages_replayed", st.messages_replayed);
+	json_set_uint(root, "queued_messages", st.queued_messages);
+	json_set_uint(root, "requests", st.requests);
+	json_set_uint(root, "request_bytes", st.request_bytes);
+	json_set_uint(root, "response_bytes", st.response_bytes);
+	json_set_uint(root, "inflight_requests", st.inflight_requests);
+	json_set_uint(root, "retries", st.retries);
+	json_set_uint(root, "buffered_bytes", st.buffered_bytes);
+	json_set_uint(root, "spooled_bytes", st.spooled_bytes);
+	json_set_uint(root, "wal_bytes", st.wal_bytes);
+
+	errors = json_object();
+	for (u = 0; u < KAFKA_STATS_ERRORS; u++) {
+		if (!st.errors[u])
+			continue;
+		snprintf(key, sizeof key, "%u", u);
+		json_set_uint(errors, key, st.errors[u]);
+	}
+	json_object_set_new(root, "errors", errors);
+
+	json_object_set_new(root, "rtt_us", json_histogram(
+			&p->stats.histograms[KAFKA_HISTOGRAM_RTT]));
+	json_object_set_new(root, "latency_us", json_histogram(
+			&p->stats.histograms[KAFKA_HISTOGRAM_LATENCY]));
+	json_object_set_new(root, "batch_size", json_histogram(
+			&p->stats.histograms[KAFKA_HISTOGRAM_BATCH_SIZE]));
+
+	brokers = json_object();
+	topics = json_object();
+	pthread_mutex_lock(&p->stats.lock);
+	i = map_iter(p->stats.brokers);
+	for (; i; i = map_iter_next(p->stats.brokers, i)) {
+		broker_stats_t *b = map_iter_value(i);
+		json_t *obj = json_object();
+		json_set_uint(obj, "requests", STATS_GET(b->requests));
+		json_set_uint(obj, "request_bytes", STATS_GET(b->request_bytes));
+		json_set_uint(obj, "response_bytes", STATS_GET(b->response_bytes));
+		json_set_uint(obj, "inflight_requests", STATS_GET(b->inflight));
+		json_set_uint(obj, "errors", STATS_GET(b->errors));
+		snprintf(key, sizeof key, "%d", map_iter_int32_key(i));
+		json_object_set_new(brokers, key, obj);
+	}
+	i = map_iter(p->stats.topics);
+	for (; i; i = map_iter_next(p->stats.topics, i)) {
+		struct map *partitions = map_iter_value(i);
+		json_t *topic = json_object();
+		j = map_iter(partitions);
+		for (; j; j = map_iter_next(partitions, j)) {
+			partition_stats_t *ps = map_iter_value(j);
+			json_t *obj = json_object();
+			json_set_uint(obj, "messages", STATS_GET(ps->messages));
+			json_set_uint(obj, "bytes", STATS_GET(ps->bytes));
+			json_set_uint(obj, "retries", STATS_GET(ps->retries));
+			json_set_uint(obj, "errors", STATS_GET(ps->errors));
+			snprintf(key, sizeof key, "%d", map_iter_int32_key(j));
+			json_object_set_new(topic, key, obj);
+		}
+		json_object_set_new(topics, map_iter_string_key(i), topic);
+	}
+	pthread_mutex_unlock(&p->stats.lock);
+	json_object_set_new(root, "brokers", brokers);
+	json_object_set_new(root, "topics", topics);
+
+	out = json_dumps(root, JSON_COMPACT);
+	json_decref(root);
+	return out;
+}
+
+void
+producer_stats_tick(struct kafka_producer *p, int64_t now)
+{
+	/**
+	 * Hands the stats to the configured callback once its interval is
+	 * up. Called by the sender thread.
+	 */
+	char *json;
+	if (now < p->stats.emit_at)
+		return;
+	p->stats.emit_at = now + p->config.stats_interval_ms;
+	json = kafka_producer_stats_json(p);
+	if (json) {
+		p->config.stats_cb(json, p->config.stats_opaque);
+		free(json);
+	}
+}
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <kafka.h>
+#include "../kafka-private.h"
+
+/**
+ * Optional write-ahead log. Every message is appended to it, in wire
+ * format, by the thread sending it, which returns as soon as the log is
+ * synced; threads sending at the same time share one sync. The sender
+ * then sends the records themselves, always asking for acks, and marks
+ * each done once acked. Those that fail go back to pending, to be
+ * replayed like spooled records until they get through, and those still
+ * there after a crash are replayed by the next producer to open the log.
+ * Whatever made it into the log is delivered at least once.
+ */
+
+/**
+ * A logged send, handed to the sender: one carrier per record, pointing
+ * at the message set in the log, which stays put while the record is
+ * held.
+ */
+struct wal_job {
+	struct produce_job job;
+	struct msgvec messages;
+	struct kafka_message carriers[];
+};
+
+int
+producer_wal_open(struct kafka_producer *p)
+{
+	if (!p->config.wal_path)
+		return 0;
+	p->wal = calloc(1, sizeof *p->wal);
+	if (segment_open(p->wal, p->config.wal_path,
+			p->config.wal_max_bytes) == -1) {
+		free(p->wal);
+		p->wal = NULL;
+		return -1;
+	}
+	p->config.wal_path = NULL;	/* not ours to keep */
+	return 0;
+}
+
+void
+producer_wal_close(struct kafka_producer *p)
+{
+	if (!p->wal)
+		return;
+	segment_close(p->wal);
+	free(p->wal);
+	p->wal = NULL;
+}
+
+static int
+message_order(const void *a, const void *b)
+{
+	/* by topic and partition, in the order sent within each */
+	const struct kafka_message *x = *(struct kafka_message * const *)a;
+	const struct kafka_message *y = *(struct kafka_message * const *)b;
+	int cmp;
+
+	if (x->topic_len != y->topic_len)
+		return x->topic_len < y->topic_len ? -1 : 1;
+	cmp = memcmp(x->topic, y->topic, x->topic_len);
+	if (cmp)
+		return cmp;
+	if (x->partition != y->partition)
+		return x->partition < y->partition ? -1 : 1;
+	/* the copies sit in one array, in the caller's order */
+	return x < y ? -1 : x > y;
+}
+
+static void
+wal_hand_back(struct kafka_producer *p, int64_t pos, unsigned records,
+	size_t bytes)
+{
+	/* logged records the sender will not see: replay sends them */
+	segment_release(p->wal, pos, records);
+	producer_budget_release(p, bytes);
+	producer_sender_wakeup(p);
+}
+
+int
+producer_wal_send(struct kafka_producer *p, struct msgvec *messages,
+	int16_t sync)
+{
+	/**
+	 * Logs messages, one record per partition, and hands the records to
+	 * the sender. Returns once they are synced to the log, so messages
+	 * may be freed right after; KAFKA_BUFFER_FULL if the log has no
+	 * room for them.
+	 */
+	struct kafka_message **msgs = msgvec_data(messages);
+	unsigned u, n = msgvec_size(messages), records;
+	struct wal_job *wj;
+	segment_record_t rec;
+	uint64_t pos;
+	int64_t first;
+	size_t bytes = 0;
+	int res;
+
+	/* only an ack lets a record leave the log */
+	if (sync == KAFKA_REQUEST_ASYNC)
+		sync = KAFKA_REQUEST_SYNC;
+	if (producer_sync_level(sync) < 0)
+		return KAFKA_PRODUCER_ERROR;
+	/* records are replayed to the partition they were logged for */
+	res = producer_shard_route(p, messages);
+	if (res != KAFKA_OK)
+		return res;
+	qsort(msgs, n, sizeof *msgs, message_order);
+	for (u = 0; u < n; u++)
+		bytes += kafka_message_wire_size(msgs[u]);
+
+	res = producer_budget_reserve(p, bytes);
+	if (res != KAFKA_OK)
+		return res;
+	first = segment_append(p->wal, messages, SEGMENT_HELD, &records);
+	if (first == -1) {
+		producer_budget_release(p, bytes);
+		return KAFKA_BUFFER_FULL;
+	}
+	if (segment_sync(p->wal) != 0) {
+		segment_done(p->wal, first, records);
+		producer_budget_release(p, bytes);
+		return KAFKA_PRODUCER_ERROR;
+	}
+
+	/* from here on the messages are the log's to deliver */
+	wj = malloc(sizeof *wj + records * sizeof wj->carriers[0]);
+	if (!wj) {
+		wal_hand_back(p, first, records, bytes);
+		return KAFKA_OK;
+	}
+	memset(&wj->job, 0, sizeof wj->job);
+	msgvec_init(&wj->messages);
+	for (u = 0, pos = first; u < records; u++, pos = rec.next) {
+		struct kafka_message *c = &wj->carriers[u];
+		if (segment_read(p->wal, pos, &rec) != 1 ||
+		    msgvec_push_back(&wj->messages, c) != 0)
+			goto fail;
+		memset(c, 0, sizeof *c);
+		c->topic = (char *)rec.topic;
+		c->topic_len = rec.topic_len;
+		c->partition = rec.partition;
+		c->sealed = rec.messages;
+		c->sealed_size = rec.messages_size;
+		c->sealed_count = rec.count;
+		c->wal_pos = rec.pos;
+	}
+	wj->job.messages = &wj->messages;
+	wj->job.bytes = bytes;
+	wj->job.pending = records;
+	wj->job.res = KAFKA_OK;
+	wj->job.wal = 1;
+	wj->job.enqueued_us = monotonic_us();
+	if (producer_shard_submit(p, &wj->job, sync) == KAFKA_OK)
+		return KAFKA_OK;
+fail:
+	msgvec_destroy(&wj->messages);
+	free(wj);
+	wal_hand_back(p, first, records, bytes);
+	return KAFKA_OK;
+}
+
+void
+producer_wal_settle(struct kafka_producer *p, struct msgvec *vec, int res)
+{
+	/**
+	 * Sender thread: logged messages in vec leave the log if res says
+	 * they were acked, and are replayed from it otherwise.
+	 */
+	unsigned u;
+	struct kafka_message **msgs = msgvec_data(vec);
+
+	for (u = 0; u < msgvec_size(vec); u++) {
+		if (!msgs[u]->job->wal)
+			continue;
+		if (res == KAFKA_OK)
+			segment_done(p->wal, msgs[u]->wal_pos, 1);
+		else
+			segment_release(p->wal, msgs[u]->wal_pos, 1);
+	}
+}
+
+void
+producer_wal_finish(struct kafka_producer *p, struct produce_job *job)
+{
+	/* sender thread, once nothing of the job is left in flight */
+	struct wal_job *wj = (struct wal_job *)((char *)job -
+		offsetof(struct wal_job, job));
+
+	producer_budget_release(p, job->bytes);
+	msgvec_destroy(&wj->messages);
+	free(wj);
+}
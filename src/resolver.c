@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include <kafka.h>
+#include "kafka-private.h"
+
+/**
+ * Hostname resolution with a cache shared by all of a producer's
+ * connections. Successful lookups are kept for ttl_ms and failed ones
+ * for negative_ttl_ms, so a flapping broker does not turn every
+ * reconnect into a DNS query. In async mode an expired entry keeps being
+ * served while a background thread resolves it again, and only a
+ * hostname never seen before (or one that last failed) is resolved on
+ * the caller's thread.
+ */
+
+typedef struct {
+	int error;			/* getaddrinfo() error, 0 if resolved */
+	resolved_addrs_t addrs;
+	int64_t expires;
+	int refresh;			/* wanted by the async thread */
+} resolver_entry_t;
+
+int
+resolve_host(const char *host, resolved_addrs_t *out)
+{
+	/**
+	 * Orders the addresses the way Happy Eyeballs (RFC 8305) does:
+	 * getaddrinfo() already sorts by preference, so keep its first family
+	 * first and alternate with the other one from there. Ports are left
+	 * for the caller to fill in.
+	 */
+	int rc;
+	struct addrinfo hints, *res, *ai;
+	struct addrinfo *first[RESOLVER_MAX_ADDRS], *other[RESOLVER_MAX_ADDRS];
+	unsigned nfirst = 0, nother = 0, i, j;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+	out->n = 0;
+	rc = getaddrinfo(host, NULL, &hints, &res);
+	if (rc != 0)
+		return rc;
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if (ai->ai_addrlen > sizeof out->addr[0])
+			continue;
+		if (ai->ai_family == res->ai_family) {
+			if (nfirst < RESOLVER_MAX_ADDRS)
+				first[nfirst++] = ai;
+		} else if (nother < RESOLVER_MAX_ADDRS) {
+			other[nother++] = ai;
+		}
+	}
+	for (i = j = 0; (i < nfirst || j < nother) && out->n < RESOLVER_MAX_ADDRS;) {
+		ai = NULL;
+		if (i < nfirst)
+			ai = first[i++];
+		if (ai) {
+			memcpy(&out->addr[out->n], ai->ai_addr, ai->ai_addrlen);
+			out->len[out->n++] = ai->ai_addrlen;
+		}
+		if (j < nother && out->n < RESOLVER_MAX_ADDRS) {
+			ai = other[j++];
+			memcpy(&out->addr[out->n], ai->ai_addr, ai->ai_addrlen);
+			out->len[out->n++] = ai->ai_addrlen;
+		}
+	}
+	freeaddrinfo(res);
+	return out->n ? 0 : EAI_NONAME;
+}
+
+static void
+resolver_store(resolver_t *r, const char *host, int error,
+	const resolved_addrs_t *addrs)
+{
+	/* called with r->lock held */
+	resolver_entry_t *e;
+	e = map_get_string(r->entries, host, strlen(host));
+	if (!e) {
+		e = calloc(1, sizeof *e);
+		map_set_string(r->entries, strdup(host), strlen(host), e);
+	}
+	e->error = error;
+	e->addrs = *addrs;
+	e->refresh = 0;
+	e->expires = monotonic_ms() +
+		(error ? r->negative_ttl_ms : r->ttl_ms);
+}
+
+static void *
+resolver_main(void *arg)
+{
+	/**
+	 * Resolves expired hostnames flagged by resolver_lookup(), one at a
+	 * time, without holding the lock during the lookup.
+	 */
+	resolver_t *r = arg;
+	pthread_mutex_lock(&r->lock);
+	while (r->running) {
+		void *i;
+		char *host = NULL;
+		for (i = map_iter(r->entries); i; i = map_iter_next(r->entries, i)) {
+			resolver_entry_t *e = map_iter_value(i);
+			if (e->refresh) {
+				host = strdup(map_iter_string_key(i));
+				break;
+			}
+		}
+		if (host) {
+			int error;
+			resolved_addrs_t addrs;
+			pthread_mutex_unlock(&r->lock);
+			error = resolve_host(host, &addrs);
+			pthread_mutex_lock(&r->lock);
+			if (!error) {
+				resolver_store(r, host, 0, &addrs);
+			} else {
+				/* keep serving the old addresses until the next expiry */
+				resolver_entry_t *e;
+				e = map_get_string(r->entries, host, strlen(host));
+				e->refresh = 0;
+				e->expires = monotonic_ms() + r->negative_ttl_ms;
+			}
+			free(host);
+			continue;
+		}
+		pthread_cond_wait(&r->wakeup, &r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+resolver_t *
+resolver_new(int ttl_ms, int negative_ttl_ms, int async)
+{
+	resolver_t *r;
+	r = calloc(1, sizeof *r);
+	if (!r)
+		return NULL;
+	r->entries = map_new_string(0, free, free);
+	r->ttl_ms = ttl_ms;
+	r->negative_ttl_ms = negative_ttl_ms;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->wakeup, NULL);
+	if (async) {
+		r->running = 1;
+		if (pthread_create(&r->thread, NULL, resolver_main, r) != 0)
+			r->running = 0;
+	}
+	r->async = r->running;
+	return r;
+}
+
+void
+resolver_free(resolver_t *r)
+{
+	if (!r)
+		return;
+	if (r->async) {
+		pthread_mutex_lock(&r->lock);
+		r->running = 0;
+		pthread_cond_signal(&r->wakeup);
+		pthread_mutex_unlock(&r->lock);
+		pthread_join(r->thread, NULL);
+	}
+	map_free(r->entries);
+	pthread_cond_destroy(&r->wakeup);
+	pthread_mutex_destroy(&r->lock);
+	free(r);
+}
+
+int
+resolver_lookup(resolver_t *r, const char *host, resolved_addrs_t *out)
+{
+	/**
+	 * Fills out with host's addresses, from the cache when it can.
+	 * Returns 0, or the getaddrinfo() error of the (cached) failure.
+	 */
+	int error;
+	resolver_entry_t *e;
+	resolved_addrs_t addrs;
+	int64_t now = monotonic_ms();
+
+	pthread_mutex_lock(&r->lock);
+	e = map_get_string(r->entries, host, strlen(host));
+	if (e && (now < e->expires || (r->async && !e->error))) {
+		if (now >= e->expires && !e->refresh) {
+			e->refresh = 1;
+			pthread_cond_signal(&r->wakeup);
+		}
+		error = e->error;
+		*out = e->addrs;
+		pthread_mutex_unlock(&r->lock);
+		return error;
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	error = resolve_host(host, &addrs);
+
+	pthread_mutex_lock(&r->lock);
+	resolver_store(r, host, error, &addrs);
+	pthread_mutex_unlock(&r->lock);
+	*out = addrs;
+	return error;
+}
@@ -0,0 +1,535 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "kafka-private.h"
+#include "serialize.h"
+
+/**
+ * Segments are memory-mapped files of records, each holding one
+ * partition's message set in wire format with its CRCs already computed,
+ * so it can go out again as is. Records are appended at the tail and
+ * marked done in any order; the head moves past the done ones at the
+ * front, and the space it leaves behind is written again once the tail
+ * gets round to it.
+ *
+ * Head and tail are offsets into an endless stream of data laid over the
+ * file again and again: offset pos lives at SEGMENT_DATA + pos % the
+ * data size. They only grow, so a position handed out once can never
+ * name a different record later on. A record never straddles the end of
+ * the file; when it does not fit, the rest of the lap is skipped, marked
+ * with a SEGMENT_WRAP header if there is room for one.
+ *
+ * A record is either pending, waiting to be replayed by the sender, or
+ * held by the thread that appended it until that thread says how its
+ * send went. Held records found when a segment is opened lost their
+ * owner with the previous process and become pending.
+ *
+ * The file header and record headers are in host byte order, as the
+ * file never leaves the machine. A record only counts once the tail has
+ * moved past it; one torn by a crash is cut off when the segment is
+ * opened again. Every function may be called from any thread.
+ */
+
+#define SEGMENT_MAGIC    0x6b736567	/* "kseg" */
+#define SEGMENT_VERSION  3
+
+#define SEGMENT_WRAP     3	/* nothing more until the end of the file */
+
+struct segment_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t head;		/* first record not done */
+	uint64_t tail;		/* end of the last record */
+};
+
+struct segment_record_header {
+	uint32_t len;		/* of the payload */
+	uint32_t crc;		/* of the payload */
+	uint8_t state;		/* SEGMENT_*, not covered by the crc */
+	uint8_t pad[7];
+};
+
+#define SEGMENT_DATA  ((uint64_t)sizeof(struct segment_header))
+#define RECORD_ALIGN(n)  (((n) + 7) & ~(uint64_t)7)
+#define RECORD_MIN  (2 + 4 + 4 + 4)	/* payload with an empty topic and set */
+#define RECORD_HEADER  ((uint64_t)sizeof(struct segment_record_header))
+
+static void segment_recover(segment_t *s);
+
+static uint64_t
+segment_lap(segment_t *s)
+{
+	/* bytes of record data the file holds, a multiple of the alignment */
+	return (s->size - SEGMENT_DATA) & ~(uint64_t)7;
+}
+
+static uint64_t
+segment_room(segment_t *s, uint64_t pos)
+{
+	/* from pos to the end of its lap */
+	return segment_lap(s) - pos % segment_lap(s);
+}
+
+static struct segment_record_header *
+record_header(segment_t *s, uint64_t pos)
+{
+	return (struct segment_record_header *)(s->base + SEGMENT_DATA +
+		pos % segment_lap(s));
+}
+
+static void
+segment_reset(segment_t *s)
+{
+	/* drops every record */
+	s->header->head = 0;
+	s->header->tail = 0;
+}
+
+static size_t
+segment_size(int fd, size_t size, size_t file_size)
+{
+	/**
+	 * The size to map a segment at: its records wrap at the end of the
+	 * file, so one that holds any keeps its size. An empty one grows
+	 * to size.
+	 */
+	struct segment_header h;
+
+	if (file_size > size)
+		size = file_size;
+	if (size < SEGMENT_DATA + 4096)
+		size = SEGMENT_DATA + 4096;
+	if (file_size >= SEGMENT_DATA + 4096 &&
+	    pread(fd, &h, sizeof h, 0) == (ssize_t)sizeof h &&
+	    h.magic == SEGMENT_MAGIC && h.version == SEGMENT_VERSION &&
+	    h.head != h.tail)
+		size = file_size;
+	return size;
+}
+
+int
+segment_open(segment_t *s, const char *path, size_t size)
+{
+	/**
+	 * Maps the segment at path, creating it if needed. An existing one
+	 * keeps its records, and its size if that is larger or if it has
+	 * records. Returns -1 with errno set if it cannot be opened or
+	 * mapped.
+	 */
+	struct stat st;
+	int created;
+
+	memset(s, 0, sizeof *s);
+	s->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (s->fd == -1)
+		return -1;
+	if (fstat(s->fd, &st) == -1)
+		goto fail;
+	created = (size_t)st.st_size < SEGMENT_DATA;
+	size = segment_size(s->fd, size, st.st_size);
+	/* sparse, so disk is only used as records are written */
+	if ((size_t)st.st_size < size && ftruncate(s->fd, size) == -1)
+		goto fail;
+	s->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+	if (s->base == MAP_FAILED) {
+		s->base = NULL;
+		goto fail;
+	}
+	s->size = size;
+	s->header = (struct segment_header *)s->base;
+	if (created || s->header->magic != SEGMENT_MAGIC ||
+	    s->header->version != SEGMENT_VERSION ||
+	    s->header->head > s->header->tail ||
+	    s->header->tail - s->header->head > segment_lap(s)) {
+		s->header->magic = SEGMENT_MAGIC;
+		s->header->version = SEGMENT_VERSION;
+		segment_reset(s);
+	}
+	segment_recover(s);
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_mutex_init(&s->sync_lock, NULL);
+	return 0;
+fail:
+	segment_close(s);
+	return -1;
+}
+
+void
+segment_close(segment_t *s)
+{
+	if (s->base) {
+		munmap(s->base, s->size);
+		pthread_mutex_destroy(&s->lock);
+		pthread_mutex_destroy(&s->sync_lock);
+	}
+	if (s->fd != -1)
+		close(s->fd);
+	s->base = NULL;
+	s->header = NULL;
+	s->fd = -1;
+}
+
+static uint64_t
+record_skip(segment_t *s, uint64_t pos)
+{
+	/* pos, or the start of the next lap if no record begins at pos */
+	uint64_t room = segment_room(s, pos);
+	if (room < RECORD_HEADER || record_header(s, pos)->state == SEGMENT_WRAP)
+		return pos + room;
+	return pos;
+}
+
+static int
+record_valid(segment_t *s, uint64_t pos, uint64_t tail)
+{
+	struct segment_record_header *rh = record_header(s, pos);
+	uint64_t end = tail - pos;
+	if (end > segment_room(s, pos))
+		end = segment_room(s, pos);
+	return end >= RECORD_HEADER && rh->len >= RECORD_MIN &&
+		rh->len <= end - RECORD_HEADER &&
+		rh->crc == crc32(0, rh + 1, rh->len);
+}
+
+static uint64_t
+record_next(segment_t *s, uint64_t pos)
+{
+	return pos + RECORD_ALIGN(RECORD_HEADER + record_header(s, pos)->len);
+}
+
+static void
+segment_recover(segment_t *s)
+{
+	/**
+	 * Cuts the segment off at its first torn or corrupt record and hands
+	 * held records, whose owner is gone, over to replay.
+	 */
+	uint64_t pos = s->header->head;
+	while (pos < s->header->tail) {
+		struct segment_record_header *rh;
+		pos = record_skip(s, pos);
+		if (pos >= s->header->tail || !record_valid(s, pos, s->header->tail)) {
+			s->header->tail = pos < s->header->tail ? pos : s->header->tail;
+			break;
+		}
+		rh = record_header(s, pos);
+		if (rh->state == SEGMENT_HELD)
+			rh->state = SEGMENT_PENDING;
+		if (rh->state == SEGMENT_PENDING)
+			s->pending++;
+		pos = record_next(s, pos);
+	}
+	if (s->header->head == s->header->tail)
+		segment_reset(s);
+}
+
+unsigned
+segment_pending(segment_t *s)
+{
+	return __atomic_load_n(&s->pending, __ATOMIC_RELAXED);
+}
+
+size_t
+segment_used(segment_t *s)
+{
+	uint64_t head = __atomic_load_n(&s->header->head, __ATOMIC_RELAXED);
+	uint64_t tail = __atomic_load_n(&s->header->tail, __ATOMIC_RELAXED);
+	return tail > head ? tail - head : 0;
+}
+
+int64_t
+segment_append(segment_t *s, struct msgvec *messages, int state,
+	unsigned *records)
+{
+	/**
+	 * Appends messages as one record per run of messages with the same
+	 * topic and partition, in state SEGMENT_PENDING or SEGMENT_HELD.
+	 * Returns the position of the first record and sets *records, or
+	 * returns -1 and appends nothing if they do not all fit.
+	 */
+	struct kafka_message **msgs = msgvec_data(messages);
+	unsigned u, n = msgvec_size(messages), count = 0;
+	struct msgvec run;
+	uint64_t start, pos, end;
+	int64_t res = -1;
+
+	msgvec_init(&run);
+	pthread_mutex_lock(&s->lock);
+	start = pos = s->header->tail;
+	/* the space the head has left behind is free again */
+	end = s->header->head + segment_lap(s);
+	for (u = 0; u < n; u++) {
+		struct kafka_message *msg = msgs[u];
+		struct segment_record_header *rh;
+		uint8_t *ptr;
+		size_t len, size;
+		uint64_t need, room;
+
+		if (msgvec_push_back(&run, msg) != 0)
+			goto out;
+		if (u + 1 < n && msgs[u + 1]->partition == msg->partition &&
+		    msgs[u + 1]->topic_len == msg->topic_len &&
+		    memcmp(msgs[u + 1]->topic, msg->topic, msg->topic_len) == 0)
+			continue;
+
+		size = message_set_packed_size(&run);
+		len = 2 + msg->topic_len + 4 + 4 + 4 + size;
+		need = RECORD_ALIGN(RECORD_HEADER + len);
+		if (len > UINT32_MAX || need > segment_lap(s))
+			goto out;
+		room = segment_room(s, pos);
+		if (need > room) {
+			/* wrap round to the start of the file */
+			if (pos + room + need > end)
+				goto out;
+			if (room >= RECORD_HEADER)
+				record_header(s, pos)->state = SEGMENT_WRAP;
+			pos += room;
+		}
+		if (pos + need > end)
+			goto out;
+		if (count == 0)
+			start = pos;
+		rh = record_header(s, pos);
+		ptr = (uint8_t *)(rh + 1);
+		ptr += string_pack_len(msg->topic, msg->topic_len, ptr);
+		ptr += uint32_pack(msg->partition, ptr);
+		ptr += uint32_pack(messages_count(&run), ptr);
+		ptr += uint32_pack(size, ptr);
+		serialize_message_set(&run, ptr);
+		rh->len = len;
+		rh->crc = crc32(0, rh + 1, len);
+		rh->state = state;
+		memset(rh->pad, 0, sizeof rh->pad);
+		pos += need;
+		msgvec_clear(&run);
+		count++;
+	}
+	/* the records exist once the tail is past them */
+	__atomic_store_n(&s->header->tail, pos, __ATOMIC_RELEASE);
+	if (state == SEGMENT_PENDING)
+		__atomic_add_fetch(&s->pending, count, __ATOMIC_RELAXED);
+	s->appended++;
+	*records = count;
+	res = start;
+out:
+	pthread_mutex_unlock(&s->lock);
+	msgvec_destroy(&run);
+	return res;
+}
+
+static int
+record_read(segment_t *s, uint64_t pos, segment_record_t *rec)
+{
+	struct segment_record_header *rh = record_header(s, pos);
+	uint8_t *ptr = (uint8_t *)(rh + 1), *end = ptr + rh->len;
+	uint16_t topicLen;
+	uint32_t partition, count, size;
+
+	if (rh->len < RECORD_MIN)
+		return -1;
+	ptr += uint16_unpack(ptr, &topicLen);
+	if (topicLen > INT16_MAX || topicLen > end - ptr - 12)
+		return -1;
+	rec->topic = (const char *)ptr;
+	rec->topic_len = topicLen;
+	ptr += topicLen;
+	ptr += uint32_unpack(ptr, &partition);
+	ptr += uint32_unpack(ptr, &count);
+	ptr += uint32_unpack(ptr, &size);
+	if (size != (size_t)(end - ptr))
+		return -1;
+	rec->partition = partition;
+	rec->count = count;
+	rec->messages_size = size;
+	rec->messages = ptr;
+	return 1;
+}
+
+int
+segment_next_pending(segment_t *s, uint64_t pos, segment_record_t *rec)
+{
+	/**
+	 * Finds the first pending record at or after pos, or after the head
+	 * if that is further on. Returns 1 for a record, 0 if there is none
+	 * and -1 for one that is corrupt, which the caller should mark done
+	 * to get rid of. rec->next is where to look for the one after it.
+	 */
+	uint64_t tail;
+	int res = 0;
+
+	pthread_mutex_lock(&s->lock);
+	tail = s->header->tail;
+	if (pos < s->header->head)
+		pos = s->header->head;
+	while (pos < tail) {
+		pos = record_skip(s, pos);
+		if (pos >= tail)
+			break;
+		if (tail - pos < RECORD_HEADER ||
+		    record_header(s, pos)->len > segment_room(s, pos) - RECORD_HEADER ||
+		    record_header(s, pos)->len > tail - pos - RECORD_HEADER) {
+			/* nothing past a broken length can be found */
+			rec->pos = pos;
+			rec->next = tail;
+			res = -1;
+			break;
+		}
+		if (record_header(s, pos)->state == SEGMENT_PENDING) {
+			rec->pos = pos;
+			rec->next = record_next(s, pos);
+			if (!record_valid(s, pos, tail) ||
+			    record_read(s, pos, rec) == -1)
+				res = -1;
+			else
+				res = 1;
+			break;
+		}
+		pos = record_next(s, pos);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return res;
+}
+
+int
+segment_read(segment_t *s, uint64_t pos, segment_record_t *rec)
+{
+	/**
+	 * Reads the record at pos, whatever its state, for whoever holds
+	 * it. Returns 1, or -1 if there is no valid record at pos.
+	 */
+	uint64_t tail;
+	int res = -1;
+
+	pthread_mutex_lock(&s->lock);
+	tail = s->header->tail;
+	if (pos >= s->header->head && pos < tail)
+		pos = record_skip(s, pos);
+	if (pos >= s->header->head && pos < tail &&
+	    record_valid(s, pos, tail) && record_read(s, pos, rec) == 1) {
+		rec->pos = pos;
+		rec->next = record_next(s, pos);
+		res = 1;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return res;
+}
+
+static void
+segment_mark(segment_t *s, uint64_t pos, unsigned n, int state)
+{
+	/**
+	 * Puts the n records from pos in state, then moves the head past
+	 * every done record at the front. Called with the lock held.
+	 */
+	uint64_t head = s->header->head, tail = s->header->tail;
+	struct segment_record_header *rh;
+
+	for (; n > 0 && pos >= head && pos < tail; n--) {
+		pos = record_skip(s, pos);
+		if (pos >= tail)
+			break;
+		rh = record_header(s, pos);
+		if (rh->state != SEGMENT_DONE) {
+			if (rh->state == SEGMENT_PENDING)
+				__atomic_sub_fetch(&s->pending, 1, __ATOMIC_RELAXED);
+			if (state == SEGMENT_PENDING)
+				__atomic_add_fetch(&s->pending, 1, __ATOMIC_RELAXED);
+			rh->state = state;
+		}
+		pos = record_next(s, pos);
+	}
+	while (head < tail) {
+		head = record_skip(s, head);
+		if (head >= tail)
+			break;
+		if (record_header(s, head)->state != SEGMENT_DONE)
+			break;
+		head = record_next(s, head);
+	}
+	if (head >= tail) {
+		/* empty: the next record goes at the start of a lap */
+		head = tail + segment_room(s, tail) % segment_lap(s);
+		__atomic_store_n(&s->header->tail, head, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&s->header->head, head, __ATOMIC_RELAXED);
+}
+
+void
+segment_done(segment_t *s, uint64_t pos, unsigned n)
+{
+	/* marks the n records from pos done */
+	pthread_mutex_lock(&s->lock);
+	segment_mark(s, pos, n, SEGMENT_DONE);
+	pthread_mutex_unlock(&s->lock);
+}
+
+void
+segment_release(segment_t *s, uint64_t pos, unsigned n)
+{
+	/* hands the n held records from pos over to replay */
+	pthread_mutex_lock(&s->lock);
+	segment_mark(s, pos, n, SEGMENT_PENDING);
+	pthread_mutex_unlock(&s->lock);
+}
+
+int
+segment_sync(segment_t *s)
+{
+	/**
+	 * Makes every record appended so far durable. Threads that sync at
+	 * the same time share the msync: the one holding the sync lock
+	 * flushes everything appended by then, so those waiting behind it
+	 * usually find their records already on disk.
+	 */
+	uint64_t want, have;
+	int res = 0;
+
+	pthread_mutex_lock(&s->lock);
+	want = s->appended;
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_mutex_lock(&s->sync_lock);
+	if (s->synced < want) {
+		pthread_mutex_lock(&s->lock);
+		have = s->appended;
+		pthread_mutex_unlock(&s->lock);
+		/* the records may sit anywhere; only dirty pages are written */
+		res = msync(s->base, s->size, MS_SYNC);
+		if (res == 0)
+			s->synced = have;
+	}
+	pthread_mutex_unlock(&s->sync_lock);
+	return res;
+}
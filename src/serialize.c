@@ -27,7 +27,7 @@
 #include <assert.h>
 #include <string.h>
 #include "serialize.h"
-#include "vector.h"
+#include "msgvec.h"
 
 size_t
 uint8_unpack(uint8_t *ptr, uint8_t *value)
@@ -106,11 +106,8 @@ uint32_pack(uint32_t value, uint8_t *ptr)
 size_t
 uint64_pack(uint64_t value, uint8_t *ptr)
 {
-	uint32_t v;
-	v = htonl((uint32_t)value);
-	uint32_pack(v, ptr);
-	v = htonl((uint32_t)(value >> 32));
-	uint32_pack(v, ptr+4);
+	uint32_pack((uint32_t)(value >> 32), ptr);
+	uint32_pack((uint32_t)value, ptr+4);
 	return 8;
 }
 
@@ -120,7 +117,12 @@ string_pack(const char *str, uint8_t *ptr)
 	/**
 	 * strings are prefixed with int16_t length
 	 */
-	uint16_t len = strlen(str);
+	return string_pack_len(str, strlen(str), ptr);
+}
+
+size_t
+string_pack_len(const char *str, uint16_t len, uint8_t *ptr)
+{
 	size_t offset = uint16_pack(len, ptr);
 	memcpy(ptr + offset, str, len);
 	return offset + len;
@@ -159,65 +161,115 @@ kafka_message_serialize0(struct kafka_message *m, uint8_t *ptr)
 	return p - ptr;
 }
 
-static int32_t
-count_keys(hashtable_t *p)
+size_t
+message_set_packed_size(struct msgvec *messages)
+{
+	/**
+	 * Exact number of bytes serialize_message_set() will write.
+	 */
+	unsigned u;
+	size_t size = 0;
+	struct kafka_message **msgs = msgvec_data(messages);
+	for (u = 0; u < msgvec_size(messages); u++)
+		size += kafka_message_wire_size(msgs[u]);
+	return size;
+}
+
+size_t
+serialize_message_set(struct msgvec *messages, uint8_t *ptr)
+{
+	/**
+	 * Writes messages as a message set, CRCs and all, without its size
+	 * prefix. Sealed sets are copied in as they are.
+	 */
+	unsigned u;
+	uint8_t *p = ptr;
+	struct kafka_message **msgs = msgvec_data(messages);
+	for (u = 0; u < msgvec_size(messages); u++) {
+		if (msgs[u]->sealed) {
+			memcpy(p, msgs[u]->sealed, msgs[u]->sealed_size);
+			p += msgs[u]->sealed_size;
+		} else
+			p += kafka_message_serialize0(msgs[u], p);
+	}
+	return p - ptr;
+}
+
+size_t
+topic_partitions_packed_size(struct map *partitions)
 {
-	int32_t k = 0;
-	void *iter = hashtable_iter(p);
-	for (; iter; iter = hashtable_iter_next(p, iter)) {
-		k++;
+	/**
+	 * Exact number of bytes serialize_topic_partitions() will write.
+	 */
+	void *iter;
+	size_t size = 0;
+	iter = map_iter(partitions);
+	for (; iter; iter = map_iter_next(partitions, iter)) {
+		/* partition id, message set size */
+		size += sizeof(int32_t) * 2;
+		size += message_set_packed_size(map_iter_value(iter));
 	}
-	return k;
+	return size;
 }
 
 size_t
-serialize_topic_partitions(hashtable_t *partitions, KafkaBuffer *buffer)
+topics_and_partitions_packed_size(struct map *topicsAndPartitions)
 {
+	/**
+	 * Exact number of bytes serialize_topics_and_partitions() will write.
+	 */
+	void *iter;
+	size_t size = sizeof(int32_t); /* number of topics */
+	iter = map_iter(topicsAndPartitions);
+	for (; iter; iter = map_iter_next(topicsAndPartitions, iter)) {
+		struct map *partitions = map_iter_value(iter);
+		/* topic string, number of partitions */
+		size += 2 + map_iter_string_key_len(iter) + sizeof(int32_t);
+		size += topic_partitions_packed_size(partitions);
+	}
+	return size;
+}
+
+size_t
+serialize_topic_partitions(struct map *partitions, KafkaBuffer *buffer)
+{
+	/**
+	 * The caller must have sized buffer with topic_partitions_packed_size()
+	 * or topics_and_partitions_packed_size(); nothing is reserved here.
+	 */
 	void *iter;
-	unsigned u;
 	size_t offset = buffer->cur - buffer->data;
-	iter = hashtable_iter(partitions);
-	for (; iter; iter = hashtable_iter_next(partitions, iter)) {
-		int32_t msgSetSize = 0;
-		size_t msgSetSizeOffset;
-		int32_t partId = *(int32_t *)hashtable_iter_key(iter);
-		struct vector *messages = hashtable_iter_value(iter);
-
-		KafkaBufferReserve(buffer, sizeof(int32_t) * 2);
+	iter = map_iter(partitions);
+	for (; iter; iter = map_iter_next(partitions, iter)) {
+		uint8_t *msgSetSizePtr;
+		size_t msgSetSize;
+		int32_t partId = map_iter_int32_key(iter);
+
 		buffer->cur += uint32_pack(partId, buffer->cur);
-		msgSetSizeOffset = buffer->cur - buffer->data;
 		/* msgSetSize is written later, skip it for now */
+		msgSetSizePtr = buffer->cur;
 		buffer->cur += sizeof(int32_t);
-		for (u = 0; u < vector_size(messages); u++) {
-			struct kafka_message *msg = vector_at(messages, u);
-			size_t msgSize = sizeof(int64_t) + sizeof(int32_t);
-			msgSize += kafka_message_packed_size(msg);
-			KafkaBufferReserve(buffer, msgSize);
-			buffer->cur += kafka_message_serialize0(msg, buffer->cur);
-			msgSetSize += msgSize;
-		}
-		uint32_pack(msgSetSize, &buffer->data[msgSetSizeOffset]);
+		msgSetSize = serialize_message_set(map_iter_value(iter), buffer->cur);
+		buffer->cur += msgSetSize;
+		uint32_pack(msgSetSize, msgSetSizePtr);
 	}
 	return (buffer->cur - buffer->data) - offset;
 }
 
 size_t
-serialize_topics_and_partitions(hashtable_t *topicsAndPartitions, KafkaBuffer *buffer)
+serialize_topics_and_partitions(struct map *topicsAndPartitions, KafkaBuffer *buffer)
 {
-	size_t len;
-	void *u, *v;
+	void *u;
 
-	buffer->cur += uint32_pack(count_keys(topicsAndPartitions), buffer->cur);
+	buffer->cur += uint32_pack(map_size(topicsAndPartitions), buffer->cur);
 
-	u = hashtable_iter(topicsAndPartitions);
-	for (; u; u = hashtable_iter_next(topicsAndPartitions, u)) {
-		size_t topicLen;
-		const char *topic = hashtable_iter_key(u);
-		hashtable_t *partitions = hashtable_iter_value(u);
-		topicLen = 2 + strlen(topic) + 4;
-		KafkaBufferReserve(buffer, topicLen);
-		buffer->cur += string_pack(topic, buffer->cur);
-		buffer->cur += uint32_pack(count_keys(partitions), buffer->cur);
+	u = map_iter(topicsAndPartitions);
+	for (; u; u = map_iter_next(topicsAndPartitions, u)) {
+		const char *topic = map_iter_string_key(u);
+		struct map *partitions = map_iter_value(u);
+		buffer->cur += string_pack_len(topic, map_iter_string_key_len(u),
+					buffer->cur);
+		buffer->cur += uint32_pack(map_size(partitions), buffer->cur);
 		serialize_topic_partitions(partitions, buffer);
 	}
 	return buffer->cur - buffer->data;
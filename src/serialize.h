@@ -41,11 +41,16 @@ inline size_t uint16_pack(uint16_t value, uint8_t *ptr);
 inline size_t uint32_pack(uint32_t value, uint8_t *ptr);
 inline size_t uint64_pack(uint64_t value, uint8_t *ptr);
 inline size_t string_pack(const char *str, uint8_t *ptr);
+size_t string_pack_len(const char *str, uint16_t len, uint8_t *ptr);
 inline size_t bytestring_pack(bytestring_t *str, uint8_t *ptr);
 
 int32_t kafka_message_serialize(struct kafka_message *m, uint8_t **out);
-size_t serialize_topic_partitions(hashtable_t *partitions, KafkaBuffer *buffer);
-size_t serialize_topics_and_partitions(hashtable_t *topicsAndPartitions,
+size_t message_set_packed_size(struct msgvec *messages);
+size_t serialize_message_set(struct msgvec *messages, uint8_t *ptr);
+size_t topic_partitions_packed_size(struct map *partitions);
+size_t topics_and_partitions_packed_size(struct map *topicsAndPartitions);
+size_t serialize_topic_partitions(struct map *partitions, KafkaBuffer *buffer);
+size_t serialize_topics_and_partitions(struct map *topicsAndPartitions,
 				KafkaBuffer *buffer);
 inline size_t request_header_pack(request_header_t *header,
 				const char *client, uint8_t *ptr);
@@ -27,6 +27,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <zookeeper/zookeeper.h>
 #include "kafka-private.h"
@@ -42,6 +43,38 @@ void free_String_vector(struct String_vector *v)
 	}
 }
 
+int64_t
+monotonic_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int64_t
+monotonic_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+deadline_after_ms(struct timespec *ts, int64_t ms)
+{
+	/**
+	 * Absolute CLOCK_MONOTONIC time ms from now, for condition variables
+	 * created with that clock.
+	 */
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
 char *string_builder(const char *fmt, ...)
 {
     /**
@@ -90,43 +123,106 @@ print_bytes(uint8_t *buf, size_t len)
 	printf("\n");
 }
 
-size_t
-jenkins(const void *key)
+/**
+ * wyhash (public domain, Wang Yi), trimmed to a fixed seed and secret.
+ * Reads 8 bytes at a time and needs the key length up front.
+ */
+static const uint64_t wyp[4] = {
+	0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+	0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static void
+wymum(uint64_t *a, uint64_t *b)
 {
-    size_t hash, i;
-    const char *k = (const char *)key;
-    size_t len = strlen(k);
-    for (hash = i = 0; i < len; i++) {
-        hash += k[i];
-        hash += (hash << 10);
-        hash ^= (hash >> 6);
-    }
-    hash += (hash << 3);
-    hash ^= (hash >> 11);
-    hash += (hash << 15);
-    return hash;
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t)*a * *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32;
+	uint64_t la = (uint32_t)*a, lb = (uint32_t)*b, hi, lo;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32), c = t < rl;
+	lo = t + (rm1 << 32);
+	c += lo < t;
+	hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+	*a = lo;
+	*b = hi;
+#endif
 }
 
-int
-keycmp(const void *a, const void *b)
+static uint64_t
+wymix(uint64_t a, uint64_t b)
 {
-	const char *aa = (const char *)a;
-	const char *bb = (const char *)b;
-	return strcmp(aa, bb) == 0;
+	wymum(&a, &b);
+	return a ^ b;
 }
 
-size_t
-int32_hash(const void *key)
+static uint64_t
+wyr8(const uint8_t *p)
 {
-	return *(int32_t *)key;
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
 }
 
-int
-int32_cmp(const void *a, const void *b)
+static uint64_t
+wyr4(const uint8_t *p)
 {
-	int32_t aa = *(int32_t *)a;
-	int32_t bb = *(int32_t *)b;
-	return aa == bb;
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static uint64_t
+wyr3(const uint8_t *p, size_t k)
+{
+	return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+size_t
+hash_bytes(const void *key, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)key;
+	uint64_t a, b, seed;
+	seed = wymix(wyp[0], wyp[1]);
+	if (len <= 16) {
+		if (len >= 4) {
+			a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+			b = (wyr4(p + len - 4) << 32) |
+				wyr4(p + len - 4 - ((len >> 3) << 2));
+		} else if (len > 0) {
+			a = wyr3(p, len);
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t i = len;
+		if (i > 48) {
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+				see1 = wymix(wyr8(p + 16) ^ wyp[2], wyr8(p + 24) ^ see1);
+				see2 = wymix(wyr8(p + 32) ^ wyp[3], wyr8(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = wyr8(p + i - 16);
+		b = wyr8(p + i - 8);
+	}
+	a ^= wyp[1];
+	b ^= seed;
+	wymum(&a, &b);
+	return (size_t)wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
 }
 
 json_t *
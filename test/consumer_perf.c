@@ -0,0 +1,464 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "kafka-private.h"
+#include "mock_broker.h"
+
+/**
+ * kafka-consumer-perf: fetches a topic's partitions from their leaders
+ * as fast as they will go and reports throughput, fetch round trips and
+ * CPU time per GB. Runs against a real broker (-b) or an in-process mock
+ * cluster serving a pre-generated log (-m).
+ *
+ * Each leader gets one connection. Its partitions are dealt round robin
+ * into prefetch depth groups, and every group keeps one FetchRequest in
+ * flight, so up to depth requests are pipelined per connection.
+ */
+
+#define CLIENT "kafka-consumer-perf"
+
+struct options {
+	const char *broker;
+	int mock_brokers;
+	int64_t mock_messages;	/* per partition */
+	int mock_size;
+	const char *topic;
+	int partitions;		/* 0 for all */
+	int fetch_size;		/* max bytes per partition */
+	int depth;
+	int max_wait_ms;
+	int64_t messages;	/* 0 to read up to the high watermarks */
+};
+
+struct part {
+	int32_t partition;
+	int64_t offset;
+	int64_t high_watermark;
+	int done;
+};
+
+struct group {
+	struct part *parts[64];
+	unsigned n;
+	int64_t sent_us;
+};
+
+struct conn {
+	int fd;
+	broker_t *broker;
+	frame_reader_t reader;
+	struct group *groups;
+	unsigned ngroups;
+	struct group **inflight;	/* ring of ngroups, oldest first */
+	unsigned head, count;
+	int32_t correlation_id;
+};
+
+static struct options o;
+static int64_t messages, bytes, fetches, corrupt, errors;
+static histogram_t rtt;
+
+static int64_t
+cpu_us(void)
+{
+	struct rusage ru;
+#ifdef RUSAGE_THREAD
+	getrusage(RUSAGE_THREAD, &ru);	/* leave out the mock's threads */
+#else
+	getrusage(RUSAGE_SELF, &ru);
+#endif
+	return (int64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+		ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static int
+part_done(struct part *p)
+{
+	if (p->done)
+		return 1;
+	if (o.messages > 0)
+		return messages >= o.messages;
+	return p->high_watermark >= 0 && p->offset >= p->high_watermark;
+}
+
+static int
+send_fetch(struct conn *c, struct group *g)
+{
+	/**
+	 * Sends a fetch for the partitions of g that are not done. Returns 0
+	 * if there were none, 1 if sent, -1 on error.
+	 */
+	fetch_partition_request_t req[64];
+	KafkaBuffer *buffer;
+	unsigned u, n = 0;
+	size_t len;
+	int rc = 1;
+
+	for (u = 0; u < g->n; u++) {
+		if (part_done(g->parts[u]))
+			continue;
+		req[n].partition = g->parts[u]->partition;
+		req[n].offset = g->parts[u]->offset;
+		req[n].max_bytes = o.fetch_size;
+		n++;
+	}
+	if (n == 0)
+		return 0;
+	len = fetch_request_packed_size(CLIENT, o.topic, n);
+	buffer = KafkaBufferNew(len);
+	buffer->cur = buffer->data;
+	fetch_request_pack(c->correlation_id++, CLIENT, o.topic, req, n,
+		o.max_wait_ms, 1, buffer);
+	g->sent_us = monotonic_us();
+	if (io_write_full(c->fd, buffer->data, len, io_deadline(10000)) == -1)
+		rc = -1;
+	else
+		c->inflight[(c->head + c->count++) % c->ngroups] = g;
+	KafkaBufferFree(buffer);
+	return rc;
+}
+
+static struct part *
+group_part(struct group *g, int32_t partition)
+{
+	unsigned u;
+	for (u = 0; u < g->n; u++)
+		if (g->parts[u]->partition == partition)
+			return g->parts[u];
+	return NULL;
+}
+
+static int
+handle_response(struct conn *c, fetch_response_t *resp)
+{
+	/**
+	 * Decodes a fetch response for the oldest request in flight and
+	 * sends that group's next fetch.
+	 */
+	struct group *g = c->inflight[c->head];
+	unsigned u;
+
+	c->head = (c->head + 1) % c->ngroups;
+	c->count--;
+	fetches++;
+	histogram_record(&rtt, monotonic_us() - g->sent_us);
+
+	if (fetch_response_parse(c->reader.body->data, c->reader.body->len,
+			resp) == -1) {
+		fprintf(stderr, "malformed fetch response from broker %d\n",
+			c->broker->id);
+		return -1;
+	}
+	for (u = 0; u < resp->n; u++) {
+		fetch_partition_t *fp = &resp->partitions[u];
+		struct part *p = group_part(g, fp->partition);
+		uint8_t *ptr = fp->messages;
+		uint8_t *end = fp->messages + fp->messages_size;
+		fetch_message_t msg;
+		int rc;
+
+		if (!p)
+			continue;
+		if (fp->error != KAFKA_OK) {
+			fprintf(stderr, "partition %d: %s\n", p->partition,
+				kafka_status_string(fp->error));
+			errors++;
+			p->done = 1;
+			continue;
+		}
+		p->high_watermark = fp->high_watermark;
+		while ((rc = fetch_message_next(&ptr, end, &msg)) == 1) {
+			if (msg.offset < p->offset)
+				continue;
+			p->offset = msg.offset + 1;
+			messages++;
+		}
+		bytes += ptr - fp->messages;
+		if (rc == -1) {
+			fprintf(stderr, "partition %d: corrupt message at %lld\n",
+				p->partition, (long long)p->offset);
+			corrupt++;
+			p->done = 1;
+		} else if (ptr == fp->messages && fp->messages_size >= o.fetch_size) {
+			fprintf(stderr, "partition %d: message at %lld is larger "
+				"than the fetch size\n", p->partition,
+				(long long)p->offset);
+			errors++;
+			p->done = 1;
+		}
+	}
+	return send_fetch(c, g) == -1 ? -1 : 0;
+}
+
+static int
+consume(struct conn *conns, unsigned nconns)
+{
+	struct pollfd *pfds = calloc(nconns, sizeof *pfds);
+	fetch_response_t resp;
+	unsigned u, v, live;
+	int rc = 0;
+
+	fetch_response_init(&resp);
+	for (u = 0; u < nconns; u++)
+		for (v = 0; v < conns[u].ngroups && rc == 0; v++)
+			if (send_fetch(&conns[u], &conns[u].groups[v]) == -1)
+				rc = -1;
+	while (rc == 0) {
+		live = 0;
+		for (u = 0; u < nconns; u++) {
+			pfds[u].fd = conns[u].count ? conns[u].fd : -1;
+			pfds[u].events = POLLIN;
+			live += conns[u].count;
+		}
+		if (live == 0)
+			break;
+		switch (poll(pfds, nconns, 10000)) {
+		case -1:
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll: %s\n", strerror(errno));
+			rc = -1;
+			break;
+		case 0:
+			fprintf(stderr, "fetch timed out\n");
+			rc = -1;
+			break;
+		}
+		if (rc == -1)
+			break;
+		for (u = 0; u < nconns && rc == 0; u++) {
+			struct conn *c = &conns[u];
+			int r = 0;
+			if (!pfds[u].revents)
+				continue;
+			while (c->count && (r = frame_reader_read(&c->reader, c->fd)) == 1)
+				if (handle_response(c, &resp) == -1) {
+					rc = -1;
+					break;
+				}
+			if (r == -1) {
+				fprintf(stderr, "broker %d: %s\n", c->broker->id,
+					strerror(errno));
+				rc = -1;
+			}
+		}
+	}
+	fetch_response_destroy(&resp);
+	free(pfds);
+	return rc;
+}
+
+static struct metadata_response *
+fetch_metadata(const char *hostport)
+{
+	/* asks the first of "host:port,..." */
+	char host[256], *colon;
+	const char *topics[2];
+	struct metadata_response *md;
+	int fd;
+
+	snprintf(host, sizeof host, "%.*s", (int)strcspn(hostport, ","),
+		hostport);
+	colon = strrchr(host, ':');
+	if (!colon)
+		return NULL;
+	*colon = 0;
+	fd = broker_connect(host, atoi(colon + 1), 5000);
+	if (fd == -1)
+		return NULL;
+	topics[0] = o.topic;
+	topics[1] = NULL;
+	md = topic_metadata_request(fd, topics, 5000);
+	close(fd);
+	return md;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-b host:port,... | -m brokers] [options]\n"
+		"  -t topic        topic to read (test)\n"
+		"  -p partitions   read partitions 0 to n-1; 0 for all (0)\n"
+		"  -f bytes        fetch size, per partition (1048576)\n"
+		"  -d depth        fetch requests in flight per broker (1)\n"
+		"  -w ms           max wait of each fetch (100)\n"
+		"  -n messages     stop after this many, waiting for more if\n"
+		"                  need be; 0 to read up to the high watermarks (0)\n"
+		"  -M messages     messages in each mock partition (1000000)\n"
+		"  -s bytes        mock message size (100)\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct mock_cluster *cluster = NULL;
+	struct metadata_response *md;
+	topic_metadata_t *topic;
+	struct part *parts;
+	struct conn *conns;
+	unsigned nconns = 0, nparts, u, v;
+	int64_t start, elapsed, cpu;
+	double secs;
+	int c, rc;
+
+	o.topic = "test";
+	o.fetch_size = 1024 * 1024;
+	o.depth = 1;
+	o.max_wait_ms = 100;
+	o.mock_messages = 1000000;
+	o.mock_size = 100;
+	while ((c = getopt(argc, argv, "b:m:M:s:t:p:f:d:w:n:h")) != -1) {
+		switch (c) {
+		case 'b': o.broker = optarg; break;
+		case 'm': o.mock_brokers = atoi(optarg); break;
+		case 'M': o.mock_messages = atoll(optarg); break;
+		case 's': o.mock_size = atoi(optarg); break;
+		case 't': o.topic = optarg; break;
+		case 'p': o.partitions = atoi(optarg); break;
+		case 'f': o.fetch_size = atoi(optarg); break;
+		case 'd': o.depth = atoi(optarg); break;
+		case 'w': o.max_wait_ms = atoi(optarg); break;
+		case 'n': o.messages = atoll(optarg); break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+	if ((!o.broker && o.mock_brokers <= 0) || o.depth < 1 ||
+	    o.fetch_size < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (o.mock_brokers > 0) {
+		char topics[256];
+		snprintf(topics, sizeof topics, "%s:%d", o.topic,
+			o.partitions > 0 ? o.partitions : 8);
+		cluster = mock_cluster_new(o.mock_brokers, topics);
+		if (!cluster) {
+			fprintf(stderr, "cannot start mock brokers\n");
+			return 1;
+		}
+		mock_cluster_set_log(cluster, o.mock_messages, o.mock_size);
+		o.broker = mock_cluster_bootstrap(cluster);
+	}
+	md = fetch_metadata(o.broker);
+	topic = md ? map_get_string(md->metadata, o.topic, strlen(o.topic)) : NULL;
+	if (!topic || topic->error != KAFKA_OK || topic->num_partitions <= 0) {
+		fprintf(stderr, "no metadata for %s\n", o.topic);
+		return 1;
+	}
+	nparts = topic->num_partitions;
+	if (o.partitions > 0 && (unsigned)o.partitions < nparts)
+		nparts = o.partitions;
+
+	/* one connection per leader, its partitions dealt into depth groups */
+	parts = calloc(nparts, sizeof *parts);
+	conns = calloc(nparts, sizeof *conns);
+	for (u = 0; u < nparts; u++) {
+		partition_metadata_t *pm = map_get_int32(topic->partitions, u);
+		struct conn *conn = NULL;
+		struct group *g;
+		if (!pm || !pm->leader) {
+			fprintf(stderr, "partition %u has no leader\n", u);
+			return 1;
+		}
+		parts[u].partition = u;
+		parts[u].high_watermark = -1;
+		for (v = 0; v < nconns; v++)
+			if (conns[v].broker == pm->leader)
+				conn = &conns[v];
+		if (!conn) {
+			conn = &conns[nconns++];
+			conn->broker = pm->leader;
+			conn->fd = broker_connect(pm->leader->hostname,
+					pm->leader->port, 5000);
+			if (conn->fd == -1) {
+				fprintf(stderr, "cannot connect to %s:%d\n",
+					pm->leader->hostname, pm->leader->port);
+				return 1;
+			}
+			frame_reader_init(&conn->reader);
+			conn->groups = calloc(o.depth, sizeof *conn->groups);
+			conn->inflight = calloc(o.depth, sizeof *conn->inflight);
+			conn->ngroups = o.depth;
+		}
+		/* deal round robin, counting partitions already dealt */
+		for (v = 0, g = NULL; v < conn->ngroups; v++)
+			if (!g || conn->groups[v].n < g->n)
+				g = &conn->groups[v];
+		if (g->n == sizeof g->parts / sizeof *g->parts) {
+			fprintf(stderr, "too many partitions per fetch\n");
+			return 1;
+		}
+		g->parts[g->n++] = &parts[u];
+	}
+
+	start = monotonic_us();
+	cpu = cpu_us();
+	rc = consume(conns, nconns);
+	cpu = cpu_us() - cpu;
+	elapsed = monotonic_us() - start;
+
+	secs = elapsed / 1e6;
+	printf("%lld messages, %lld bytes from %u partitions in %.3f s\n",
+		(long long)messages, (long long)bytes, nparts, secs);
+	printf("%.0f msgs/s, %.2f MB/s\n", messages / secs,
+		bytes / secs / (1024 * 1024));
+	printf("%lld fetches, rtt us: p50 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+		(long long)fetches,
+		(unsigned long long)histogram_percentile(&rtt, 50),
+		(unsigned long long)histogram_percentile(&rtt, 99),
+		(unsigned long long)histogram_percentile(&rtt, 99.9),
+		(unsigned long long)histogram_percentile(&rtt, 100));
+	if (bytes > 0)
+		printf("%.2f cpu s/GB\n", cpu / 1e6 /
+			(bytes / (1024.0 * 1024 * 1024)));
+	if (corrupt || errors)
+		printf("%lld corrupt messages, %lld partition errors\n",
+			(long long)corrupt, (long long)errors);
+
+	for (u = 0; u < nconns; u++) {
+		close(conns[u].fd);
+		frame_reader_destroy(&conns[u].reader);
+		free(conns[u].groups);
+		free(conns[u].inflight);
+	}
+	free(conns);
+	free(parts);
+	mock_cluster_free(cluster);
+	return rc != 0 || corrupt || errors;
+}
@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kafka-private.h"
+#include "serialize.h"
+
+/**
+ * kafka-bench: times the hot paths of the producer in isolation and
+ * counts the allocations they make per message. Nothing here touches the
+ * network; routing runs against metadata parsed from a synthetic response.
+ */
+
+#define BENCH_MIN_NS   (200 * 1000 * 1000)	/* per case */
+#define BENCH_BROKERS  3
+#define BENCH_TOPICS   10
+#define BENCH_PARTS    1000			/* per topic */
+#define BENCH_MESSAGES 256			/* per serialize or route */
+
+static unsigned long allocs;
+static int counting;
+
+#ifdef __GLIBC__
+/**
+ * Counts every allocation made while counting is set, libkafka's
+ * included, by standing in for the libc allocator.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *
+malloc(size_t size)
+{
+	allocs += counting;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	allocs += counting;
+	return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	allocs += counting;
+	return __libc_realloc(ptr, size);
+}
+#define HAVE_ALLOC_COUNT 1
+#endif
+
+typedef void (*bench_fn)(void *arg);
+
+static int64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+run(const char *name, bench_fn fn, void *arg, size_t bytes, unsigned messages)
+{
+	/**
+	 * Doubles the iteration count until a run takes BENCH_MIN_NS, then
+	 * reports that run. bytes and messages are per call of fn.
+	 */
+	unsigned long i, n = 1;
+	int64_t elapsed;
+	double ns;
+
+	counting = 1;
+	allocs = 0;
+	fn(arg);
+	counting = 0;
+
+	for (;;) {
+		int64_t start = now_ns();
+		for (i = 0; i < n; i++)
+			fn(arg);
+		elapsed = now_ns() - start;
+		if (elapsed >= BENCH_MIN_NS)
+			break;
+		n *= 2;
+	}
+	ns = (double)elapsed / n;
+	printf("%-32s %12.0f ns/op", name, ns);
+	if (bytes)
+		printf(" %10.1f MB/s", bytes / ns * 1e9 / (1024 * 1024));
+	else
+		printf(" %15s", "");
+	if (messages)
+		printf(" %10.1f ns/msg", ns / messages);
+#ifdef HAVE_ALLOC_COUNT
+	if (messages)
+		printf(" %6.2f allocs/msg", (double)allocs / messages);
+	else
+		printf(" %6lu allocs/op", allocs);
+#endif
+	printf("\n");
+}
+
+/* crc32 */
+
+struct crc_case {
+	uint8_t *data;
+	size_t size;
+};
+
+static void
+bench_crc32(void *arg)
+{
+	struct crc_case *c = arg;
+	volatile uint32_t crc = crc32(0, c->data, c->size);
+	(void)crc;
+}
+
+/* message construction */
+
+struct message_case {
+	const char *value;
+};
+
+static void
+bench_message(void *arg)
+{
+	struct message_case *c = arg;
+	kafka_message_free(kafka_keyed_message_new("topic-0", "key", c->value));
+}
+
+/* serialization */
+
+struct serialize_case {
+	struct kafka_message *msgs[BENCH_MESSAGES];
+	struct msgvec vecs[4];
+	struct kafka_message sealed[4];	/* after serialize_case_seal() */
+	struct map *partitions;
+	struct map *topics;
+	KafkaBuffer *buffer;
+	size_t size;
+};
+
+static void
+serialize_case_init(struct serialize_case *c, const char *value)
+{
+	/**
+	 * One topic, four partitions, BENCH_MESSAGES keyed messages spread
+	 * evenly over them, as a single ProduceRequest would carry.
+	 */
+	unsigned u;
+	memset(c->sealed, 0, sizeof c->sealed);
+	c->topics = map_new_string(0, NULL, NULL);
+	c->partitions = map_new_int32(0, NULL);
+	map_set_string(c->topics, "topic-0", 7, c->partitions);
+	for (u = 0; u < 4; u++) {
+		msgvec_init(&c->vecs[u]);
+		map_set_int32(c->partitions, u, &c->vecs[u]);
+	}
+	for (u = 0; u < BENCH_MESSAGES; u++) {
+		c->msgs[u] = kafka_keyed_message_new("topic-0", "key", value);
+		c->msgs[u]->partition = u % 4;
+		msgvec_push_back(&c->vecs[u % 4], c->msgs[u]);
+	}
+	c->size = topics_and_partitions_packed_size(c->topics);
+	c->buffer = KafkaBufferNew(c->size);
+}
+
+static void
+serialize_case_seal(struct serialize_case *c)
+{
+	/* swaps each partition's messages for one set sealed from them */
+	unsigned u;
+	for (u = 0; u < 4; u++) {
+		struct kafka_message *m = &c->sealed[u];
+		uint8_t *data;
+		m->sealed_size = message_set_packed_size(&c->vecs[u]);
+		data = malloc(m->sealed_size);
+		serialize_message_set(&c->vecs[u], data);
+		m->sealed = data;
+		m->sealed_count = msgvec_size(&c->vecs[u]);
+		msgvec_clear(&c->vecs[u]);
+		msgvec_push_back(&c->vecs[u], m);
+	}
+}
+
+static void
+serialize_case_destroy(struct serialize_case *c)
+{
+	unsigned u;
+	KafkaBufferFree(c->buffer);
+	for (u = 0; u < 4; u++) {
+		msgvec_destroy(&c->vecs[u]);
+		free((uint8_t *)c->sealed[u].sealed);
+	}
+	for (u = 0; u < BENCH_MESSAGES; u++)
+		kafka_message_free(c->msgs[u]);
+	map_free(c->partitions);
+	map_free(c->topics);
+}
+
+static void
+bench_serialize(void *arg)
+{
+	struct serialize_case *c = arg;
+	c->buffer->cur = c->buffer->data;
+	serialize_topics_and_partitions(c->topics, c->buffer);
+	assert((size_t)(c->buffer->cur - c->buffer->data) == c->size);
+}
+
+/* metadata */
+
+struct metadata_case {
+	uint8_t *data;
+	size_t size;
+};
+
+static void
+metadata_case_init(struct metadata_case *c)
+{
+	/**
+	 * A MetadataResponse for BENCH_TOPICS topics of BENCH_PARTS
+	 * partitions each, led round robin by BENCH_BROKERS brokers with a
+	 * replication factor of three.
+	 */
+	int32_t b, t, part, r;
+	char name[32];
+	uint8_t *ptr;
+
+	c->data = malloc(64 * BENCH_BROKERS +
+			(32 + 42 * BENCH_PARTS) * BENCH_TOPICS + 8);
+	ptr = c->data;
+	ptr += uint32_pack(1, ptr);
+	ptr += uint32_pack(BENCH_BROKERS, ptr);
+	for (b = 0; b < BENCH_BROKERS; b++) {
+		ptr += uint32_pack(b, ptr);
+		ptr += string_pack("broker.example.com", ptr);
+		ptr += uint32_pack(9092, ptr);
+	}
+	ptr += uint32_pack(BENCH_TOPICS, ptr);
+	for (t = 0; t < BENCH_TOPICS; t++) {
+		snprintf(name, sizeof name, "topic-%d", t);
+		ptr += uint16_pack(0, ptr);
+		ptr += string_pack(name, ptr);
+		ptr += uint32_pack(BENCH_PARTS, ptr);
+		for (part = 0; part < BENCH_PARTS; part++) {
+			ptr += uint16_pack(0, ptr);
+			ptr += uint32_pack(part, ptr);
+			ptr += uint32_pack(part % BENCH_BROKERS, ptr);
+			ptr += uint32_pack(3, ptr);
+			for (r = 0; r < 3; r++)
+				ptr += uint32_pack((part + r) % BENCH_BROKERS, ptr);
+			ptr += uint32_pack(3, ptr);
+			for (r = 0; r < 3; r++)
+				ptr += uint32_pack((part + r) % BENCH_BROKERS, ptr);
+		}
+	}
+	c->size = ptr - c->data;
+}
+
+static producer_metadata_t *
+metadata_parse(struct metadata_case *c)
+{
+	struct metadata_response *resp;
+	producer_metadata_t *md;
+	resp = metadata_response_from_buffer(c->data, c->size);
+	md = calloc(1, sizeof *md);
+	md->refs = 1;
+	md->brokers = resp->brokers;
+	md->topics = resp->metadata;
+	free(resp);
+	return md;
+}
+
+static void
+bench_metadata(void *arg)
+{
+	producer_metadata_release(metadata_parse(arg));
+}
+
+/* routing */
+
+struct route_case {
+	producer_metadata_t *md;
+	struct kafka_message *msgs[BENCH_MESSAGES];
+	unsigned seed;
+};
+
+static void
+bench_route(void *arg)
+{
+	/**
+	 * What the sender does with a batch of unpartitioned messages: pick
+	 * a partition for each and file it under its leader.
+	 */
+	struct route_case *c = arg;
+	struct map *map;
+	unsigned u;
+
+	map = map_new_int32(map_size(c->md->brokers), NULL);
+	for (u = 0; u < BENCH_MESSAGES; u++) {
+		struct kafka_message *msg = c->msgs[u];
+		partition_metadata_t *pm;
+		msg->partition = -1;
+		pm = producer_pick_partition(c->md, msg, &c->seed);
+		msgvec_push_back(broker_message_slot(map, pm->leader->id, msg),
+			msg);
+	}
+	broker_message_map_free(map);
+}
+
+int main(void)
+{
+	static const size_t sizes[] = { 10, 100, 1000, 10000 };
+	struct metadata_case mc;
+	struct route_case rc;
+	char name[64];
+	unsigned u;
+
+	for (u = 0; u < sizeof sizes / sizeof *sizes; u++) {
+		struct crc_case c;
+		c.size = sizes[u];
+		c.data = malloc(c.size);
+		memset(c.data, 'x', c.size);
+		snprintf(name, sizeof name, "crc32 %zu bytes", c.size);
+		run(name, bench_crc32, &c, c.size, 0);
+		free(c.data);
+	}
+
+	for (u = 0; u < sizeof sizes / sizeof *sizes; u++) {
+		struct message_case c;
+		char *value = malloc(sizes[u] + 1);
+		memset(value, 'x', sizes[u]);
+		value[sizes[u]] = 0;
+		c.value = value;
+		snprintf(name, sizeof name, "message new/free %zu bytes", sizes[u]);
+		run(name, bench_message, &c, 0, 1);
+		free(value);
+	}
+
+	for (u = 0; u < sizeof sizes / sizeof *sizes; u++) {
+		struct serialize_case c;
+		char *value = malloc(sizes[u] + 1);
+		memset(value, 'x', sizes[u]);
+		value[sizes[u]] = 0;
+		serialize_case_init(&c, value);
+		snprintf(name, sizeof name, "serialize %zu bytes", sizes[u]);
+		run(name, bench_serialize, &c, c.size, BENCH_MESSAGES);
+		serialize_case_seal(&c);
+		snprintf(name, sizeof name, "serialize sealed %zu bytes", sizes[u]);
+		run(name, bench_serialize, &c, c.size, BENCH_MESSAGES);
+		serialize_case_destroy(&c);
+		free(value);
+	}
+
+	metadata_case_init(&mc);
+	snprintf(name, sizeof name, "metadata %d partitions",
+		BENCH_TOPICS * BENCH_PARTS);
+	run(name, bench_metadata, &mc, mc.size, 0);
+
+	rc.md = metadata_parse(&mc);
+	rc.seed = 1;
+	for (u = 0; u < BENCH_MESSAGES; u++)
+		rc.msgs[u] = kafka_message_new("topic-0", "value");
+	run("route", bench_route, &rc, 0, BENCH_MESSAGES);
+	for (u = 0; u < BENCH_MESSAGES; u++)
+		kafka_message_free(rc.msgs[u]);
+	producer_metadata_release(rc.md);
+	free(mc.data);
+	return 0;
+}
@@ -0,0 +1,833 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "mock_broker.h"
+
+#define MOCK_MAX_TOPICS    16
+#define MOCK_MAX_REQUEST   (64 * 1024 * 1024)
+
+#define MOCK_MAX_WAIT_MS   100	/* longest an empty fetch is held */
+
+#define API_PRODUCE   0
+#define API_FETCH     1
+#define API_METADATA  3
+
+#define ERR_OFFSET_OUT_OF_RANGE         1
+#define ERR_UNKNOWN_TOPIC_OR_PARTITION  3
+#define ERR_NOT_LEADER_FOR_PARTITION    6
+
+struct mock_topic {
+	char *name;
+	int32_t partitions;
+	int32_t *leaders;
+};
+
+struct mock_broker {
+	struct mock_cluster *cluster;
+	int32_t id;
+	int fd;
+	int port;
+	pthread_t thread;
+};
+
+struct mock_conn {
+	struct mock_broker *broker;
+	int fd;
+	pthread_t thread;
+	struct mock_conn *next;
+};
+
+struct mock_cluster {
+	pthread_mutex_t lock;
+	int stopping;
+	int nbrokers;
+	struct mock_broker *brokers;
+	int ntopics;
+	struct mock_topic topics[MOCK_MAX_TOPICS];
+	char *bootstrap;
+	struct mock_conn *conns;
+
+	/* knobs */
+	int latency_ms;
+	int fail_every;
+	int16_t fail_error;
+	int drop_every;
+	size_t chunk;
+
+	/* the log every partition serves fetches from */
+	int64_t log_messages;
+	uint8_t *log_message;	/* the message at every offset, offset aside */
+	size_t log_message_len;
+
+	/* counters */
+	uint64_t messages;
+	uint64_t requests;
+	uint64_t bad_crcs;
+	uint64_t connections;
+};
+
+/* response buffer */
+struct out {
+	uint8_t *data;
+	size_t len;
+	size_t cap;
+};
+
+static void
+out_put(struct out *o, const void *p, size_t n)
+{
+	if (o->len + n > o->cap) {
+		o->cap = (o->len + n) * 2;
+		o->data = realloc(o->data, o->cap);
+	}
+	memcpy(o->data + o->len, p, n);
+	o->len += n;
+}
+
+static void
+out_16(struct out *o, int16_t v)
+{
+	uint16_t n = htons((uint16_t)v);
+	out_put(o, &n, 2);
+}
+
+static void
+out_32(struct out *o, int32_t v)
+{
+	uint32_t n = htonl((uint32_t)v);
+	out_put(o, &n, 4);
+}
+
+static void
+out_64(struct out *o, int64_t v)
+{
+	out_32(o, (int32_t)(v >> 32));
+	out_32(o, (int32_t)v);
+}
+
+static void
+out_str(struct out *o, const char *s, size_t len)
+{
+	out_16(o, len);
+	out_put(o, s, len);
+}
+
+/* request parser; any overrun sets bad and yields zeroes */
+struct in {
+	const uint8_t *p;
+	const uint8_t *end;
+	int bad;
+};
+
+static const uint8_t *
+in_take(struct in *in, size_t n)
+{
+	const uint8_t *p = in->p;
+	if (in->bad || (size_t)(in->end - in->p) < n) {
+		in->bad = 1;
+		return NULL;
+	}
+	in->p += n;
+	return p;
+}
+
+static int16_t
+in_16(struct in *in)
+{
+	const uint8_t *p = in_take(in, 2);
+	return p ? (int16_t)((p[0] << 8) | p[1]) : 0;
+}
+
+static int32_t
+in_32(struct in *in)
+{
+	const uint8_t *p = in_take(in, 4);
+	if (!p)
+		return 0;
+	return (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | p[3]);
+}
+
+static int64_t
+in_64(struct in *in)
+{
+	int64_t hi = (uint32_t)in_32(in);
+	return (int64_t)((uint64_t)hi << 32 | (uint32_t)in_32(in));
+}
+
+static const char *
+in_str(struct in *in, size_t *len)
+{
+	int16_t n = in_16(in);
+	*len = n > 0 ? n : 0;
+	return (const char *)in_take(in, *len);
+}
+
+static uint32_t
+crc32_of(const uint8_t *p, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+	size_t i;
+	int k;
+	for (i = 0; i < len; i++) {
+		crc ^= p[i];
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static struct mock_topic *
+find_topic(struct mock_cluster *c, const char *name, size_t len)
+{
+	int i;
+	for (i = 0; i < c->ntopics; i++) {
+		if (strlen(c->topics[i].name) == len &&
+		    memcmp(c->topics[i].name, name, len) == 0)
+			return &c->topics[i];
+	}
+	return NULL;
+}
+
+static int
+read_full(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t rc = read(fd, (char *)buf + done, len - done);
+		if (rc == -1 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return -1;
+		done += rc;
+	}
+	return 0;
+}
+
+static int
+send_response(struct mock_cluster *c, int fd, struct out *body)
+{
+	/**
+	 * Writes the size prefix and body, chunk bytes at a time with a
+	 * pause in between if the cluster is set up for short reads.
+	 */
+	size_t chunk, done = 0;
+	uint32_t size = htonl(body->len);
+	struct out o = {NULL, 0, 0};
+	int rc = 0;
+
+	out_put(&o, &size, 4);
+	out_put(&o, body->data, body->len);
+	pthread_mutex_lock(&c->lock);
+	chunk = c->chunk;
+	pthread_mutex_unlock(&c->lock);
+	if (chunk == 0)
+		chunk = o.len;
+	while (done < o.len) {
+		size_t n = o.len - done < chunk ? o.len - done : chunk;
+		ssize_t w = send(fd, o.data + done, n, MSG_NOSIGNAL);
+		if (w == -1 && errno == EINTR)
+			continue;
+		if (w <= 0) {
+			rc = -1;
+			break;
+		}
+		done += w;
+		if (done < o.len && chunk < o.len)
+			usleep(100);
+	}
+	free(o.data);
+	return rc;
+}
+
+static void
+handle_metadata(struct mock_broker *b, struct in *in, struct out *o)
+{
+	struct mock_cluster *c = b->cluster;
+	int32_t i, n, p;
+
+	n = in_32(in);
+	pthread_mutex_lock(&c->lock);
+	out_32(o, c->nbrokers);
+	for (i = 0; i < c->nbrokers; i++) {
+		out_32(o, c->brokers[i].id);
+		out_str(o, "127.0.0.1", 9);
+		out_32(o, c->brokers[i].port);
+	}
+	if (n <= 0) {
+		out_32(o, c->ntopics);
+		for (i = 0; i < c->ntopics; i++) {
+			struct mock_topic *t = &c->topics[i];
+			out_16(o, 0);
+			out_str(o, t->name, strlen(t->name));
+			out_32(o, t->partitions);
+			for (p = 0; p < t->partitions; p++) {
+				out_16(o, 0);
+				out_32(o, p);
+				out_32(o, t->leaders[p]);
+				out_32(o, 1);	/* replicas */
+				out_32(o, t->leaders[p]);
+				out_32(o, 1);	/* isr */
+				out_32(o, t->leaders[p]);
+			}
+		}
+	} else {
+		out_32(o, n);
+		for (i = 0; i < n; i++) {
+			size_t len;
+			const char *name = in_str(in, &len);
+			struct mock_topic *t = name ? find_topic(c, name, len) : NULL;
+			if (!t) {
+				out_16(o, ERR_UNKNOWN_TOPIC_OR_PARTITION);
+				out_str(o, name ? name : "", name ? len : 0);
+				out_32(o, 0);
+				continue;
+			}
+			out_16(o, 0);
+			out_str(o, t->name, strlen(t->name));
+			out_32(o, t->partitions);
+			for (p = 0; p < t->partitions; p++) {
+				out_16(o, 0);
+				out_32(o, p);
+				out_32(o, t->leaders[p]);
+				out_32(o, 1);
+				out_32(o, t->leaders[p]);
+				out_32(o, 1);
+				out_32(o, t->leaders[p]);
+			}
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+static int
+handle_produce(struct mock_broker *b, struct in *in, struct out *o)
+{
+	/**
+	 * Checks every message's CRC and accepts the partitions this broker
+	 * leads. Returns 0 if no response should be sent: the request did
+	 * not ask for one, or it is one the cluster was told to drop.
+	 */
+	struct mock_cluster *c = b->cluster;
+	int16_t acks;
+	int32_t i, j, ntopics, nparts;
+	uint64_t reqno;
+	int latency, fail_every, drop_every, respond;
+	int16_t fail_error;
+
+	pthread_mutex_lock(&c->lock);
+	reqno = ++c->requests;
+	latency = c->latency_ms;
+	fail_every = c->fail_every;
+	fail_error = c->fail_error;
+	drop_every = c->drop_every;
+	pthread_mutex_unlock(&c->lock);
+	if (latency > 0)
+		usleep(latency * 1000);
+
+	acks = in_16(in);
+	in_32(in);	/* timeout */
+	respond = acks != 0 && !(drop_every && reqno % drop_every == 0);
+	ntopics = in_32(in);
+	out_32(o, ntopics);
+	for (i = 0; i < ntopics && !in->bad; i++) {
+		size_t len;
+		const char *name = in_str(in, &len);
+		struct mock_topic *t;
+		out_str(o, name ? name : "", name ? len : 0);
+		nparts = in_32(in);
+		out_32(o, nparts);
+		for (j = 0; j < nparts && !in->bad; j++) {
+			int32_t partition = in_32(in);
+			int32_t size = in_32(in);
+			struct in set;
+			uint64_t count = 0, bad = 0;
+			int16_t error = 0;
+
+			set.p = in_take(in, size > 0 ? size : 0);
+			set.end = set.p ? set.p + size : NULL;
+			set.bad = set.p == NULL;
+			while (!set.bad && set.p < set.end) {
+				const uint8_t *msg;
+				int32_t msize;
+				in_take(&set, 8);	/* offset */
+				msize = in_32(&set);
+				if (msize < 4)
+					break;
+				msg = in_take(&set, msize);
+				if (!msg)
+					break;
+				if (crc32_of(msg + 4, msize - 4) != (uint32_t)(
+					(msg[0] << 24) | (msg[1] << 16) | (msg[2] << 8) | msg[3]))
+					bad++;
+				count++;
+			}
+
+			pthread_mutex_lock(&c->lock);
+			t = name ? find_topic(c, name, len) : NULL;
+			if (!t || partition < 0 || partition >= t->partitions)
+				error = ERR_UNKNOWN_TOPIC_OR_PARTITION;
+			else if (t->leaders[partition] != b->id)
+				error = ERR_NOT_LEADER_FOR_PARTITION;
+			else if (fail_every && reqno % fail_every == 0)
+				error = fail_error;
+			else if (respond || acks == 0)
+				c->messages += count;
+			c->bad_crcs += bad;
+			pthread_mutex_unlock(&c->lock);
+
+			out_32(o, partition);
+			out_16(o, error);
+			out_64(o, 0);
+		}
+	}
+	return respond;
+}
+
+static void
+handle_fetch(struct mock_broker *b, struct in *in, struct out *o)
+{
+	/**
+	 * Serves from the log set up with mock_cluster_set_log(), cutting
+	 * each message set at the partition's max bytes the way a broker
+	 * does, partial last message and all. A fetch that finds nothing is
+	 * held for its max wait, up to MOCK_MAX_WAIT_MS.
+	 */
+	struct mock_cluster *c = b->cluster;
+	int32_t i, j, ntopics, nparts, max_wait;
+	int latency;
+	int64_t served = 0;
+
+	in_32(in);	/* replica id */
+	max_wait = in_32(in);
+	in_32(in);	/* min bytes */
+	pthread_mutex_lock(&c->lock);
+	latency = c->latency_ms;
+	pthread_mutex_unlock(&c->lock);
+	if (latency > 0)
+		usleep(latency * 1000);
+
+	ntopics = in_32(in);
+	out_32(o, ntopics);
+	for (i = 0; i < ntopics && !in->bad; i++) {
+		size_t len;
+		const char *name = in_str(in, &len);
+		struct mock_topic *t;
+		out_str(o, name ? name : "", name ? len : 0);
+		nparts = in_32(in);
+		out_32(o, nparts);
+		for (j = 0; j < nparts && !in->bad; j++) {
+			int32_t partition = in_32(in);
+			int64_t offset = in_64(in);
+			int32_t max_bytes = in_32(in);
+			int16_t error = 0;
+			size_t mlen = c->log_message_len;
+			size_t bytes, left;
+
+			pthread_mutex_lock(&c->lock);
+			t = name ? find_topic(c, name, len) : NULL;
+			if (!t || partition < 0 || partition >= t->partitions)
+				error = ERR_UNKNOWN_TOPIC_OR_PARTITION;
+			else if (t->leaders[partition] != b->id)
+				error = ERR_NOT_LEADER_FOR_PARTITION;
+			else if (offset < 0 || offset > c->log_messages)
+				error = ERR_OFFSET_OUT_OF_RANGE;
+			pthread_mutex_unlock(&c->lock);
+
+			out_32(o, partition);
+			out_16(o, error);
+			out_64(o, error ? -1 : c->log_messages);
+			if (error || mlen == 0 || max_bytes <= 0) {
+				out_32(o, 0);
+				continue;
+			}
+			bytes = (c->log_messages - offset) * mlen;
+			if (bytes > (size_t)max_bytes)
+				bytes = max_bytes;
+			out_32(o, bytes);
+			for (left = bytes; left > 0; offset++) {
+				size_t n = left < mlen ? left : mlen;
+				uint32_t off[2];
+				off[0] = htonl((uint32_t)(offset >> 32));
+				off[1] = htonl((uint32_t)offset);
+				out_put(o, off, n < 8 ? n : 8);
+				if (n > 8)
+					out_put(o, c->log_message + 8, n - 8);
+				left -= n;
+			}
+			served += bytes;
+		}
+	}
+	if (!served && max_wait > 0)
+		usleep((max_wait < MOCK_MAX_WAIT_MS ? max_wait :
+			MOCK_MAX_WAIT_MS) * 1000);
+}
+
+static void *
+conn_main(void *arg)
+{
+	struct mock_conn *conn = arg;
+	struct mock_cluster *c = conn->broker->cluster;
+	uint8_t *buf = NULL;
+
+	for (;;) {
+		uint32_t size;
+		struct in in;
+		struct out o = {NULL, 0, 0};
+		int16_t api;
+		int32_t corr;
+		size_t len;
+		int respond = 1;
+
+		if (read_full(conn->fd, &size, 4) == -1)
+			break;
+		size = ntohl(size);
+		if (size > MOCK_MAX_REQUEST)
+			break;
+		buf = realloc(buf, size ? size : 1);
+		if (read_full(conn->fd, buf, size) == -1)
+			break;
+		in.p = buf;
+		in.end = buf + size;
+		in.bad = 0;
+		api = in_16(&in);
+		in_16(&in);	/* version */
+		corr = in_32(&in);
+		in_str(&in, &len);	/* client id */
+
+		out_32(&o, corr);
+		if (api == API_METADATA)
+			handle_metadata(conn->broker, &in, &o);
+		else if (api == API_PRODUCE)
+			respond = handle_produce(conn->broker, &in, &o);
+		else if (api == API_FETCH)
+			handle_fetch(conn->broker, &in, &o);
+		else
+			in.bad = 1;
+		if (!in.bad && respond && send_response(c, conn->fd, &o) == -1)
+			in.bad = 1;
+		free(o.data);
+		if (in.bad)
+			break;
+	}
+	free(buf);
+	shutdown(conn->fd, SHUT_RDWR);
+	return NULL;
+}
+
+static void *
+broker_main(void *arg)
+{
+	struct mock_broker *b = arg;
+	struct mock_cluster *c = b->cluster;
+	for (;;) {
+		int one = 1;
+		struct mock_conn *conn;
+		int fd = accept(b->fd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+		conn = calloc(1, sizeof *conn);
+		conn->broker = b;
+		conn->fd = fd;
+		pthread_mutex_lock(&c->lock);
+		if (c->stopping ||
+		    pthread_create(&conn->thread, NULL, conn_main, conn) != 0) {
+			pthread_mutex_unlock(&c->lock);
+			close(fd);
+			free(conn);
+			continue;
+		}
+		conn->next = c->conns;
+		c->conns = conn;
+		c->connections++;
+		pthread_mutex_unlock(&c->lock);
+	}
+	return NULL;
+}
+
+static int
+parse_topics(struct mock_cluster *c, const char *spec)
+{
+	/* "name:partitions,..." */
+	char *copy, *entry, *save = NULL;
+	copy = strdup(spec);
+	for (entry = strtok_r(copy, ",", &save); entry;
+	     entry = strtok_r(NULL, ",", &save)) {
+		struct mock_topic *t;
+		char *colon = strchr(entry, ':');
+		int32_t p;
+		if (!colon || c->ntopics == MOCK_MAX_TOPICS) {
+			free(copy);
+			return -1;
+		}
+		*colon = 0;
+		t = &c->topics[c->ntopics++];
+		t->name = strdup(entry);
+		t->partitions = atoi(colon + 1);
+		if (t->partitions <= 0)
+			t->partitions = 1;
+		t->leaders = calloc(t->partitions, sizeof *t->leaders);
+		for (p = 0; p < t->partitions; p++)
+			t->leaders[p] = p % c->nbrokers;
+	}
+	free(copy);
+	return 0;
+}
+
+struct mock_cluster *
+mock_cluster_new(int brokers, const char *topics)
+{
+	/**
+	 * Starts brokers fake brokers, with ids from 0, serving topics given
+	 * as "name:partitions,...". Returns NULL if they cannot listen.
+	 */
+	struct mock_cluster *c;
+	int i;
+	size_t len = 0;
+
+	if (brokers <= 0)
+		return NULL;
+	c = calloc(1, sizeof *c);
+	pthread_mutex_init(&c->lock, NULL);
+	c->nbrokers = brokers;
+	c->brokers = calloc(brokers, sizeof *c->brokers);
+	if (parse_topics(c, topics ? topics : "test:4") == -1) {
+		mock_cluster_free(c);
+		return NULL;
+	}
+	c->bootstrap = calloc(brokers, 24);
+	for (i = 0; i < brokers; i++) {
+		struct mock_broker *b = &c->brokers[i];
+		struct sockaddr_in addr;
+		socklen_t alen = sizeof addr;
+		int one = 1;
+
+		b->cluster = c;
+		b->id = i;
+		b->fd = socket(AF_INET, SOCK_STREAM, 0);
+		setsockopt(b->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+		memset(&addr, 0, sizeof addr);
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(b->fd, (struct sockaddr *)&addr, sizeof addr) == -1 ||
+		    listen(b->fd, 128) == -1 ||
+		    getsockname(b->fd, (struct sockaddr *)&addr, &alen) == -1 ||
+		    pthread_create(&b->thread, NULL, broker_main, b) != 0) {
+			close(b->fd);
+			b->fd = -1;
+			mock_cluster_free(c);
+			return NULL;
+		}
+		b->port = ntohs(addr.sin_port);
+		len += sprintf(c->bootstrap + len, "%s127.0.0.1:%d",
+				i ? "," : "", b->port);
+	}
+	return c;
+}
+
+void
+mock_cluster_free(struct mock_cluster *c)
+{
+	int i;
+	struct mock_conn *conn, *next;
+
+	if (!c)
+		return;
+	pthread_mutex_lock(&c->lock);
+	c->stopping = 1;
+	pthread_mutex_unlock(&c->lock);
+	for (i = 0; i < c->nbrokers; i++) {
+		struct mock_broker *b = &c->brokers[i];
+		if (!b->cluster || b->fd == -1)
+			continue;
+		shutdown(b->fd, SHUT_RDWR);
+		pthread_join(b->thread, NULL);
+		close(b->fd);
+	}
+	/* nothing adds connections any more */
+	for (conn = c->conns; conn; conn = next) {
+		next = conn->next;
+		shutdown(conn->fd, SHUT_RDWR);
+		pthread_join(conn->thread, NULL);
+		close(conn->fd);
+		free(conn);
+	}
+	for (i = 0; i < c->ntopics; i++) {
+		free(c->topics[i].name);
+		free(c->topics[i].leaders);
+	}
+	free(c->brokers);
+	free(c->bootstrap);
+	free(c->log_message);
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+const char *
+mock_cluster_bootstrap(struct mock_cluster *c)
+{
+	/* the brokers as "host:port,...", for kafka_producer_config.brokers */
+	return c->bootstrap;
+}
+
+void
+mock_cluster_set_log(struct mock_cluster *c, int64_t messages, size_t size)
+{
+	/**
+	 * Gives every partition a log of messages unkeyed messages with
+	 * values of size bytes, at offsets from 0. Without one, partitions
+	 * are empty.
+	 */
+	struct out m = {NULL, 0, 0};
+	uint8_t *value = malloc(size ? size : 1);
+	uint32_t crc;
+
+	memset(value, 'x', size);
+	out_64(&m, 0);		/* offset, filled in per fetch */
+	out_32(&m, 14 + size);
+	out_32(&m, 0);		/* crc */
+	out_put(&m, "\0\0", 2);	/* magic, attributes */
+	out_32(&m, -1);		/* null key */
+	out_32(&m, size);
+	out_put(&m, value, size);
+	free(value);
+	crc = htonl(crc32_of(m.data + 16, m.len - 16));
+	memcpy(m.data + 12, &crc, 4);
+
+	free(c->log_message);
+	c->log_message = m.data;
+	c->log_message_len = m.len;
+	c->log_messages = messages;
+}
+
+void
+mock_cluster_set_latency(struct mock_cluster *c, int ms)
+{
+	/* delay before answering each produce or fetch request */
+	pthread_mutex_lock(&c->lock);
+	c->latency_ms = ms;
+	pthread_mutex_unlock(&c->lock);
+}
+
+void
+mock_cluster_fail_every(struct mock_cluster *c, int n, int16_t error)
+{
+	/* every nth produce request fails with error; 0 for never */
+	pthread_mutex_lock(&c->lock);
+	c->fail_every = n;
+	c->fail_error = error;
+	pthread_mutex_unlock(&c->lock);
+}
+
+void
+mock_cluster_drop_every(struct mock_cluster *c, int n)
+{
+	/**
+	 * Every nth produce request is thrown away unanswered, so the
+	 * client times out; 0 for never.
+	 */
+	pthread_mutex_lock(&c->lock);
+	c->drop_every = n;
+	pthread_mutex_unlock(&c->lock);
+}
+
+void
+mock_cluster_set_chunk(struct mock_cluster *c, size_t bytes)
+{
+	/* responses go out bytes at a time, forcing short reads; 0 for off */
+	pthread_mutex_lock(&c->lock);
+	c->chunk = bytes;
+	pthread_mutex_unlock(&c->lock);
+}
+
+int
+mock_cluster_set_leader(struct mock_cluster *c, const char *topic,
+	int32_t partition, int32_t broker)
+{
+	/* moves a partition's leadership, returns -1 if there is no such thing */
+	struct mock_topic *t;
+	int rc = -1;
+	pthread_mutex_lock(&c->lock);
+	t = find_topic(c, topic, strlen(topic));
+	if (t && partition >= 0 && partition < t->partitions &&
+	    broker >= 0 && broker < c->nbrokers) {
+		t->leaders[partition] = broker;
+		rc = 0;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return rc;
+}
+
+static uint64_t
+counter(struct mock_cluster *c, uint64_t *value)
+{
+	uint64_t v;
+	pthread_mutex_lock(&c->lock);
+	v = *value;
+	pthread_mutex_unlock(&c->lock);
+	return v;
+}
+
+uint64_t
+mock_cluster_messages(struct mock_cluster *c)
+{
+	/* messages accepted by a partition leader */
+	return counter(c, &c->messages);
+}
+
+uint64_t
+mock_cluster_requests(struct mock_cluster *c)
+{
+	/* produce requests */
+	return counter(c, &c->requests);
+}
+
+uint64_t
+mock_cluster_bad_crcs(struct mock_cluster *c)
+{
+	return counter(c, &c->bad_crcs);
+}
+
+uint64_t
+mock_cluster_connections(struct mock_cluster *c)
+{
+	return counter(c, &c->connections);
+}
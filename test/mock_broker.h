@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MOCK_BROKER_H_
+#define _MOCK_BROKER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * In-process stand-in for a Kafka 0.8 cluster, for tests and benchmarks
+ * that should not need ZooKeeper or real brokers. Each fake broker
+ * listens on an ephemeral port on 127.0.0.1 and answers Metadata,
+ * Produce and Fetch requests, see docs/kafka_wire_format.org. Partition p of a
+ * topic is led by broker p % brokers until mock_cluster_set_leader()
+ * moves it, and a broker that does not lead a partition answers
+ * NOT_LEADER_FOR_PARTITION for it, as a real one would. Fetches are
+ * served from a log generated up front by mock_cluster_set_log(), which
+ * must be called before any client connects; what is produced is
+ * counted, not stored.
+ *
+ * All the knobs below it may be turned while clients are connected.
+ */
+struct mock_cluster;
+
+struct mock_cluster *mock_cluster_new(int brokers, const char *topics);
+void mock_cluster_free(struct mock_cluster *c);
+const char *mock_cluster_bootstrap(struct mock_cluster *c);
+void mock_cluster_set_log(struct mock_cluster *c, int64_t messages,
+			size_t size);
+
+void mock_cluster_set_latency(struct mock_cluster *c, int ms);
+void mock_cluster_fail_every(struct mock_cluster *c, int n, int16_t error);
+void mock_cluster_drop_every(struct mock_cluster *c, int n);
+void mock_cluster_set_chunk(struct mock_cluster *c, size_t bytes);
+int mock_cluster_set_leader(struct mock_cluster *c, const char *topic,
+			int32_t partition, int32_t broker);
+
+uint64_t mock_cluster_messages(struct mock_cluster *c);
+uint64_t mock_cluster_requests(struct mock_cluster *c);
+uint64_t mock_cluster_bad_crcs(struct mock_cluster *c);
+uint64_t mock_cluster_connections(struct mock_cluster *c);
+
+#endif
@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <kafka.h>
+
+#include "mock_broker.h"
+
+/**
+ * kafka-producer-perf: drives a producer from any number of threads and
+ * reports throughput and latency. Runs against real brokers (-b or -z)
+ * or an in-process mock cluster (-m).
+ */
+
+struct options {
+	const char *brokers;
+	const char *zookeeper;
+	int mock_brokers;
+	int mock_latency_ms;
+	const char *topic;
+	int partitions;		/* of the mock topic */
+	long messages;
+	int size;
+	int keys;		/* distinct keys, 0 for none */
+	int threads;
+	int acks;
+	int batch;		/* messages per send, 1 for kafka_producer_send */
+	const char *wal;	/* write-ahead log file, NULL for none */
+};
+
+struct worker {
+	pthread_t thread;
+	struct kafka_producer *p;
+	const struct options *o;
+	const char *value;
+	long messages;
+	long sends;
+	long failed;
+	uint64_t *latencies;	/* of each send, us */
+	unsigned seed;
+};
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct kafka_message *
+message_new(struct worker *w)
+{
+	char key[16];
+	if (w->o->keys <= 0)
+		return kafka_message_new(w->o->topic, w->value);
+	snprintf(key, sizeof key, "key-%d", rand_r(&w->seed) % w->o->keys);
+	return kafka_keyed_message_new(w->o->topic, key, w->value);
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+	long sent = 0;
+
+	while (sent < w->messages) {
+		uint64_t start;
+		int rc;
+		if (w->o->batch <= 1) {
+			struct kafka_message *msg = message_new(w);
+			start = now_us();
+			rc = kafka_producer_send(w->p, msg, w->o->acks);
+			w->latencies[w->sends++] = now_us() - start;
+			kafka_message_free(msg);
+			sent++;
+			if (rc != KAFKA_OK)
+				w->failed++;
+		} else {
+			struct kafka_message_set *set = kafka_message_set_new();
+			long n = 0;
+			while (n < w->o->batch && sent + n < w->messages) {
+				kafka_message_set_append(set, message_new(w));
+				n++;
+			}
+			start = now_us();
+			rc = kafka_producer_send_batch(w->p, set, w->o->acks);
+			w->latencies[w->sends++] = now_us() - start;
+			kafka_message_set_free(set);
+			sent += n;
+			if (rc != KAFKA_OK)
+				w->failed += n;
+		}
+	}
+	return NULL;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t
+percentile(const uint64_t *sorted, long n, double pct)
+{
+	long i;
+	if (n == 0)
+		return 0;
+	i = (long)(pct / 100 * n + 0.5);
+	if (i < 1)
+		i = 1;
+	if (i > n)
+		i = n;
+	return sorted[i - 1];
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-b host:port,... | -z zookeeper | -m brokers] [options]\n"
+		"  -t topic        topic to send to (test)\n"
+		"  -p partitions   partitions of the mock topic (8)\n"
+		"  -L ms           mock broker latency (0)\n"
+		"  -n messages     messages to send in total (100000)\n"
+		"  -s bytes        message size (100)\n"
+		"  -k keys         distinct keys, picked at random; 0 for none (0)\n"
+		"  -T threads      sending threads (1)\n"
+		"  -a acks         0, 1 or -1 (1)\n"
+		"  -B batch        messages per kafka_producer_send_batch, 1 for\n"
+		"                  kafka_producer_send (1)\n"
+		"  -W file         log every message to a write-ahead log first\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct options o;
+	struct kafka_producer_config config;
+	struct kafka_producer *p;
+	struct mock_cluster *cluster = NULL;
+	struct worker *workers;
+	uint64_t *all, start, elapsed;
+	long sends = 0, failed = 0, i;
+	char *value;
+	double secs;
+	int c, t;
+
+	memset(&o, 0, sizeof o);
+	o.topic = "test";
+	o.partitions = 8;
+	o.messages = 100000;
+	o.size = 100;
+	o.threads = 1;
+	o.acks = KAFKA_REQUEST_SYNC;
+	o.batch = 1;
+	while ((c = getopt(argc, argv, "b:z:m:L:t:p:n:s:k:T:a:B:W:h")) != -1) {
+		switch (c) {
+		case 'b': o.brokers = optarg; break;
+		case 'z': o.zookeeper = optarg; break;
+		case 'm': o.mock_brokers = atoi(optarg); break;
+		case 'L': o.mock_latency_ms = atoi(optarg); break;
+		case 't': o.topic = optarg; break;
+		case 'p': o.partitions = atoi(optarg); break;
+		case 'n': o.messages = atol(optarg); break;
+		case 's': o.size = atoi(optarg); break;
+		case 'k': o.keys = atoi(optarg); break;
+		case 'T': o.threads = atoi(optarg); break;
+		case 'a': o.acks = atoi(optarg); break;
+		case 'B': o.batch = atoi(optarg); break;
+		case 'W': o.wal = optarg; break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+	if (o.threads < 1 || o.messages < 1 || o.size < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	kafka_producer_config_init(&config);
+	if (o.mock_brokers > 0) {
+		char topics[256];
+		snprintf(topics, sizeof topics, "%s:%d", o.topic, o.partitions);
+		cluster = mock_cluster_new(o.mock_brokers, topics);
+		if (!cluster) {
+			fprintf(stderr, "cannot start mock brokers\n");
+			return 1;
+		}
+		mock_cluster_set_latency(cluster, o.mock_latency_ms);
+		config.brokers = mock_cluster_bootstrap(cluster);
+	} else {
+		config.brokers = o.brokers;
+		config.zookeeper = o.zookeeper;
+	}
+	config.wal_path = o.wal;
+	p = kafka_producer_new_with_config(&config);
+	if (kafka_producer_status(p) != KAFKA_OK) {
+		fprintf(stderr, "%s\n", kafka_status_string(kafka_producer_status(p)));
+		return 1;
+	}
+
+	value = malloc(o.size + 1);
+	memset(value, 'x', o.size);
+	value[o.size] = 0;
+	workers = calloc(o.threads, sizeof *workers);
+	for (t = 0; t < o.threads; t++) {
+		struct worker *w = &workers[t];
+		w->p = p;
+		w->o = &o;
+		w->value = value;
+		w->messages = o.messages / o.threads +
+			(t < o.messages % o.threads);
+		w->latencies = malloc((w->messages + 1) * sizeof *w->latencies);
+		w->seed = t + 1;
+	}
+
+	start = now_us();
+	for (t = 0; t < o.threads; t++)
+		pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]);
+	for (t = 0; t < o.threads; t++)
+		pthread_join(workers[t].thread, NULL);
+	elapsed = now_us() - start;
+
+	for (t = 0; t < o.threads; t++) {
+		sends += workers[t].sends;
+		failed += workers[t].failed;
+	}
+	all = malloc((sends + 1) * sizeof *all);
+	for (i = 0, t = 0; t < o.threads; t++) {
+		memcpy(all + i, workers[t].latencies,
+			workers[t].sends * sizeof *all);
+		i += workers[t].sends;
+		free(workers[t].latencies);
+	}
+	qsort(all, sends, sizeof *all, cmp_u64);
+
+	secs = elapsed / 1e6;
+	printf("%ld messages of %d bytes in %.3f s, %ld failed\n",
+		o.messages, o.size, secs, failed);
+	printf("%.0f msgs/s, %.2f MB/s\n", o.messages / secs,
+		o.messages * (double)o.size / secs / (1024 * 1024));
+	printf("send latency us: p50 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+		(unsigned long long)percentile(all, sends, 50),
+		(unsigned long long)percentile(all, sends, 99),
+		(unsigned long long)percentile(all, sends, 99.9),
+		(unsigned long long)(sends ? all[sends - 1] : 0));
+	printf("request rtt us: p50 %llu, p99 %llu, p99.9 %llu\n",
+		(unsigned long long)kafka_producer_percentile(p, KAFKA_HISTOGRAM_RTT, 50),
+		(unsigned long long)kafka_producer_percentile(p, KAFKA_HISTOGRAM_RTT, 99),
+		(unsigned long long)kafka_producer_percentile(p, KAFKA_HISTOGRAM_RTT, 99.9));
+	printf("messages per request: p50 %llu, max %llu\n",
+		(unsigned long long)kafka_producer_percentile(p,
+			KAFKA_HISTOGRAM_BATCH_SIZE, 50),
+		(unsigned long long)kafka_producer_percentile(p,
+			KAFKA_HISTOGRAM_BATCH_SIZE, 100));
+
+	free(all);
+	free(workers);
+	free(value);
+	kafka_producer_free(p);
+	mock_cluster_free(cluster);
+	return failed != 0;
+}
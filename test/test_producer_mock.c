@@ -0,0 +1,397 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <kafka.h>
+
+#include "mock_broker.h"
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+		return -1; \
+	} \
+} while (0)
+
+static struct kafka_producer *
+producer_new(struct mock_cluster *c, int socket_timeout_ms)
+{
+	struct kafka_producer_config config;
+	kafka_producer_config_init(&config);
+	config.brokers = mock_cluster_bootstrap(c);
+	config.socket_timeout_ms = socket_timeout_ms;
+	config.retry_backoff_ms = 10;
+	config.retry_backoff_max_ms = 50;
+	return kafka_producer_new_with_config(&config);
+}
+
+static int
+send_messages(struct kafka_producer *p, int n)
+{
+	/* returns how many of n messages failed */
+	int i, failed = 0;
+	char value[32];
+	for (i = 0; i < n; i++) {
+		struct kafka_message *msg;
+		snprintf(value, sizeof value, "message %d", i);
+		msg = kafka_message_new(i % 2 ? "test" : "foobar", value);
+		if (kafka_producer_send(p, msg, KAFKA_REQUEST_SYNC) != KAFKA_OK)
+			failed++;
+		kafka_message_free(msg);
+	}
+	return failed;
+}
+
+static int
+scenario(struct mock_cluster *c, const char *name, int socket_timeout_ms)
+{
+	/* sends 100 messages, every one of which has to arrive exactly once */
+	struct kafka_producer *p;
+	uint64_t before = mock_cluster_messages(c);
+	int failed;
+
+	p = producer_new(c, socket_timeout_ms);
+	CHECK(kafka_producer_status(p) == KAFKA_OK);
+	failed = send_messages(p, 100);
+	kafka_producer_free(p);
+	if (failed || mock_cluster_messages(c) - before != 100) {
+		fprintf(stderr, "%s: %d failed, %llu arrived\n", name, failed,
+			(unsigned long long)(mock_cluster_messages(c) - before));
+		return -1;
+	}
+	return 0;
+}
+
+static int
+test_batch(struct mock_cluster *c)
+{
+	struct kafka_producer *p;
+	struct kafka_message_set *set;
+	uint64_t before = mock_cluster_messages(c);
+	int i;
+
+	p = producer_new(c, 1000);
+	CHECK(kafka_producer_status(p) == KAFKA_OK);
+	set = kafka_message_set_new();
+	for (i = 0; i < 50; i++)
+		kafka_message_set_append(set, kafka_keyed_message_new(
+				i % 3 ? "test" : "foobar", "key", "batched"));
+	CHECK(kafka_producer_send_batch(p, set, KAFKA_REQUEST_FULL_SYNC) == KAFKA_OK);
+	kafka_message_set_free(set);
+	kafka_producer_free(p);
+	CHECK(mock_cluster_messages(c) - before == 50);
+	return 0;
+}
+
+struct shared_send {
+	struct kafka_producer *p;
+	struct kafka_message *msg;
+	int failed;
+};
+
+static void *
+shared_sender(void *arg)
+{
+	struct shared_send *s = arg;
+	int i;
+	for (i = 0; i < 50; i++)
+		if (kafka_producer_send(s->p, s->msg, KAFKA_REQUEST_SYNC) != KAFKA_OK)
+			s->failed++;
+	return NULL;
+}
+
+static int
+test_shared_message(struct mock_cluster *c)
+{
+	/* one message object, sent by several threads at once */
+	struct shared_send sends[4];
+	pthread_t threads[4];
+	struct kafka_producer *p;
+	struct kafka_message *msg;
+	uint64_t before = mock_cluster_messages(c);
+	int i, failed = 0;
+
+	p = producer_new(c, 1000);
+	CHECK(kafka_producer_status(p) == KAFKA_OK);
+	msg = kafka_message_new("test", "shared");
+	for (i = 0; i < 4; i++) {
+		sends[i].p = p;
+		sends[i].msg = msg;
+		sends[i].failed = 0;
+		pthread_create(&threads[i], NULL, shared_sender, &sends[i]);
+	}
+	for (i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+		failed += sends[i].failed;
+	}
+	kafka_message_free(msg);
+	kafka_producer_free(p);
+	CHECK(failed == 0);
+	CHECK(mock_cluster_messages(c) - before == 200);
+	return 0;
+}
+
+static int
+test_sealed(struct mock_cluster *c)
+{
+	/* one sealed set, sent by two producers to two topics each */
+	struct kafka_producer *p1, *p2;
+	struct kafka_message_set *set;
+	struct kafka_message *late;
+	struct kafka_producer_stats stats;
+	uint64_t before = mock_cluster_messages(c);
+	int i;
+
+	p1 = producer_new(c, 1000);
+	p2 = producer_new(c, 1000);
+	CHECK(kafka_producer_status(p1) == KAFKA_OK);
+	CHECK(kafka_producer_status(p2) == KAFKA_OK);
+	set = kafka_message_set_new();
+	CHECK(kafka_message_set_seal(set) == -1);
+	for (i = 0; i < 30; i++)
+		kafka_message_set_append(set, kafka_keyed_message_new("ignored",
+				i % 2 ? "key" : NULL, "sealed"));
+	CHECK(kafka_producer_send_sealed(p1, "test", set, KAFKA_REQUEST_SYNC) == -1);
+	CHECK(kafka_message_set_seal(set) == 0);
+	late = kafka_message_new("test", "late");
+	CHECK(kafka_message_set_append(set, late) == 0);
+	kafka_message_free(late);
+	CHECK(kafka_producer_send_sealed(p1, "test", set, KAFKA_REQUEST_SYNC) == KAFKA_OK);
+	CHECK(kafka_producer_send_sealed(p1, "foobar", set, KAFKA_REQUEST_SYNC) == KAFKA_OK);
+	CHECK(kafka_producer_send_sealed(p1, "test", set, KAFKA_REQUEST_ASYNC) == KAFKA_OK);
+	CHECK(kafka_producer_send_sealed(p2, "test", set, KAFKA_REQUEST_SYNC) == KAFKA_OK);
+	CHECK(kafka_producer_send_sealed(p2, "no-such-topic", set,
+			KAFKA_REQUEST_SYNC) == KAFKA_UNKNOWN_TOPIC_OR_PARTITION);
+	kafka_producer_stats(p1, &stats);
+	kafka_producer_free(p1);
+	kafka_producer_free(p2);
+	kafka_message_set_free(set);
+	CHECK(stats.messages_acked == 60 && stats.messages_sent == 30);
+	CHECK(mock_cluster_messages(c) - before == 120);
+	return 0;
+}
+
+static int
+test_unknown_topic(struct mock_cluster *c)
+{
+	struct kafka_producer *p;
+	struct kafka_message *msg;
+
+	p = producer_new(c, 1000);
+	CHECK(kafka_producer_status(p) == KAFKA_OK);
+	msg = kafka_message_new("no-such-topic", "lost");
+	CHECK(kafka_producer_send(p, msg, KAFKA_REQUEST_SYNC) ==
+		KAFKA_UNKNOWN_TOPIC_OR_PARTITION);
+	kafka_message_free(msg);
+	kafka_producer_free(p);
+	return 0;
+}
+
+static int
+test_spool(struct mock_cluster *c)
+{
+	/**
+	 * With every produce failing, messages end up in the spool. The next
+	 * producer to open it delivers them once the brokers are back.
+	 */
+	char path[] = "/tmp/libkafka-spool-XXXXXX";
+	struct kafka_producer_config config;
+	struct kafka_producer_stats stats;
+	struct kafka_producer *p;
+	uint64_t before;
+	int fd, i, spooled = 0;
+
+	fd = mkstemp(path);
+	CHECK(fd != -1);
+	close(fd);
+	kafka_producer_config_init(&config);
+	config.brokers = mock_cluster_bootstrap(c);
+	config.retry_backoff_ms = 10;
+	config.retry_backoff_max_ms = 50;
+	config.max_retries = 1;
+	config.spool_path = path;
+
+	mock_cluster_fail_every(c, 1, KAFKA_NOT_LEADER_FOR_PARTITION);
+	p = kafka_producer_new_with_config(&config);
+	CHECK(kafka_producer_status(p) == KAFKA_OK);
+	for (i = 0; i < 20; i++) {
+		struct kafka_message *msg = kafka_message_new("test", "spooled");
+		if (kafka_producer_send(p, msg, KAFKA_REQUEST_SYNC) ==
+		    KAFKA_MESSAGE_SPOOLED)
+			spooled++;
+		kafka_message_free(msg);
+	}
+	kafka_producer_stats(p, &stats);
+	kafka_producer_free(p);
+	CHECK(spooled == 20);
+	CHECK(stats.messages_spooled == 20 && stats.spooled_bytes > 0);
+
+	before = mock_cluster_messages(c);
+	mock_cluster_fail_every(c, 0, 0);
+	p = kafka_producer_new_with_config(&config);
+	CHECK(kafka_producer_status(p) == KAFKA_OK);
+	for (i = 0; i < 500 && mock_cluster_messages(c) - before < 20; i++)
+		usleep(10000);
+	kafka_producer_stats(p, &stats);
+	kafka_producer_free(p);
+	unlink(path);
+	CHECK(mock_cluster_messages(c) - before == 20);
+	CHECK(stats.spooled_bytes == 0);
+	return 0;
+}
+
+static int
+test_wal(struct mock_cluster *c, int16_t sync)
+{
+	/**
+	 * Sends return once logged. Those the brokers turn down stay in the
+	 * log, ASYNC ones included, and reach the brokers through the next
+	 * producer to open it; acked ones leave it.
+	 */
+	char path[] = "/tmp/libkafka-wal-XXXXXX";
+	struct kafka_producer_config config;
+	struct kafka_producer_stats stats;
+	struct kafka_producer *p;
+	uint64_t before;
+	int fd, i, failed = 0;
+
+	fd = mkstemp(path);
+	CHECK(fd != -1);
+	close(fd);
+	kafka_producer_config_init(&config);
+	config.brokers = mock_cluster_bootstrap(c);
+	config.retry_backoff_ms = 10;
+	config.retry_backoff_max_ms = 50;
+	config.max_retries = 1;
+	config.wal_path = path;
+
+	before = mock_cluster_messages(c);
+	mock_cluster_fail_every(c, 1, KAFKA_NOT_LEADER_FOR_PARTITION);
+	p = kafka_producer_new_with_config(&config);
+	CHECK(kafka_producer_status(p) == KAFKA_OK);
+	for (i = 0; i < 20; i++) {
+		struct kafka_message *msg = kafka_message_new("test", "logged");
+		if (kafka_producer_send(p, msg, sync) != KAFKA_OK)
+			failed++;
+		kafka_message_free(msg);
+	}
+	kafka_producer_stats(p, &stats);
+	kafka_producer_free(p);
+	CHECK(failed == 0);
+	CHECK(stats.wal_bytes > 0);
+	CHECK(stats.messages_acked + stats.messages_failed <= stats.messages);
+	CHECK(mock_cluster_messages(c) == before);
+
+	mock_cluster_fail_every(c, 0, 0);
+	p = kafka_producer_new_with_config(&config);
+	CHECK(kafka_producer_status(p) == KAFKA_OK);
+	for (i = 0; i < 500 && mock_cluster_messages(c) - before < 20; i++)
+		usleep(10000);
+	CHECK(mock_cluster_messages(c) - before == 20);
+	CHECK(send_messages(p, 50) == 0);
+	for (i = 0; i < 500; i++) {
+		kafka_producer_stats(p, &stats);
+		if (stats.wal_bytes == 0)
+			break;
+		usleep(10000);
+	}
+	kafka_producer_free(p);
+	unlink(path);
+	CHECK(stats.wal_bytes == 0);
+	CHECK(stats.messages_replayed == 20 && stats.messages_acked == 50);
+	CHECK(stats.queued_messages == 0);
+	CHECK(mock_cluster_messages(c) - before == 70);
+	return 0;
+}
+
+static int
+test_failover(struct mock_cluster *c)
+{
+	/* leadership moves between two sends of the same producer */
+	struct kafka_producer *p;
+	uint64_t before = mock_cluster_messages(c);
+
+	p = producer_new(c, 1000);
+	CHECK(kafka_producer_status(p) == KAFKA_OK);
+	CHECK(send_messages(p, 50) == 0);
+	CHECK(mock_cluster_set_leader(c, "test", 0, 2) == 0);
+	CHECK(mock_cluster_set_leader(c, "test", 1, 0) == 0);
+	CHECK(mock_cluster_set_leader(c, "foobar", 0, 1) == 0);
+	CHECK(mock_cluster_set_leader(c, "foobar", 1, 2) == 0);
+	CHECK(send_messages(p, 50) == 0);
+	kafka_producer_free(p);
+	CHECK(mock_cluster_messages(c) - before == 100);
+	return 0;
+}
+
+int main(void)
+{
+	int rc = 0;
+	struct mock_cluster *c;
+
+	c = mock_cluster_new(3, "test:4,foobar:2");
+	if (!c) {
+		fprintf(stderr, "cannot start mock brokers\n");
+		return -1;
+	}
+
+	rc |= scenario(c, "plain", 1000);
+	rc |= test_batch(c);
+	rc |= test_sealed(c);
+	rc |= test_shared_message(c);
+	rc |= test_unknown_topic(c);
+
+	mock_cluster_fail_every(c, 3, KAFKA_NOT_LEADER_FOR_PARTITION);
+	rc |= scenario(c, "not leader", 1000);
+	mock_cluster_fail_every(c, 0, 0);
+
+	mock_cluster_set_chunk(c, 3);
+	rc |= scenario(c, "short reads", 1000);
+	mock_cluster_set_chunk(c, 0);
+
+	mock_cluster_drop_every(c, 7);
+	rc |= scenario(c, "timeouts", 200);
+	mock_cluster_drop_every(c, 0);
+
+	rc |= test_spool(c);
+	rc |= test_wal(c, KAFKA_REQUEST_SYNC);
+	rc |= test_wal(c, KAFKA_REQUEST_ASYNC);
+
+	mock_cluster_set_latency(c, 2);
+	rc |= test_failover(c);
+
+	if (mock_cluster_bad_crcs(c) != 0) {
+		fprintf(stderr, "%llu messages with bad CRCs\n",
+			(unsigned long long)mock_cluster_bad_crcs(c));
+		rc = -1;
+	}
+	mock_cluster_free(c);
+	return rc;
+}
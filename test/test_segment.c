@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2013, David Reynolds <david@alwaysmovefast.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kafka-private.h"
+
+/**
+ * Runs segments round the end of their file while older records are
+ * still in use, and checks what comes back once they are opened again.
+ */
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+		return -1; \
+	} \
+} while (0)
+
+static int64_t
+append(segment_t *s, const char *topic, int32_t partition, const char *value,
+	int state)
+{
+	/* appends one message as one record */
+	struct kafka_message *msg = kafka_message_new(topic, value);
+	struct msgvec vec;
+	unsigned records;
+	int64_t pos;
+
+	msg->partition = partition;
+	msgvec_init(&vec);
+	msgvec_push_back(&vec, msg);
+	pos = segment_append(s, &vec, state, &records);
+	msgvec_destroy(&vec);
+	kafka_message_free(msg);
+	return pos;
+}
+
+static int
+test_wrap(const char *path)
+{
+	/**
+	 * A record held halfway down the file while records done as soon
+	 * as they are appended run on past the end of the file: the tail
+	 * has to wrap round to the space in front of the held record.
+	 */
+	segment_t s;
+	segment_record_t rec;
+	char value[300];
+	int64_t held = -1, pos = -1;
+	int i, n;
+
+	unlink(path);
+	CHECK(segment_open(&s, path, 0) == 0);
+	memset(value, 'x', sizeof value - 1);
+	value[sizeof value - 1] = '\0';
+	/* one file's worth of values is more than a file of records */
+	n = s.size / sizeof value;
+	for (i = 0; i < n; i++) {
+		if (i == n / 2) {
+			held = append(&s, "held", 3, "keep me", SEGMENT_HELD);
+			CHECK(held >= 0);
+		}
+		pos = append(&s, "test", i % 4, value, SEGMENT_PENDING);
+		CHECK(pos >= 0);
+		CHECK(segment_next_pending(&s, 0, &rec) == 1);
+		CHECK(rec.pos == (uint64_t)pos && rec.partition == i % 4);
+		segment_done(&s, rec.pos, 1);
+	}
+	/* past the end of the file, so at the front of it */
+	CHECK((uint64_t)pos > s.size);
+	CHECK(segment_pending(&s) == 0);
+	CHECK(segment_used(&s) < s.size);
+
+	/* with nothing done, the file does fill up, and takes no more */
+	for (i = 0; append(&s, "test", 0, value, SEGMENT_PENDING) >= 0; i++)
+		;
+	CHECK(i > 0 && segment_pending(&s) == (unsigned)i);
+
+	/* the held record comes through intact, and so do the others */
+	segment_release(&s, held, 1);
+	segment_close(&s);
+	CHECK(segment_open(&s, path, 0) == 0);
+	CHECK(segment_pending(&s) == (unsigned)i + 1);
+	CHECK(segment_next_pending(&s, 0, &rec) == 1);
+	CHECK(rec.pos == (uint64_t)held && rec.partition == 3 && rec.count == 1);
+	CHECK(rec.topic_len == 4 && memcmp(rec.topic, "held", 4) == 0);
+	for (pos = 0; segment_next_pending(&s, pos, &rec) == 1; pos = rec.next) {
+		CHECK(rec.partition == (rec.pos == (uint64_t)held ? 3 : 0));
+		segment_done(&s, rec.pos, 1);
+		i--;
+	}
+	CHECK(i == -1 && segment_pending(&s) == 0 && segment_used(&s) == 0);
+	CHECK(append(&s, "test", 0, value, SEGMENT_PENDING) >= 0);
+	segment_close(&s);
+	unlink(path);
+	return 0;
+}
+
+static int
+test_torn(const char *path)
+{
+	/* a record torn after the file wrapped is cut off, the rest kept */
+	segment_t s;
+	segment_record_t rec;
+	char value[1000];
+	int64_t pos, last = -1;
+	int i;
+
+	unlink(path);
+	CHECK(segment_open(&s, path, 0) == 0);
+	memset(value, 'y', sizeof value - 1);
+	value[sizeof value - 1] = '\0';
+	for (i = 0; i < 3; i++)
+		CHECK(append(&s, "test", 0, value, SEGMENT_PENDING) >= 0);
+	CHECK(segment_next_pending(&s, 0, &rec) == 1);
+	segment_done(&s, rec.pos, 1);
+	CHECK(segment_next_pending(&s, rec.next, &rec) == 1);
+	segment_done(&s, rec.pos, 1);
+	for (i = 0; i < 3 && (pos = append(&s, "test", 1, value,
+			SEGMENT_PENDING)) >= 0; i++)
+		last = pos;
+	/* past the end of the file, so at the front of it */
+	CHECK(last >= 0 && (uint64_t)last > s.size);
+	/* scribble over the last record's payload */
+	CHECK(segment_next_pending(&s, last, &rec) == 1);
+	rec.messages[0] ^= 0xff;
+	segment_close(&s);
+
+	CHECK(segment_open(&s, path, 0) == 0);
+	/* the third record, and those after the wrap but the last */
+	CHECK(segment_pending(&s) == 1 + (unsigned)i - 1);
+	for (pos = 0; segment_next_pending(&s, pos, &rec) == 1; pos = rec.next)
+		CHECK(rec.pos < (uint64_t)last);
+	segment_close(&s);
+	unlink(path);
+	return 0;
+}
+
+int main(void)
+{
+	char path[64];
+	int rc = 0;
+
+	snprintf(path, sizeof path, "/tmp/test_segment.%d", (int)getpid());
+	rc |= test_wrap(path);
+	rc |= test_torn(path);
+	return rc;
+}